@@ -0,0 +1,301 @@
+/* Copyright (c) 2007 Scott Lembcke
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Headless benchmark runner for the scenes in demo/Bench.c.
+// Runs each scene on cpSpace and on cpHastySpace for each requested thread count and tree update mode and prints the results as JSON.
+//
+// Usage: chipmunk_bench [-steps N] [-threads 1,2,4] [-tree-update reinsert,refit] [-scene name] [-no-space] [-no-hasty]
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef _WIN32
+	#include <windows.h>
+#else
+	#include <time.h>
+#endif
+
+#include "chipmunk/chipmunk.h"
+#include "chipmunk/cpHastySpace.h"
+#include "ChipmunkDemo.h"
+
+#define MAX_THREAD_COUNTS 16
+
+static const char *TreeUpdateModeNames[] = {"reinsert", "refit"};
+#define TREE_UPDATE_MODE_COUNT (sizeof(TreeUpdateModeNames)/sizeof(*TreeUpdateModeNames))
+
+#if CP_STEP_STATS
+	#define STEP_STATS_ENABLED "true"
+#else
+	#define STEP_STATS_ENABLED "false"
+#endif
+
+extern ChipmunkDemo bench_list[];
+extern int bench_count;
+
+extern cpBool BenchUseHasty;
+extern unsigned long BenchHastyThreads;
+
+//MARK: Demo Support
+
+// Bench.c is shared with the demo app, these replace the parts of ChipmunkDemo.c that it uses.
+
+void ChipmunkDemoDefaultDrawImpl(cpSpace *space){}
+
+static void ShapeFreeWrap(cpSpace *space, cpShape *shape, void *unused){
+	cpSpaceRemoveShape(space, shape);
+	cpShapeFree(shape);
+}
+
+static void PostShapeFree(cpShape *shape, cpSpace *space){
+	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)ShapeFreeWrap, shape, NULL);
+}
+
+static void ConstraintFreeWrap(cpSpace *space, cpConstraint *constraint, void *unused){
+	cpSpaceRemoveConstraint(space, constraint);
+	cpConstraintFree(constraint);
+}
+
+static void PostConstraintFree(cpConstraint *constraint, cpSpace *space){
+	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)ConstraintFreeWrap, constraint, NULL);
+}
+
+static void BodyFreeWrap(cpSpace *space, cpBody *body, void *unused){
+	cpSpaceRemoveBody(space, body);
+	cpBodyFree(body);
+}
+
+static void PostBodyFree(cpBody *body, cpSpace *space){
+	cpSpaceAddPostStepCallback(space, (cpPostStepFunc)BodyFreeWrap, body, NULL);
+}
+
+void
+ChipmunkDemoFreeSpaceChildren(cpSpace *space)
+{
+	// Must remove these BEFORE freeing the body or you will access dangling pointers.
+	cpSpaceEachShape(space, (cpSpaceShapeIteratorFunc)PostShapeFree, space);
+	cpSpaceEachConstraint(space, (cpSpaceConstraintIteratorFunc)PostConstraintFree, space);
+	
+	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)PostBodyFree, space);
+}
+
+//MARK: Timing
+
+// Monotonic wall clock time in seconds.
+static double
+GetTime(void)
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency, counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	return (double)counter.QuadPart/(double)frequency.QuadPart;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (double)time.tv_sec + (double)time.tv_nsec*1e-9;
+#endif
+}
+
+static int
+CompareTimes(const void *a, const void *b)
+{
+	double ta = *(const double *)a, tb = *(const double *)b;
+	return (ta > tb) - (ta < tb);
+}
+
+// Nearest rank percentile of a sorted array.
+static double
+Percentile(double *sorted, int count, double percent)
+{
+	int rank = (int)(percent/100.0*count + 0.5);
+	if(rank < 1) rank = 1;
+	if(rank > count) rank = count;
+	return sorted[rank - 1];
+}
+
+//MARK: Benchmarks
+
+static void
+RunBenchmark(ChipmunkDemo *bench, cpBool hasty, unsigned long threads, cpBBTreeUpdateMode mode, int steps, double *times, cpBool first)
+{
+	BenchUseHasty = hasty;
+	BenchHastyThreads = threads;
+	
+	// Use the same random scene for every run.
+	srand(1);
+	cpSpace *space = bench->initFunc();
+	cpSpaceSetTreeUpdateMode(space, mode);
+	
+#if CP_STEP_STATS
+	cpSpaceStepStats phases = {0};
+#endif
+	
+	double start = GetTime();
+	for(int i=0; i<steps; i++){
+		double step_start = GetTime();
+		bench->updateFunc(space, bench->timestep);
+		times[i] = GetTime() - step_start;
+		
+#if CP_STEP_STATS
+		cpSpaceStepStats stats = cpSpaceGetStepStats(space);
+		phases.integratePositions += stats.integratePositions;
+		phases.updateBBs += stats.updateBBs;
+		phases.reindexQuery += stats.reindexQuery;
+		phases.narrowPhase += stats.narrowPhase;
+		phases.processComponents += stats.processComponents;
+		phases.arbiterFilter += stats.arbiterFilter;
+		phases.preStep += stats.preStep;
+		phases.integrateVelocities += stats.integrateVelocities;
+		phases.warmStart += stats.warmStart;
+		phases.solve += stats.solve;
+		phases.callbacks += stats.callbacks;
+#endif
+	}
+	double elapsed = GetTime() - start;
+	
+	// Report the actual thread count when it was picked automatically.
+	if(hasty) threads = cpHastySpaceGetThreads(space);
+	bench->destroyFunc(space);
+	
+	qsort(times, steps, sizeof(double), CompareTimes);
+	double mean = 0.0;
+	for(int i=0; i<steps; i++) mean += times[i];
+	mean /= steps;
+	
+	// Skip the "benchmark - " prefix of the demo names.
+	const char *name = strchr(bench->name, '-');
+	name = (name ? name + 2 : bench->name);
+	
+	printf("%s\n\t\t{\"scene\": \"%s\", \"space\": \"%s\", \"threads\": %lu, \"tree_update\": \"%s\", ", (first ? "" : ","), name, (hasty ? "cpHastySpace" : "cpSpace"), threads, TreeUpdateModeNames[mode]);
+	printf("\"steps_per_sec\": %.2f, \"mean_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f",
+		steps/elapsed, mean*1e6, Percentile(times, steps, 50.0)*1e6, Percentile(times, steps, 90.0)*1e6, Percentile(times, steps, 99.0)*1e6, times[steps - 1]*1e6
+	);
+	
+#if CP_STEP_STATS
+	// Mean time spent in each phase per step.
+	double scale = 1e-3/steps;
+	printf(", \"phases_us\": {\"integratePositions\": %.2f, \"updateBBs\": %.2f, \"reindexQuery\": %.2f, \"narrowPhase\": %.2f, ",
+		phases.integratePositions*scale, phases.updateBBs*scale, phases.reindexQuery*scale, phases.narrowPhase*scale
+	);
+	printf("\"processComponents\": %.2f, \"arbiterFilter\": %.2f, \"preStep\": %.2f, \"integrateVelocities\": %.2f, ",
+		phases.processComponents*scale, phases.arbiterFilter*scale, phases.preStep*scale, phases.integrateVelocities*scale
+	);
+	printf("\"warmStart\": %.2f, \"solve\": %.2f, \"callbacks\": %.2f}",
+		phases.warmStart*scale, phases.solve*scale, phases.callbacks*scale
+	);
+#endif
+	
+	printf("}");
+	fflush(stdout);
+}
+
+static void
+Usage(const char *exe)
+{
+	fprintf(stderr, "Usage: %s [-steps N] [-threads 1,2,4] [-tree-update reinsert,refit] [-scene name] [-no-space] [-no-hasty]\n", exe);
+	fprintf(stderr, "\t-steps N          Number of steps to run for each scene. (default 1000)\n");
+	fprintf(stderr, "\t-threads list     Comma separated cpHastySpace thread counts, 0 uses one thread per core. (default 1,0)\n");
+	fprintf(stderr, "\t-tree-update list Comma separated dynamic tree update modes, see cpBBTreeSetUpdateMode(). (default reinsert,refit)\n");
+	fprintf(stderr, "\t-scene name       Only run the scenes with names containing this string.\n");
+	fprintf(stderr, "\t-no-space         Don't run the scenes on cpSpace.\n");
+	fprintf(stderr, "\t-no-hasty         Don't run the scenes on cpHastySpace.\n");
+	exit(1);
+}
+
+int
+main(int argc, const char **argv)
+{
+	int steps = 1000;
+	unsigned long thread_counts[MAX_THREAD_COUNTS] = {1, 0};
+	int thread_count_num = 2;
+	cpBBTreeUpdateMode tree_update_modes[TREE_UPDATE_MODE_COUNT] = {CP_BBTREE_UPDATE_REINSERT, CP_BBTREE_UPDATE_REFIT};
+	int tree_update_mode_num = 2;
+	const char *scene = NULL;
+	cpBool run_space = cpTrue, run_hasty = cpTrue;
+	
+	for(int i=1; i<argc; i++){
+		if(strcmp(argv[i], "-steps") == 0 && i + 1 < argc){
+			steps = atoi(argv[++i]);
+			if(steps < 1) Usage(argv[0]);
+		} else if(strcmp(argv[i], "-threads") == 0 && i + 1 < argc){
+			thread_count_num = 0;
+			for(const char *str = argv[++i]; *str && thread_count_num < MAX_THREAD_COUNTS;){
+				char *end;
+				thread_counts[thread_count_num++] = strtoul(str, &end, 10);
+				if(end == str) Usage(argv[0]);
+				str = (*end == ',' ? end + 1 : end);
+			}
+		} else if(strcmp(argv[i], "-tree-update") == 0 && i + 1 < argc){
+			tree_update_mode_num = 0;
+			for(const char *str = argv[++i]; *str && tree_update_mode_num < (int)TREE_UPDATE_MODE_COUNT;){
+				size_t length = strcspn(str, ",");
+				
+				int mode = 0;
+				while(mode < (int)TREE_UPDATE_MODE_COUNT && !(strlen(TreeUpdateModeNames[mode]) == length && strncmp(str, TreeUpdateModeNames[mode], length) == 0)) mode++;
+				if(mode == TREE_UPDATE_MODE_COUNT) Usage(argv[0]);
+				
+				tree_update_modes[tree_update_mode_num++] = (cpBBTreeUpdateMode)mode;
+				str = (str[length] == ',' ? str + length + 1 : str + length);
+			}
+		} else if(strcmp(argv[i], "-scene") == 0 && i + 1 < argc){
+			scene = argv[++i];
+		} else if(strcmp(argv[i], "-no-space") == 0){
+			run_space = cpFalse;
+		} else if(strcmp(argv[i], "-no-hasty") == 0){
+			run_hasty = cpFalse;
+		} else {
+			Usage(argv[0]);
+		}
+	}
+	
+	double *times = (double *)cpcalloc(steps, sizeof(double));
+	cpBool first = cpTrue;
+	
+	printf("{\n\t\"version\": \"%s\",\n\t\"steps\": %d,\n\t\"step_stats\": %s,\n\t\"results\": [", cpVersionString, steps, STEP_STATS_ENABLED);
+	
+	for(int i=0; i<bench_count; i++){
+		ChipmunkDemo *bench = bench_list + i;
+		if(scene && !strstr(bench->name, scene)) continue;
+		
+		for(int k=0; k<tree_update_mode_num; k++){
+			cpBBTreeUpdateMode mode = tree_update_modes[k];
+			
+			if(run_space){
+				RunBenchmark(bench, cpFalse, 1, mode, steps, times, first);
+				first = cpFalse;
+			}
+			
+			if(run_hasty){
+				for(int j=0; j<thread_count_num; j++){
+					RunBenchmark(bench, cpTrue, thread_counts[j], mode, steps, times, first);
+					first = cpFalse;
+				}
+			}
+		}
+	}
+	
+	printf("\n\t]\n}\n");
+	
+	cpfree(times);
+	return 0;
+}
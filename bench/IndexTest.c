@@ -0,0 +1,410 @@
+/* Copyright (c) 2007 Scott Lembcke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Checks the spatial indexes against brute force.
+// Objects are randomly inserted, removed, moved and reindexed, and after each change
+// the pairs from cpSpatialIndexReindexQuery() and the results of cpSpatialIndexQuery() and cpSpatialIndexSegmentQuery()
+// are compared with the ones found by checking every object against every other.
+//
+// Exits with 0 if every index matches, or 1 if any of them don't.
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "chipmunk/chipmunk.h"
+
+#define STEPS 30
+#define QUERIES 20
+
+// Size of the area the objects are spread over.
+#define WORLD 1000.0
+
+typedef cpSpatialIndex *(*IndexNewFunc)(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+
+typedef struct IndexType {
+	const char *name;
+	IndexNewFunc create;
+	// Called on the static index after it's reindexed, like cpSpaceReindexStatic() does for trees.
+	void (*optimize)(cpSpatialIndex *index);
+	// cpSpatialIndexReindexObject() and cpSpatialIndexReindex() update the boxes right away,
+	// otherwise they are only updated by cpSpatialIndexReindexQuery().
+	cpBool reindexes;
+	// Works with infinite boxes, like the ones of static segments that run off to infinity.
+	cpBool infinite;
+} IndexType;
+
+typedef struct Object {
+	cpBB bb;
+	cpBool in;
+} Object;
+
+typedef struct Test {
+	const IndexType *type;
+	cpSpatialIndex *index, *staticIndex;
+
+	// The dynamic objects come first, followed by the static ones.
+	Object *objects;
+	int count, staticCount;
+
+	// How many times each object or pair of objects was reported.
+	int *hits;
+	const char *error;
+} Test;
+
+//MARK: Index Types
+
+static cpSpatialIndex *
+BBTreeRefitNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndex *index = cpBBTreeNew(bbfunc, staticIndex);
+	cpBBTreeSetUpdateMode(index, CP_BBTREE_UPDATE_REFIT);
+	// Rebuild the tree whenever it gets any worse.
+	cpBBTreeSetRefitRebuildRatio(index, 1.0);
+	return index;
+}
+
+static cpSpatialIndex *
+BBTreeFlatNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndex *index = cpBBTreeNew(bbfunc, staticIndex);
+	cpBBTreeSetFlatLayout(index, cpTrue);
+	return index;
+}
+
+static cpSpatialIndex *
+SpaceHashNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpSpaceHashNew(40.0, 1000, bbfunc, staticIndex);
+}
+
+static cpSpatialIndex *
+UniformGridNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	// Only covers the middle of the world so that some objects stick out of the bounds or are entirely outside of them.
+	return cpUniformGridNew(40.0, cpBBNew(0.25*WORLD, 0.25*WORLD, 0.75*WORLD, 0.75*WORLD), bbfunc, staticIndex);
+}
+
+static const IndexType types[] = {
+	{"bbtree", cpBBTreeNew, cpBBTreeOptimize, cpTrue, cpTrue},
+	{"bbtree refit", BBTreeRefitNew, cpBBTreeOptimize, cpTrue, cpTrue},
+	{"bbtree flat", BBTreeFlatNew, cpBBTreeOptimize, cpTrue, cpTrue},
+	{"spacehash", SpaceHashNew, NULL, cpTrue, cpFalse},
+	{"sweep1d", cpSweep1DNew, NULL, cpFalse, cpTrue},
+	{"sweep2d", cpSweep2DNew, NULL, cpTrue, cpTrue},
+	{"uniformgrid", UniformGridNew, NULL, cpTrue, cpTrue},
+};
+
+#define TYPE_COUNT (sizeof(types)/sizeof(*types))
+
+//MARK: Objects
+
+static cpFloat
+Random(cpFloat min, cpFloat max)
+{
+	return min + (max - min)*(cpFloat)rand()/(cpFloat)RAND_MAX;
+}
+
+static cpBB
+RandomBB(cpBool infinite)
+{
+	cpFloat size = Random(1.0, 60.0);
+	cpVect p = cpv(Random(0.0, WORLD), Random(0.0, WORLD));
+
+	if(infinite){
+		switch(rand()%32){
+			case 0: return cpBBNew(-INFINITY, -INFINITY, INFINITY, INFINITY);
+			case 1: return cpBBNew(-INFINITY, p.y, INFINITY, p.y + 1.0);
+			case 2: return cpBBNew(p.x, -INFINITY, p.x + 1.0, INFINITY);
+		}
+	}
+
+	// Some long thin boxes.
+	if(rand()%8 == 0) return cpBBNew(p.x, p.y, p.x + 4.0*size, p.y + 2.0);
+	return cpBBNew(p.x, p.y, p.x + size, p.y + size);
+}
+
+// Small moves keep the sorted indexes mostly sorted, and teleports make them rebuild.
+static cpBB
+MoveBB(cpBB bb, cpBool teleport, cpBool infinite)
+{
+	if(teleport) return RandomBB(infinite);
+
+	cpFloat dx = Random(-10.0, 10.0), dy = Random(-10.0, 10.0);
+	return cpBBNew(bb.l + dx, bb.b + dy, bb.r + dx, bb.t + dy);
+}
+
+static cpBB
+ObjectBB(Object *obj)
+{
+	return obj->bb;
+}
+
+static inline int
+ObjectIndex(Test *test, void *obj)
+{
+	return (int)((Object *)obj - test->objects);
+}
+
+static void
+Insert(Test *test, int i)
+{
+	cpSpatialIndex *index = (i < test->count ? test->index : test->staticIndex);
+	cpSpatialIndexInsert(index, test->objects + i, i);
+	test->objects[i].in = cpTrue;
+}
+
+static void
+Remove(Test *test, int i)
+{
+	cpSpatialIndexRemove(test->index, test->objects + i, i);
+	test->objects[i].in = cpFalse;
+}
+
+//MARK: Checks
+
+static void
+Fail(Test *test, const char *error)
+{
+	if(!test->error) test->error = error;
+}
+
+static cpCollisionID
+PairFunc(void *a, void *b, cpCollisionID id, Test *test)
+{
+	int i = ObjectIndex(test, a), j = ObjectIndex(test, b);
+	int total = test->count + test->staticCount;
+
+	if(i == j){
+		Fail(test, "an object was paired with itself");
+	} else if(i < 0 || i >= total || j < 0 || j >= total){
+		Fail(test, "an object that was never inserted was paired");
+	} else if(!test->objects[i].in || !test->objects[j].in){
+		Fail(test, "a removed object was paired");
+	} else if(i >= test->count && j >= test->count){
+		Fail(test, "two static objects were paired");
+	} else {
+		test->hits[(i < j ? i*total + j : j*total + i)]++;
+	}
+
+	return id;
+}
+
+static void
+CheckPairs(Test *test)
+{
+	int total = test->count + test->staticCount;
+	memset(test->hits, 0, total*total*sizeof(int));
+	cpSpatialIndexReindexQuery(test->index, (cpSpatialIndexQueryFunc)PairFunc, test);
+
+	for(int i=0; i<test->count; i++){
+		for(int j=i+1; j<total; j++){
+			Object *a = test->objects + i, *b = test->objects + j;
+			int hits = test->hits[i*total + j];
+
+			// Indexes may report pairs that don't overlap, but not the same pair twice.
+			if(hits > 1){
+				Fail(test, "a pair was reported more than once");
+			} else if(hits == 0 && a->in && b->in && cpBBIntersects(a->bb, b->bb)){
+				Fail(test, "an overlapping pair was missed");
+			}
+		}
+	}
+}
+
+static cpCollisionID
+QueryFunc(void *unused, void *obj, cpCollisionID id, Test *test)
+{
+	int i = ObjectIndex(test, obj);
+
+	if(i < 0 || i >= test->count){
+		Fail(test, "a query found an object that isn't in the index");
+	} else {
+		test->hits[i]++;
+	}
+
+	return id;
+}
+
+static cpFloat
+SegmentQueryFunc(void *unused, void *obj, Test *test)
+{
+	QueryFunc(unused, obj, 0, test);
+	return 1.0;
+}
+
+static void
+CheckQuery(Test *test, cpBB bb)
+{
+	memset(test->hits, 0, test->count*sizeof(int));
+	cpSpatialIndexQuery(test->index, NULL, bb, (cpSpatialIndexQueryFunc)QueryFunc, test);
+
+	// Trees keep the old bounds of objects that shrink in place, so indexes may report objects that don't overlap the box.
+	for(int i=0; i<test->count; i++){
+		Object *obj = test->objects + i;
+		int hits = test->hits[i];
+
+		if(hits > 1){
+			Fail(test, "a query found an object more than once");
+		} else if(hits == 1 && !obj->in){
+			Fail(test, "a query found a removed object");
+		} else if(hits == 0 && obj->in && cpBBIntersects(bb, obj->bb)){
+			Fail(test, "a query missed an object");
+		}
+	}
+}
+
+static void
+CheckSegmentQuery(Test *test, cpVect a, cpVect b)
+{
+	memset(test->hits, 0, test->count*sizeof(int));
+	cpSpatialIndexSegmentQuery(test->index, NULL, a, b, 1.0, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFunc, test);
+
+	// The callback does the exact test, so indexes may report objects the segment misses, but must report the ones it hits.
+	for(int i=0; i<test->count; i++){
+		Object *obj = test->objects + i;
+		int hits = test->hits[i];
+
+		if(hits > 1){
+			Fail(test, "a segment query found an object more than once");
+		} else if(hits == 1 && !obj->in){
+			Fail(test, "a segment query found a removed object");
+		} else if(hits == 0 && obj->in && cpBBSegmentQuery(obj->bb, a, b) < 1.0){
+			Fail(test, "a segment query missed an object");
+		}
+	}
+}
+
+static void
+CheckQueries(Test *test)
+{
+	int count = 0;
+	for(int i=0; i<test->count; i++) count += test->objects[i].in;
+	if(cpSpatialIndexCount(test->index) != count) Fail(test, "the count is wrong");
+
+	for(int i=0; i<test->count; i++){
+		Object *obj = test->objects + i;
+		if(cpSpatialIndexContains(test->index, obj, i) != obj->in) Fail(test, "contains is wrong");
+	}
+
+	if(test->type->infinite){
+		CheckQuery(test, cpBBNew(-INFINITY, -INFINITY, INFINITY, INFINITY));
+		CheckQuery(test, cpBBNew(-INFINITY, 0.5*WORLD, INFINITY, 0.5*WORLD));
+	}
+
+	for(int i=0; i<QUERIES; i++){
+		CheckQuery(test, RandomBB(cpFalse));
+		CheckSegmentQuery(test, cpv(Random(0.0, WORLD), Random(0.0, WORLD)), cpv(Random(0.0, WORLD), Random(0.0, WORLD)));
+	}
+}
+
+//MARK: Tests
+
+static const char *
+RunTest(const IndexType *type, int count, int staticCount)
+{
+	int total = count + staticCount;
+	Test test = {type, NULL, NULL, (Object *)calloc(total, sizeof(Object)), count, staticCount, (int *)calloc(total*total, sizeof(int)), NULL};
+
+	test.staticIndex = type->create((cpSpatialIndexBBFunc)ObjectBB, NULL);
+	test.index = type->create((cpSpatialIndexBBFunc)ObjectBB, test.staticIndex);
+
+	for(int i=0; i<total; i++){
+		test.objects[i].bb = RandomBB(type->infinite);
+		if(i >= count || rand()%4) Insert(&test, i);
+	}
+
+	cpSpatialIndexReindex(test.staticIndex);
+	if(type->optimize) type->optimize(test.staticIndex);
+
+	for(int step=0; step<STEPS && !test.error; step++){
+		// Change some of the objects one at a time.
+		for(int n=0; n<count/4 + 1; n++){
+			int i = rand()%count;
+			Object *obj = test.objects + i;
+
+			if(!obj->in){
+				obj->bb = RandomBB(type->infinite);
+				Insert(&test, i);
+			} else if(rand()%3 == 0){
+				Remove(&test, i);
+				// Reindexing an object that isn't in the index does nothing.
+				cpSpatialIndexReindexObject(test.index, obj, i);
+			} else if(type->reindexes){
+				obj->bb = MoveBB(obj->bb, rand()%2, type->infinite);
+				cpSpatialIndexReindexObject(test.index, obj, i);
+			}
+		}
+
+		CheckQueries(&test);
+
+		// Then move a lot of them at once.
+		cpBool teleport = (step%4 == 0);
+		for(int i=0; i<count; i++){
+			if(rand()%2) test.objects[i].bb = MoveBB(test.objects[i].bb, teleport, type->infinite);
+		}
+
+		if(step%3 == 0 && type->reindexes){
+			cpSpatialIndexReindex(test.index);
+			CheckQueries(&test);
+		}
+
+		CheckPairs(&test);
+		CheckQueries(&test);
+	}
+
+	cpSpatialIndexFree(test.index);
+	cpSpatialIndexFree(test.staticIndex);
+	free(test.objects);
+	free(test.hits);
+
+	return test.error;
+}
+
+// Odd counts that leave the 4 wide indexes with partly filled groups, and a few that are big enough to need rebuilding.
+static const int counts[] = {1, 2, 3, 5, 6, 7, 65, 300};
+
+#define COUNT_COUNT (sizeof(counts)/sizeof(*counts))
+
+int
+main(int argc, const char **argv)
+{
+	int failures = 0;
+	srand(1);
+
+	for(unsigned int i=0; i<TYPE_COUNT; i++){
+		const IndexType *type = types + i;
+		const char *error = NULL;
+
+		for(unsigned int j=0; j<COUNT_COUNT && !error; j++){
+			error = RunTest(type, counts[j], counts[j]/4 + 1);
+			if(error) printf("%s: %s with %d objects FAILED\n", type->name, error, counts[j]);
+		}
+
+		if(error){
+			failures++;
+		} else {
+			printf("%s: ok\n", type->name);
+		}
+	}
+
+	return (failures ? 1 : 0);
+}
@@ -0,0 +1,252 @@
+/* Copyright (c) 2007 Scott Lembcke
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+// Checks the SIMD contact solver of cpHastySpace against its scalar solver.
+// Each scene is stepped twice, once with each solver, and the bodies must end up in the same state within a tolerance.
+// The solvers round differently, and more so with -ffast-math, so the results aren't expected to be bit identical.
+//
+// Exits with 0 if the states match, 1 if they don't, or 77 if the CPU or build has no SIMD solver to test.
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "chipmunk/chipmunk.h"
+#include "chipmunk/cpHastySpace.h"
+
+#if CP_USE_DOUBLES
+	#define PRECISION "double"
+	#define TOLERANCE 1e-6
+#else
+	#define PRECISION "float"
+	#define TOLERANCE 2e-2
+#endif
+
+#define STEPS 60
+#define TIMESTEP (1.0/60.0)
+
+typedef void (*SceneFunc)(cpSpace *space);
+
+typedef struct Scene {
+	const char *name;
+	SceneFunc build;
+} Scene;
+
+//MARK: Scenes
+
+static void
+AddGround(cpSpace *space)
+{
+	cpBody *staticBody = cpSpaceGetStaticBody(space);
+	cpShape *shape;
+
+	shape = cpSpaceAddShape(space, cpSegmentShapeNew(staticBody, cpv(-400, 0), cpv(400, 0), 0));
+	cpShapeSetFriction(shape, 1.0);
+	shape = cpSpaceAddShape(space, cpSegmentShapeNew(staticBody, cpv(-400, 0), cpv(-400, 600), 0));
+	cpShapeSetFriction(shape, 1.0);
+	shape = cpSpaceAddShape(space, cpSegmentShapeNew(staticBody, cpv(400, 0), cpv(400, 600), 0));
+	cpShapeSetFriction(shape, 1.0);
+}
+
+static void
+AddBox(cpSpace *space, cpVect pos, cpFloat size, cpFloat radius)
+{
+	cpBody *body = cpSpaceAddBody(space, cpBodyNew(1.0, cpMomentForBox(1.0, size, size)));
+	cpBodySetPosition(body, pos);
+
+	cpShape *shape = cpSpaceAddShape(space, cpBoxShapeNew(body, size, size, radius));
+	cpShapeSetElasticity(shape, 0.0);
+	cpShapeSetFriction(shape, 0.8);
+}
+
+// Resting contacts with two contact points each.
+static void
+Pyramid(cpSpace *space)
+{
+	AddGround(space);
+
+	for(int row=0; row<20; row++){
+		for(int i=0; i<20 - row; i++){
+			AddBox(space, cpv((i - (20 - row)*0.5)*20.0 + 10.0, 10.0 + row*20.0), 20.0, 0.0);
+		}
+	}
+}
+
+// Falling bodies with a mix of one and two contact points.
+static void
+Pile(cpSpace *space)
+{
+	AddGround(space);
+
+	srand(1);
+	for(int i=0; i<300; i++){
+		cpVect pos = cpv((cpFloat)(rand()%700) - 350.0, 20.0 + (cpFloat)(rand()%500));
+
+		if(i%2){
+			AddBox(space, pos, 16.0, 1.0);
+		} else {
+			cpBody *body = cpSpaceAddBody(space, cpBodyNew(1.0, cpMomentForCircle(1.0, 0.0, 8.0, cpvzero)));
+			cpBodySetPosition(body, pos);
+
+			cpShape *shape = cpSpaceAddShape(space, cpCircleShapeNew(body, 8.0, cpvzero));
+			cpShapeSetElasticity(shape, 0.5);
+			cpShapeSetFriction(shape, 0.5);
+		}
+	}
+}
+
+// Contacts mixed with constraints, which are solved in the same colors.
+static void
+Chains(cpSpace *space)
+{
+	AddGround(space);
+	cpBody *staticBody = cpSpaceGetStaticBody(space);
+
+	for(int chain=0; chain<8; chain++){
+		cpBody *prev = staticBody;
+		cpVect anchor = cpv(-280.0 + chain*80.0, 500.0);
+
+		for(int link=0; link<20; link++){
+			cpVect pos = cpvadd(anchor, cpv(link*10.0, -link*5.0));
+			cpBody *body = cpSpaceAddBody(space, cpBodyNew(1.0, cpMomentForBox(1.0, 12.0, 6.0)));
+			cpBodySetPosition(body, pos);
+
+			cpShape *shape = cpSpaceAddShape(space, cpBoxShapeNew(body, 12.0, 6.0, 0.0));
+			cpShapeSetFriction(shape, 0.7);
+
+			cpSpaceAddConstraint(space, cpPivotJointNew(prev, body, cpvadd(pos, cpv(-5.0, 0.0))));
+			prev = body;
+		}
+	}
+
+	for(int i=0; i<40; i++) AddBox(space, cpv(-300.0 + i*15.0, 20.0), 14.0, 0.0);
+}
+
+static Scene scenes[] = {
+	{"pyramid", Pyramid},
+	{"pile", Pile},
+	{"chains", Chains},
+};
+
+#define SCENE_COUNT (sizeof(scenes)/sizeof(*scenes))
+
+//MARK: Comparison
+
+typedef struct BodyState {
+	cpVect p, v;
+	cpFloat a, w;
+} BodyState;
+
+typedef struct StateArray {
+	BodyState *states;
+	int count;
+} StateArray;
+
+static void
+CountBody(cpBody *body, int *count)
+{
+	(*count)++;
+}
+
+static void
+SaveBodyState(cpBody *body, StateArray *arr)
+{
+	BodyState state = {cpBodyGetPosition(body), cpBodyGetVelocity(body), cpBodyGetAngle(body), cpBodyGetAngularVelocity(body)};
+	arr->states[arr->count++] = state;
+}
+
+static StateArray
+RunScene(Scene *scene, cpBool wide)
+{
+	cpSpace *space = cpHastySpaceNew();
+	cpHastySpaceSetThreads(space, 1);
+	cpHastySpaceSetWideSolver(space, wide);
+	cpSpaceSetIterations(space, 10);
+	cpSpaceSetGravity(space, cpv(0.0, -100.0));
+
+	scene->build(space);
+	for(int i=0; i<STEPS; i++) cpHastySpaceStep(space, TIMESTEP);
+
+	int count = 0;
+	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)CountBody, &count);
+
+	// Bodies are iterated in the order they were added in both runs.
+	StateArray arr = {(BodyState *)calloc(count, sizeof(BodyState)), 0};
+	cpSpaceEachBody(space, (cpSpaceBodyIteratorFunc)SaveBodyState, &arr);
+
+	cpHastySpaceFree(space);
+	return arr;
+}
+
+// Relative error, but absolute near zero so that resting velocities don't fail on rounding noise.
+static cpFloat
+Error(cpFloat a, cpFloat b)
+{
+	return cpfabs(a - b)/cpfmax(1.0, cpfmax(cpfabs(a), cpfabs(b)));
+}
+
+static cpFloat
+StateError(BodyState a, BodyState b)
+{
+	cpFloat error = 0.0;
+	error = cpfmax(error, Error(a.p.x, b.p.x));
+	error = cpfmax(error, Error(a.p.y, b.p.y));
+	error = cpfmax(error, Error(a.v.x, b.v.x));
+	error = cpfmax(error, Error(a.v.y, b.v.y));
+	error = cpfmax(error, Error(a.a, b.a));
+	error = cpfmax(error, Error(a.w, b.w));
+	return error;
+}
+
+int
+main(int argc, const char **argv)
+{
+	cpSpace *probe = cpHastySpaceNew();
+	cpBool available = cpHastySpaceGetWideSolver(probe);
+	cpHastySpaceFree(probe);
+
+	if(!available){
+		printf("No SIMD solver in this build or on this CPU, skipping.\n");
+		return 77;
+	}
+
+	int failures = 0;
+	for(unsigned int i=0; i<SCENE_COUNT; i++){
+		Scene *scene = scenes + i;
+		StateArray scalar = RunScene(scene, cpFalse);
+		StateArray wide = RunScene(scene, cpTrue);
+
+		cpFloat maxError = 0.0;
+		if(scalar.count != wide.count){
+			maxError = INFINITY;
+		} else {
+			for(int j=0; j<scalar.count; j++) maxError = cpfmax(maxError, StateError(scalar.states[j], wide.states[j]));
+		}
+
+		cpBool pass = (maxError <= TOLERANCE);
+		printf("%s %s: %d bodies, max error %g (tolerance %g) %s\n", PRECISION, scene->name, scalar.count, (double)maxError, (double)TOLERANCE, (pass ? "ok" : "FAILED"));
+		if(!pass) failures++;
+
+		free(scalar.states);
+		free(wide.states);
+	}
+
+	return (failures ? 1 : 0);
+}
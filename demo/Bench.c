@@ -2,24 +2,40 @@
 #include "chipmunk/chipmunk_unsafe.h"
 #include "ChipmunkDemo.h"
 
+#include "chipmunk/cpHastySpace.h"
+
 #define ENABLE_HASTY 0
-#if ENABLE_HASTY
-	#include "chipmunk/cpHastySpace.h"
-	
-	static cpSpace *MakeHastySpace(){
+
+// Space type used to run the benchmarks. The headless benchmark runner toggles these between scenes.
+cpBool BenchUseHasty = ENABLE_HASTY;
+// Thread count passed to cpHastySpaceSetThreads(). 0 picks one thread per core.
+unsigned long BenchHastyThreads = 0;
+
+static cpSpace *BenchSpaceNew(){
+	if(BenchUseHasty){
 		cpSpace *space = cpHastySpaceNew();
-		cpHastySpaceSetThreads(space, 0);
+		cpHastySpaceSetThreads(space, BenchHastyThreads);
 		return space;
+	} else {
+		return cpSpaceNew();
 	}
-	
-	#define BENCH_SPACE_NEW MakeHastySpace
-	#define BENCH_SPACE_FREE cpHastySpaceFree
-	#define BENCH_SPACE_STEP cpHastySpaceStep
-#else
-	#define BENCH_SPACE_NEW cpSpaceNew
-	#define BENCH_SPACE_FREE cpSpaceFree
-	#define BENCH_SPACE_STEP cpSpaceStep
-#endif
+}
+
+static void BenchSpaceFree(cpSpace *space){
+	if(BenchUseHasty){
+		cpHastySpaceFree(space);
+	} else {
+		cpSpaceFree(space);
+	}
+}
+
+static void BenchSpaceStep(cpSpace *space, cpFloat dt){
+	if(BenchUseHasty){
+		cpHastySpaceStep(space, dt);
+	} else {
+		cpSpaceStep(space, dt);
+	}
+}
 
 const cpFloat bevel = 1.0;
 
@@ -80,7 +96,7 @@ static void add_hexagon(cpSpace *space, int index, cpFloat radius){
 
 static cpSpace *
 SetupSpace_simpleTerrain(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -215,7 +231,7 @@ static cpVect complex_terrain_verts[] = {
 static int complex_terrain_count = sizeof(complex_terrain_verts)/sizeof(cpVect);
 
 static cpSpace *init_ComplexTerrainCircles_1000(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -240,7 +256,7 @@ static cpSpace *init_ComplexTerrainCircles_1000(){
 }
 
 static cpSpace *init_ComplexTerrainHexagons_1000(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	cpSpaceSetGravity(space, cpv(0, -100));
 	cpSpaceSetCollisionSlop(space, 0.5f);
@@ -320,7 +336,7 @@ static cpVect bouncy_terrain_verts[] = {
 static int bouncy_terrain_count = sizeof(bouncy_terrain_verts)/sizeof(cpVect);
 
 static cpSpace *init_BouncyTerrainCircles_500(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpVect offset = cpv(-320, -240);
@@ -345,7 +361,7 @@ static cpSpace *init_BouncyTerrainCircles_500(){
 }
 
 static cpSpace *init_BouncyTerrainHexagons_500(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpVect offset = cpv(-320, -240);
@@ -386,7 +402,7 @@ static cpBool NoCollide_begin(cpArbiter *arb, cpSpace *space, void *data){
 
 
 static cpSpace *init_NoCollide(){
-	cpSpace *space = BENCH_SPACE_NEW();
+	cpSpace *space = BenchSpaceNew();
 	cpSpaceSetIterations(space, 10);
 	
 	cpCollisionHandler *handler = cpSpaceAddCollisionHandler(space, 2, 2);
@@ -440,12 +456,12 @@ static cpSpace *init_NoCollide(){
 
 // Build benchmark list
 static void update(cpSpace *space, double dt){
-	BENCH_SPACE_STEP(space, dt);
+	BenchSpaceStep(space, dt);
 }
 
 static void destroy(cpSpace *space){
 	ChipmunkDemoFreeSpaceChildren(space);
-	BENCH_SPACE_FREE(space);
+	BenchSpaceFree(space);
 }
 
 // Make a second demo declaration for this demo to use in the regular demo set.
@@ -82,6 +82,62 @@ CP_EXPORT void cpMessage(const char *condition, const char *file, int line, int
 	#define cpfree free
 #endif
 
+typedef struct cpAllocator cpAllocator;
+
+/// Memory allocation callbacks a space can use instead of cpcalloc(), cprealloc() and cpfree(), see cpSpaceNewWithAllocator().
+/// The functions are passed the allocator itself, so it can be the first member of a struct that holds the allocator's state.
+struct cpAllocator {
+	/// Works like calloc().
+	void *(*callocFunc)(cpAllocator *allocator, size_t count, size_t size);
+	/// Works like realloc(), including being passed NULL.
+	void *(*reallocFunc)(cpAllocator *allocator, void *ptr, size_t size);
+	/// Works like free(), including being passed NULL.
+	void (*freeFunc)(cpAllocator *allocator, void *ptr);
+};
+
+/// Allocate zeroed memory using @c allocator, or cpcalloc() if it's NULL.
+static inline void *
+cpAllocatorCalloc(cpAllocator *allocator, size_t count, size_t size)
+{
+	return (allocator ? allocator->callocFunc(allocator, count, size) : cpcalloc(count, size));
+}
+
+/// Reallocate memory using @c allocator, or cprealloc() if it's NULL.
+static inline void *
+cpAllocatorRealloc(cpAllocator *allocator, void *ptr, size_t size)
+{
+	return (allocator ? allocator->reallocFunc(allocator, ptr, size) : cprealloc(ptr, size));
+}
+
+/// Free memory using @c allocator, or cpfree() if it's NULL.
+static inline void
+cpAllocatorFree(cpAllocator *allocator, void *ptr)
+{
+	if(allocator){
+		allocator->freeFunc(allocator, ptr);
+	} else {
+		cpfree(ptr);
+	}
+}
+
+typedef struct cpArena cpArena;
+
+/// Allocate and initialize an arena that takes memory from cpcalloc() in chunks of at least @c chunkBytes, or 1 MB if it is 0.
+/// Freed memory is reused for later allocations of a similar size, and everything is returned at once by cpArenaFree().
+/// An arena is not thread safe. Give each space its own, a cpHastySpace only allocates from the thread that steps it.
+CP_EXPORT cpArena *cpArenaNew(size_t chunkBytes);
+/// Free an arena and all of the memory allocated from it.
+CP_EXPORT void cpArenaFree(cpArena *arena);
+/// Get the allocator that allocates from the arena.
+CP_EXPORT cpAllocator *cpArenaGetAllocator(cpArena *arena);
+/// Bytes of the arena's memory that are currently allocated, rounded up to the size classes the arena uses.
+CP_EXPORT size_t cpArenaGetBytesAllocated(cpArena *arena);
+/// Bytes of memory the arena has taken from cpcalloc().
+CP_EXPORT size_t cpArenaGetBytesReserved(cpArena *arena);
+/// Limit how many bytes the arena may take from cpcalloc(). 0 means no limit, which is the default.
+/// Going over the limit is a hard error, so check cpArenaGetBytesReserved() between steps to stop a world before it gets there.
+CP_EXPORT void cpArenaSetLimit(cpArena *arena, size_t limit);
+
 typedef struct cpArray cpArray;
 typedef struct cpHashSet cpHashSet;
 
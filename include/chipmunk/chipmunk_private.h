@@ -34,7 +34,7 @@
 
 //MARK: cpArray
 
-cpArray *cpArrayNew(int size);
+cpArray *cpArrayNew(int size, cpAllocator *allocator);
 
 void cpArrayFree(cpArray *arr);
 
@@ -44,6 +44,8 @@ void cpArrayDeleteObj(cpArray *arr, void *obj);
 cpBool cpArrayContains(cpArray *arr, void *ptr);
 
 void cpArrayFreeEach(cpArray *arr, void (freeFunc)(void*));
+// Free each element with the array's allocator.
+void cpArrayFreeElements(cpArray *arr);
 
 
 //MARK: cpHashSet
@@ -51,7 +53,7 @@ void cpArrayFreeEach(cpArray *arr, void (freeFunc)(void*));
 typedef cpBool (*cpHashSetEqlFunc)(void *ptr, void *elt);
 typedef void *(*cpHashSetTransFunc)(void *ptr, void *data);
 
-cpHashSet *cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc);
+cpHashSet *cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc, cpAllocator *allocator);
 void cpHashSetSetDefaultValue(cpHashSet *set, void *default_value);
 
 void cpHashSetFree(cpHashSet *set);
@@ -82,6 +84,7 @@ void cpBodyRemoveConstraint(cpBody *body, cpConstraint *constraint);
 //MARK: Spatial Index Functions
 
 cpSpatialIndex *cpSpatialIndexInit(cpSpatialIndex *index, cpSpatialIndexClass *klass, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+cpBool cpSpatialIndexIsBBTree(cpSpatialIndex *index);
 
 
 //MARK: Arbiters
@@ -162,6 +165,10 @@ void cpLoopIndexes(const cpVect *verts, int count, int *start, int *end);
 
 void cpConstraintInit(cpConstraint *constraint, const struct cpConstraintClass *klass, cpBody *a, cpBody *b);
 
+// True if the spring uses the default callback or one marked thread safe.
+cpBool cpDampedSpringPreStepThreadSafe(const cpConstraint *constraint);
+cpBool cpDampedRotarySpringPreStepThreadSafe(const cpConstraint *constraint);
+
 static inline void
 cpConstraintActivateBodies(cpConstraint *constraint)
 {
@@ -290,11 +297,35 @@ cpPostStepCallback *cpSpaceGetPostStepCallback(cpSpace *space, void *key);
 
 cpBool cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space);
 void cpSpaceFilterArbiters(cpSpace *space, cpBody *body, cpShape *filter);
+// Update noCollidePairs after adding, removing or changing collideBodies on a constraint between two bodies.
+void cpSpaceUpdateNoCollidePair(cpSpace *space, cpBody *a, cpBody *b);
 
 void cpSpaceActivateBody(cpSpace *space, cpBody *body);
 void cpSpaceLock(cpSpace *space);
 void cpSpaceUnlock(cpSpace *space, cpBool runPostStep);
 
+// The spatial index stores a handle to a pair's arbiter in place of its collision ID so the pair can skip looking it up in cachedArbiters.
+// The top bit tells handles apart from collision IDs, which only set it for polygons with more than 128 vertices.
+#define CP_ARBITER_HANDLE_TAG ((cpCollisionID)1<<31)
+
+// Handles only find the arbiter while it's in cachedArbiters.
+static inline void
+cpSpaceSetArbiterCached(cpSpace *space, cpArbiter *arb, cpBool cached)
+{
+	space->arbiterHandles->arr[arb->handle] = (cached ? arb : NULL);
+}
+
+// Returns the cached arbiter for the two shapes if the handle refers to it, or NULL.
+static inline cpArbiter *
+cpSpaceArbiterForHandle(cpSpace *space, const cpShape *a, const cpShape *b, cpCollisionID handle)
+{
+	unsigned int index = handle & ~CP_ARBITER_HANDLE_TAG;
+	if(!(handle & CP_ARBITER_HANDLE_TAG) || index >= (unsigned int)space->arbiterHandles->num) return NULL;
+	
+	cpArbiter *arb = (cpArbiter *)space->arbiterHandles->arr[index];
+	return (arb && ((arb->a == a && arb->b == b) || (arb->a == b && arb->b == a)) ? arb : NULL);
+}
+
 static inline void
 cpSpaceUncacheArbiter(cpSpace *space, cpArbiter *arb)
 {
@@ -303,6 +334,7 @@ cpSpaceUncacheArbiter(cpSpace *space, cpArbiter *arb)
 	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
 	cpHashSetRemove(space->cachedArbiters, arbHashID, shape_pair);
 	cpArrayDeleteObj(space->arbiters, arb);
+	cpSpaceSetArbiterCached(space, arb, cpFalse);
 }
 
 static inline cpArray *
@@ -314,6 +346,37 @@ cpSpaceArrayForBodyType(cpSpace *space, cpBodyType type)
 void cpShapeUpdateFunc(cpShape *shape, void *unused);
 cpCollisionID cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space);
 
+// The two halves of cpSpaceCollideShapes() for callers that run the narrow phase themselves.
+// Returns true if a pair of shapes from the broadphase can be skipped without calling cpCollide().
+cpBool cpSpaceQueryReject(cpShape *a, cpShape *b);
+// Update the arbiter and call the collision handlers for a pair of colliding shapes.
+// The contacts must be at the head of the space's contact buffer as returned by cpContactBufferGetArray().
+// Pass the shapes' arbiter if it's already known from cpSpaceArbiterForHandle(), otherwise NULL to look it up. Returns the arbiter.
+cpArbiter *cpSpaceProcessCollision(cpSpace *space, struct cpCollisionInfo *info, cpArbiter *arb);
+
+// Step statistics timers. They compile to nothing unless CP_STEP_STATS is enabled.
+// CP_STEP_STATS_START() resets the stats and starts the step timer, CP_STEP_STATS_MARK() starts a timer without resetting.
+// CP_STEP_STATS_LAP() adds the time since the last start or lap to a phase.
+#if CP_STEP_STATS
+	uint64_t cpStepStatsTime(void);
+	uint64_t cpStepStatsReset(cpSpace *space);
+	void cpStepStatsFinish(cpSpace *space, uint64_t start);
+	
+	#define CP_STEP_STATS_START(space) uint64_t cpStepStatsStart = cpStepStatsReset(space), cpStepStatsLap = cpStepStatsStart
+	#define CP_STEP_STATS_MARK() uint64_t cpStepStatsLap = cpStepStatsTime()
+	#define CP_STEP_STATS_LAP(space, phase) {uint64_t cpStepStatsNow = cpStepStatsTime(); (space)->stepStats.phase += cpStepStatsNow - cpStepStatsLap; cpStepStatsLap = cpStepStatsNow;}
+	#define CP_STEP_STATS_EXCLUDE(space, phase, nested) ((space)->stepStats.phase -= (space)->stepStats.nested)
+	#define CP_STEP_STATS_COUNT(space, counter, n) ((space)->stepStats.counter += (n))
+	#define CP_STEP_STATS_FINISH(space) cpStepStatsFinish(space, cpStepStatsStart)
+#else
+	#define CP_STEP_STATS_START(space)
+	#define CP_STEP_STATS_MARK()
+	#define CP_STEP_STATS_LAP(space, phase)
+	#define CP_STEP_STATS_EXCLUDE(space, phase, nested)
+	#define CP_STEP_STATS_COUNT(space, counter, n)
+	#define CP_STEP_STATS_FINISH(space)
+#endif
+
 
 //MARK: Foreach loops
 
@@ -30,12 +30,16 @@
 struct cpArray {
 	int num, max;
 	void **arr;
+	
+	cpAllocator *allocator;
 };
 
 struct cpBody {
 	// Integration functions
 	cpBodyVelocityFunc velocity_func;
 	cpBodyPositionFunc position_func;
+	// True if the integration functions are safe to call from several threads at once.
+	cpBool threadSafeFuncs;
 	
 	// mass and it's inverse
 	cpFloat m;
@@ -78,6 +82,10 @@ struct cpBody {
 		cpBody *next;
 		cpFloat idleTime;
 	} sleeping;
+	
+	// Index of the body in the space's dynamic body array.
+	// Only assigned by cpHastySpaceStep() for use by its solver.
+	int solverIndex;
 };
 
 enum cpArbiterState {
@@ -142,6 +150,11 @@ struct cpArbiter {
 	
 	cpTimestamp stamp;
 	enum cpArbiterState state;
+	
+	// Index of the arbiter in the space's arbiter handles, it never changes.
+	int handle;
+	// Collision ID from the last cpCollide() call on the shapes to warm start the next one.
+	cpCollisionID id;
 };
 
 struct cpShapeMassInfo {
@@ -325,6 +338,7 @@ struct cpDampedSpring {
 	cpFloat stiffness;
 	cpFloat damping;
 	cpDampedSpringForceFunc springForceFunc;
+	cpBool threadSafeFunc;
 	
 	cpFloat target_vrn;
 	cpFloat v_coef;
@@ -342,6 +356,7 @@ struct cpDampedRotarySpring {
 	cpFloat stiffness;
 	cpFloat damping;
 	cpDampedRotarySpringTorqueFunc springTorqueFunc;
+	cpBool threadSafeFunc;
 	
 	cpFloat target_wrn;
 	cpFloat w_coef;
@@ -406,6 +421,9 @@ struct cpSpace {
 	cpFloat collisionBias;
 	cpTimestamp collisionPersistence;
 	
+	int treeOptimizationPasses;
+	cpBBTreeUpdateMode treeUpdateMode;
+	
 	cpDataPointer userData;
 	
 	cpTimestamp stamp;
@@ -421,11 +439,15 @@ struct cpSpace {
 	cpSpatialIndex *dynamicShapes;
 	
 	cpArray *constraints;
+	// A constraint with collideBodies disabled for each pair of bodies that has one.
+	cpHashSet *noCollidePairs;
 	
 	cpArray *arbiters;
 	cpContactBufferHeader *contactBuffersHead;
 	cpHashSet *cachedArbiters;
 	cpArray *pooledArbiters;
+	// Every arbiter the space has allocated indexed by its handle, or NULL if the arbiter isn't cached.
+	cpArray *arbiterHandles;
 	
 	cpArray *allocatedBuffers;
 	unsigned int locked;
@@ -439,6 +461,11 @@ struct cpSpace {
 	
 	cpBody *staticBody;
 	cpBody _staticBody;
+	
+	cpSpaceStepStats stepStats;
+	
+	// Allocates the space's internal memory, or NULL to use cpcalloc() and friends.
+	cpAllocator *allocator;
 };
 
 typedef struct cpPostStepCallback {
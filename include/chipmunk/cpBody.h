@@ -143,6 +143,13 @@ CP_EXPORT void cpBodySetVelocityUpdateFunc(cpBody *body, cpBodyVelocityFunc velo
 /// NOTE: It's not generally recommended to override this unless you call the default position update function.
 CP_EXPORT void cpBodySetPositionUpdateFunc(cpBody *body, cpBodyPositionFunc positionFunc);
 
+/// Returns true if the body's custom velocity and position update functions are thread safe.
+CP_EXPORT cpBool cpBodyGetThreadSafeUpdateFuncs(const cpBody *body);
+/// Mark the body's custom velocity and position update functions as safe to call from worker threads.
+/// cpHastySpace integrates bodies in parallel, but calls custom update functions serially unless they are marked thread safe.
+/// The default update functions are always thread safe.
+CP_EXPORT void cpBodySetThreadSafeUpdateFuncs(cpBody *body, cpBool threadSafe);
+
 /// Default velocity integration function..
 CP_EXPORT void cpBodyUpdateVelocity(cpBody *body, cpVect gravity, cpFloat damping, cpFloat dt);
 /// Default position integration function.
@@ -55,4 +55,11 @@ CP_EXPORT cpDampedRotarySpringTorqueFunc cpDampedRotarySpringGetSpringTorqueFunc
 /// Set the damping of the spring.
 CP_EXPORT void cpDampedRotarySpringSetSpringTorqueFunc(cpConstraint *constraint, cpDampedRotarySpringTorqueFunc springTorqueFunc);
 
+/// Returns true if the spring's custom torque function is thread safe.
+CP_EXPORT cpBool cpDampedRotarySpringGetThreadSafeSpringTorqueFunc(const cpConstraint *constraint);
+/// Mark the spring's custom torque function as safe to call from worker threads.
+/// cpHastySpace pre-steps constraints in parallel, but pre-steps springs with custom torque functions serially unless they are marked thread safe.
+/// The default torque function is always thread safe.
+CP_EXPORT void cpDampedRotarySpringSetThreadSafeSpringTorqueFunc(cpConstraint *constraint, cpBool threadSafe);
+
 /// @}
@@ -65,4 +65,11 @@ CP_EXPORT cpDampedSpringForceFunc cpDampedSpringGetSpringForceFunc(const cpConst
 /// Set the damping of the spring.
 CP_EXPORT void cpDampedSpringSetSpringForceFunc(cpConstraint *constraint, cpDampedSpringForceFunc springForceFunc);
 
+/// Returns true if the spring's custom force function is thread safe.
+CP_EXPORT cpBool cpDampedSpringGetThreadSafeSpringForceFunc(const cpConstraint *constraint);
+/// Mark the spring's custom force function as safe to call from worker threads.
+/// cpHastySpace pre-steps constraints in parallel, but pre-steps springs with custom force functions serially unless they are marked thread safe.
+/// The default force function is always thread safe.
+CP_EXPORT void cpDampedSpringSetThreadSafeSpringForceFunc(cpConstraint *constraint, cpBool threadSafe);
+
 /// @}
@@ -8,20 +8,84 @@
 struct cpHastySpace;
 typedef struct cpHastySpace cpHastySpace;
 
+//MARK: Thread Pools
+
+/// A pool of persistent worker threads.
+/// Work is split into tasks that the threads steal from each other, so it scales to any number of cores.
+/// Idle workers spin briefly waiting for more work before they are parked.
+typedef struct cpHastyThreadPool cpHastyThreadPool;
+
+/// Task callback function type.
+/// @c task is the index of the task to run, and @c thread is the index of the thread running it (0 is the calling thread).
+typedef void (*cpHastyTaskFunc)(void *context, unsigned long task, unsigned long thread);
+
+/// Create a thread pool with the given number of threads (including the thread that submits work).
+/// Passing 0 will automatically detect the number of threads to use.
+CP_EXPORT cpHastyThreadPool *cpHastyThreadPoolNew(unsigned long threads);
+/// Stop the worker threads and free the pool.
+CP_EXPORT void cpHastyThreadPoolFree(cpHastyThreadPool *pool);
+/// Returns the number of threads in the pool (including the thread that submits work).
+CP_EXPORT unsigned long cpHastyThreadPoolGetThreads(cpHastyThreadPool *pool);
+/// Call @c func for each task in [0, count) using the pool, and wait for all of the tasks to finish.
+/// The calling thread runs tasks as well.
+CP_EXPORT void cpHastyThreadPoolRun(cpHastyThreadPool *pool, unsigned long count, cpHastyTaskFunc func, void *context);
+
+//MARK: Hasty Spaces
+
 /// Create a new hasty space.
 /// On ARM platforms that support NEON, this will enable the vectorized solver.
-/// cpHastySpace also supports multiple threads, but runs single threaded by default for determinism.
+/// On x86 it solves several contacts at once using SSE2 or AVX, whichever the CPU supports at runtime.
+/// Define CP_HASTY_NO_SIMD when building Chipmunk to always use the scalar x86 solver.
+/// cpHastySpace solves batches of contacts and constraints that share no dynamic bodies in parallel.
+/// The results are deterministic and don't depend on the number of threads, so it uses all of the cores by default.
 CP_EXPORT cpSpace *cpHastySpaceNew(void);
+/// Create a new hasty space that allocates itself and its internal memory using @c allocator, see cpSpaceNewWithAllocator().
+/// The solver's buffers come from the allocator too, but they are only allocated by the thread stepping the space.
+/// Thread pools can be shared between spaces, so they always use cpcalloc().
+/// Free the space with cpHastySpaceFree() before freeing the allocator's memory, which also stops the threads of the space's own pool.
+CP_EXPORT cpSpace *cpHastySpaceNewWithAllocator(cpAllocator *allocator);
 CP_EXPORT void cpHastySpaceFree(cpSpace *space);
 
 /// Set the number of threads to use for the solver.
-/// Currently Chipmunk is limited to 2 threads as using more generally provides very minimal performance gains.
-/// Passing 0 as the thread count on iOS or OS X will cause Chipmunk to automatically detect the number of threads it should use.
-/// On other platforms passing 0 for the thread count will set 1 thread.
+/// This creates a new thread pool that is owned by the space, replacing any pool set with cpHastySpaceSetThreadPool().
+/// Passing 0 as the thread count will cause Chipmunk to automatically detect the number of threads it should use.
 CP_EXPORT void cpHastySpaceSetThreads(cpSpace *space, unsigned long threads);
 
 /// Returns the number of threads the solver is using to run.
 CP_EXPORT unsigned long cpHastySpaceGetThreads(cpSpace *space);
 
+/// Use a thread pool that is shared with other spaces.
+/// The space does not take ownership of the pool. It must not be freed while a space is still using it.
+/// If the pool is busy running a job for a different space when this space steps, the work is run on the calling thread instead.
+/// Passing NULL reverts the space to a single threaded pool of its own.
+CP_EXPORT void cpHastySpaceSetThreadPool(cpSpace *space, cpHastyThreadPool *pool);
+/// Returns the thread pool the space is using.
+CP_EXPORT cpHastyThreadPool *cpHastySpaceGetThreadPool(cpSpace *space);
+
+/// Ways a hasty space can split up the work of solving its contacts and constraints between threads.
+typedef enum cpHastySolverMode {
+	/// Solve batches of contacts and constraints that share no dynamic bodies in parallel. (default)
+	/// Works well for any scene, including large piles of touching bodies.
+	CP_HASTY_SOLVER_COLORED,
+	/// Solve each island of connected bodies on its own thread.
+	/// Works best for scenes with many small disconnected groups such as stacks or vehicles.
+	/// Islands that are too big for a single thread are solved as in CP_HASTY_SOLVER_COLORED.
+	CP_HASTY_SOLVER_ISLANDS,
+} cpHastySolverMode;
+
+/// Set how the solver splits up its work between threads.
+CP_EXPORT void cpHastySpaceSetSolverMode(cpSpace *space, cpHastySolverMode mode);
+/// Returns how the solver splits up its work between threads.
+CP_EXPORT cpHastySolverMode cpHastySpaceGetSolverMode(cpSpace *space);
+
+/// Enable or disable the SIMD contact solver on CPUs that have one. Enabled by default.
+/// Results only differ from the scalar solver by rounding, so this is mostly useful for testing the two against each other.
+CP_EXPORT void cpHastySpaceSetWideSolver(cpSpace *space, cpBool enabled);
+/// Returns true if the space solves contacts using the SIMD solver.
+CP_EXPORT cpBool cpHastySpaceGetWideSolver(cpSpace *space);
+
 /// When stepping a hasty space, you must use this function.
 CP_EXPORT void cpHastySpaceStep(cpSpace *space, cpFloat dt);
+
+/// Same as cpSpaceReindexStatic(), but rebuilds the static tree using the space's threads.
+CP_EXPORT void cpHastySpaceReindexStatic(cpSpace *space);
@@ -70,6 +70,16 @@ CP_EXPORT cpSpace* cpSpaceAlloc(void);
 CP_EXPORT cpSpace* cpSpaceInit(cpSpace *space);
 /// Allocate and initialize a cpSpace.
 CP_EXPORT cpSpace* cpSpaceNew(void);
+/// Initialize a cpSpace that allocates its internal memory using @c allocator.
+/// cpSpaceFree() frees the space itself using the allocator too, so it should be allocated from it.
+CP_EXPORT cpSpace* cpSpaceInitWithAllocator(cpSpace *space, cpAllocator *allocator);
+/// Allocate and initialize a cpSpace that allocates itself and its internal memory using @c allocator.
+/// The space's spatial indexes, collision pairs, contacts and buffers all come from the allocator.
+/// Bodies, shapes and constraints are allocated by you. Place them in the allocator's memory with cpAllocatorCalloc() and the *Init() functions,
+/// and a space using an arena can be torn down along with everything in it by a single call to cpArenaFree().
+/// There are two exceptions. Polygons with more than CP_POLY_SHAPE_INLINE_ALLOC vertices allocate their planes with cpcalloc(),
+/// so call cpShapeDestroy() on them first. A cpHastySpace runs worker threads, so free it with cpHastySpaceFree() first.
+CP_EXPORT cpSpace* cpSpaceNewWithAllocator(cpAllocator *allocator);
 
 /// Destroy a cpSpace.
 CP_EXPORT void cpSpaceDestroy(cpSpace *space);
@@ -123,12 +133,26 @@ CP_EXPORT void cpSpaceSetCollisionBias(cpSpace *space, cpFloat collisionBias);
 CP_EXPORT cpTimestamp cpSpaceGetCollisionPersistence(const cpSpace *space);
 CP_EXPORT void cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence);
 
+/// Number of incremental optimization passes to run on the dynamic shape tree each step.
+/// Keeps the query cost of the tree from degrading in long running spaces with a lot of moving objects.
+/// See cpBBTreeOptimizeIncremental(). Defaults to 0. Ignored when using a spatial hash.
+CP_EXPORT int cpSpaceGetTreeOptimizationPasses(const cpSpace *space);
+CP_EXPORT void cpSpaceSetTreeOptimizationPasses(cpSpace *space, int passes);
+
+/// How the dynamic shape tree handles shapes that move outside of their bounds.
+/// See cpBBTreeSetUpdateMode(). Defaults to CP_BBTREE_UPDATE_REINSERT. Ignored when using a spatial hash.
+CP_EXPORT cpBBTreeUpdateMode cpSpaceGetTreeUpdateMode(const cpSpace *space);
+CP_EXPORT void cpSpaceSetTreeUpdateMode(cpSpace *space, cpBBTreeUpdateMode mode);
+
 /// User definable data pointer.
 /// Generally this points to your game's controller or game state
 /// class so you can access it when given a cpSpace reference in a callback.
 CP_EXPORT cpDataPointer cpSpaceGetUserData(const cpSpace *space);
 CP_EXPORT void cpSpaceSetUserData(cpSpace *space, cpDataPointer userData);
 
+/// The allocator the space was initialized with, or NULL if it uses cpcalloc().
+CP_EXPORT cpAllocator* cpSpaceGetAllocator(const cpSpace *space);
+
 /// The Space provided static body for a given cpSpace.
 /// This is merely provided for convenience and you are not required to use it.
 CP_EXPORT cpBody* cpSpaceGetStaticBody(const cpSpace *space);
@@ -239,6 +263,8 @@ CP_EXPORT void cpSpaceEachConstraint(cpSpace *space, cpSpaceConstraintIteratorFu
 //MARK: Indexing
 
 /// Update the collision detection info for the static shapes in the space.
+/// When using the default bounding box tree, this also rebuilds the static tree from scratch using cpBBTreeOptimize().
+/// Call it once after adding the static shapes for a level to get a better tree than inserting them one at a time.
 CP_EXPORT void cpSpaceReindexStatic(cpSpace *space);
 /// Update the collision detection data for a specific shape in the space.
 CP_EXPORT void cpSpaceReindexShape(cpSpace *space, cpShape *shape);
@@ -246,7 +272,14 @@ CP_EXPORT void cpSpaceReindexShape(cpSpace *space, cpShape *shape);
 CP_EXPORT void cpSpaceReindexShapesForBody(cpSpace *space, cpBody *body);
 
 /// Switch the space to use a spatial has as it's spatial index.
+/// Pass 0 for @c dim or @c count to start from a guess based on the shapes in the space and let the hash tune itself, see cpSpaceHashSetAutoResize().
 CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
+/// Switch the space to use a two axis sort and sweep for its dynamic shapes, see cpSweep2DNew().
+/// Static shapes are kept in a bounding box tree.
+CP_EXPORT void cpSpaceUseSweep2D(cpSpace *space);
+/// Switch the space to use a uniform grid for its dynamic shapes, see cpUniformGridNew().
+/// Static shapes are kept in a bounding box tree.
+CP_EXPORT void cpSpaceUseUniformGrid(cpSpace *space, cpFloat dim, cpBB bounds);
 
 
 //MARK: Time Stepping
@@ -255,6 +288,52 @@ CP_EXPORT void cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count);
 CP_EXPORT void cpSpaceStep(cpSpace *space, cpFloat dt);
 
 
+//MARK: Step Statistics
+
+/// Timings and counters recorded for each phase of the most recent step.
+/// Times are measured in nanoseconds of wall clock time.
+/// Statistics are only recorded if Chipmunk was compiled with CP_STEP_STATS defined to 1.
+/// Otherwise the timers are compiled out entirely and all of the fields are zero.
+typedef struct cpSpaceStepStats {
+	/// Time spent integrating body positions.
+	uint64_t integratePositions;
+	/// Time spent updating the bounding boxes of the dynamic shapes.
+	uint64_t updateBBs;
+	/// Time spent finding pairs of overlapping shapes in the spatial index, not including the narrow phase.
+	uint64_t reindexQuery;
+	/// Time spent in narrow phase collision detection and updating the arbiters.
+	uint64_t narrowPhase;
+	/// Time spent rebuilding the contact graph and updating sleeping components.
+	uint64_t processComponents;
+	/// Time spent resetting the arbiter list and filtering old cached arbiters.
+	uint64_t arbiterFilter;
+	/// Time spent pre-stepping the arbiters and constraints, including constraint pre-solve callbacks.
+	uint64_t preStep;
+	/// Time spent integrating body velocities.
+	uint64_t integrateVelocities;
+	/// Time spent applying the cached impulses from the previous step.
+	uint64_t warmStart;
+	/// Time spent in the impulse solver iterations.
+	uint64_t solve;
+	/// Time spent in post-solve and post-step callbacks.
+	uint64_t callbacks;
+	/// Total time of the step.
+	uint64_t total;
+	
+	/// Number of shape pairs from the spatial index passed to the narrow phase.
+	unsigned int pairsTested;
+	/// Number of active arbiters.
+	unsigned int arbiters;
+	/// Number of contacts in the active arbiters.
+	unsigned int contacts;
+	/// Number of sleeping bodies.
+	unsigned int sleepingBodies;
+} cpSpaceStepStats;
+
+/// Get the statistics recorded during the most recent call to cpSpaceStep() or cpHastySpaceStep().
+CP_EXPORT cpSpaceStepStats cpSpaceGetStepStats(const cpSpace *space);
+
+
 //MARK: Debug API
 
 #ifndef CP_SPACE_DISABLE_DEBUG_API
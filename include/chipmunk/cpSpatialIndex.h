@@ -61,6 +61,9 @@ struct cpSpatialIndex {
 	cpSpatialIndexBBFunc bbfunc;
 	
 	cpSpatialIndex *staticIndex, *dynamicIndex;
+	
+	// Allocates the index and everything it owns. Set by the *NewWithAllocator() functions before initializing, NULL otherwise.
+	cpAllocator *allocator;
 };
 
 
@@ -74,6 +77,8 @@ CP_EXPORT cpSpaceHash* cpSpaceHashAlloc(void);
 CP_EXPORT cpSpatialIndex* cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, int numcells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 /// Allocate and initialize a spatial hash.
 CP_EXPORT cpSpatialIndex* cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Same as cpSpaceHashNew(), but the hash and all of its memory are allocated using @c allocator.
+CP_EXPORT cpSpatialIndex* cpSpaceHashNewWithAllocator(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator);
 
 /// Change the cell dimensions and table size of the spatial hash to tune it.
 /// The cell dimensions should roughly match the average size of your objects
@@ -81,6 +86,11 @@ CP_EXPORT cpSpatialIndex* cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIn
 /// Some trial and error is required to find the optimum numbers for efficiency.
 CP_EXPORT void cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells);
 
+/// Enable or disable automatic resizing of the spatial hash. Disabled by default.
+/// The hash measures the average size of its objects every time it's reindexed,
+/// and resizes itself when the cells or the table drift far from the guidelines above for several reindexes in a row.
+CP_EXPORT void cpSpaceHashSetAutoResize(cpSpaceHash *hash, cpBool enabled);
+
 //MARK: AABB Tree
 
 typedef struct cpBBTree cpBBTree;
@@ -91,16 +101,79 @@ CP_EXPORT cpBBTree* cpBBTreeAlloc(void);
 CP_EXPORT cpSpatialIndex* cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 /// Allocate and initialize a bounding box tree.
 CP_EXPORT cpSpatialIndex* cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Same as cpBBTreeNew(), but the tree and all of its memory are allocated using @c allocator.
+CP_EXPORT cpSpatialIndex* cpBBTreeNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator);
 
 /// Perform a static top down optimization of the tree.
+/// Rebuilds the tree from scratch, splitting the leaves using a binned surface area heuristic.
 CP_EXPORT void cpBBTreeOptimize(cpSpatialIndex *index);
 
+/// Task callback function type used by cpBBTreeOptimizeParallel().
+typedef void (*cpBBTreeTaskFunc)(void *context, unsigned long task, unsigned long thread);
+/// Function type that runs @c count tasks, possibly in parallel, and returns once they have all finished.
+/// cpHastyThreadPoolRun() can be used with its thread pool as the @c runner.
+typedef void (*cpBBTreeRunTasksFunc)(void *runner, unsigned long count, cpBBTreeTaskFunc func, void *context);
+/// Same as cpBBTreeOptimize(), but builds independent subtrees as separate tasks using @c run.
+CP_EXPORT void cpBBTreeOptimizeParallel(cpSpatialIndex *index, cpBBTreeRunTasksFunc run, void *runner);
+/// Perform @c passes steps of incremental optimization on the tree.
+/// Each pass walks down a different path from the root, applying tree rotations that reduce the area of the nodes along the way,
+/// and then reinserts the leaf at the end of the path.
+/// This is much cheaper than cpBBTreeOptimize() and keeps trees with a lot of moving objects from slowly degrading.
+CP_EXPORT void cpBBTreeOptimizeIncremental(cpSpatialIndex *index, int passes);
+/// Set the number of incremental optimization passes to run every time the tree is reindexed. Defaults to 0.
+CP_EXPORT void cpBBTreeSetOptimizationPasses(cpSpatialIndex *index, int passes);
+
+/// How a bounding box tree handles leaves that move outside of their bounds when it is reindexed.
+typedef enum cpBBTreeUpdateMode {
+	/// Remove the leaf and insert it again in a better spot. This is the default.
+	CP_BBTREE_UPDATE_REINSERT,
+	/// Leave the structure of the tree alone and recalculate the bounds of the nodes bottom up in a single pass.
+	/// The tree is rebuilt with cpBBTreeOptimize() when its quality drops too far, see cpBBTreeSetRefitRebuildRatio().
+	CP_BBTREE_UPDATE_REFIT,
+} cpBBTreeUpdateMode;
+
+/// Set how the tree handles leaves that move outside of their bounds.
+/// Refitting is cheaper than reinserting when a lot of leaves move every step, such as with fast moving crowds of objects.
+CP_EXPORT void cpBBTreeSetUpdateMode(cpSpatialIndex *index, cpBBTreeUpdateMode mode);
+/// Set how much the quality of a refitted tree can degrade before it is rebuilt.
+/// The quality is measured as the total area of the internal nodes relative to the area of the root,
+/// and the tree is rebuilt when it grows to @c ratio times its value after the last rebuild. Defaults to 1.5.
+CP_EXPORT void cpBBTreeSetRefitRebuildRatio(cpSpatialIndex *index, cpFloat ratio);
+
 /// Bounding box tree velocity callback function.
 /// This function should return an estimate for the object's velocity.
 typedef cpVect (*cpBBTreeVelocityFunc)(void *obj);
 /// Set the velocity function for the bounding box tree to enable temporal coherence.
 CP_EXPORT void cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func);
 
+struct cpShapeFilter;
+/// Bounding box tree filter callback function.
+/// This function should return the collision filter of the object.
+typedef struct cpShapeFilter (*cpBBTreeFilterFunc)(void *obj);
+/// Set the filter function for the bounding box tree.
+/// Every node keeps the filters of the leaves below it merged together,
+/// so that finding pairs and filtered queries can skip whole subtrees that cpShapeFilterReject() would reject.
+/// Like bounding boxes, the filters are read when objects are inserted or reindexed. Set the function before adding objects.
+CP_EXPORT void cpBBTreeSetFilterFunc(cpSpatialIndex *index, cpBBTreeFilterFunc func);
+/// Notify the tree that the filter of an object changed.
+/// Queries see the new filter right away, and the object's pairs are updated the next time the tree is reindexed.
+/// Unlike reindexing, this is safe to call from query and collision callbacks.
+CP_EXPORT void cpBBTreeUpdateFilter(cpSpatialIndex *index, void *obj, cpHashValue hashid);
+/// Same as cpSpatialIndexQuery(), but skips objects whose filters @c filter rejects.
+/// The callback may still be called for rejected objects, so it needs to check the filter itself.
+CP_EXPORT void cpBBTreeQueryFiltered(cpSpatialIndex *index, void *obj, cpBB bb, struct cpShapeFilter filter, cpSpatialIndexQueryFunc func, void *data);
+/// Same as cpSpatialIndexSegmentQuery(), but skips objects whose filters @c filter rejects.
+/// The callback may still be called for rejected objects, so it needs to check the filter itself.
+CP_EXPORT void cpBBTreeSegmentQueryFiltered(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, struct cpShapeFilter filter, cpSpatialIndexSegmentQueryFunc func, void *data);
+
+/// Enable or disable the flat layout for queries against the tree.
+/// The tree keeps a copy of its nodes packed into a single array of 4 wide nodes with 32 bit child indexes.
+/// The bounds of each node's children are stored together so that a query box is tested against all of them at once with SIMD.
+/// Queries, and collisions with the tree as a static index, walk the array instead of following node pointers around the heap.
+/// The copy is rebuilt on the first query after the tree changes, so it works best for trees that are queried more often than they change.
+/// Define CP_BBTREE_QUANTIZED_BOUNDS to 1 when building Chipmunk with doubles to store the copied bounds as floats rounded outwards.
+CP_EXPORT void cpBBTreeSetFlatLayout(cpSpatialIndex *index, cpBool enabled);
+
 //MARK: Single Axis Sweep
 
 typedef struct cpSweep1D cpSweep1D;
@@ -111,6 +184,44 @@ CP_EXPORT cpSweep1D* cpSweep1DAlloc(void);
 CP_EXPORT cpSpatialIndex* cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
 /// Allocate and initialize a 1D sort and sweep broadphase.
 CP_EXPORT cpSpatialIndex* cpSweep1DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Same as cpSweep1DNew(), but the broadphase and all of its memory are allocated using @c allocator.
+CP_EXPORT cpSpatialIndex* cpSweep1DNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator);
+
+//MARK: Two Axis Sweep
+
+typedef struct cpSweep2D cpSweep2D;
+
+/// Allocate a 2D sort and sweep broadphase.
+CP_EXPORT cpSweep2D* cpSweep2DAlloc(void);
+/// Initialize a 2D sort and sweep broadphase.
+CP_EXPORT cpSpatialIndex* cpSweep2DInit(cpSweep2D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a 2D sort and sweep broadphase.
+/// It keeps the endpoints of the bounding boxes sorted along both axes between steps along with a set of the overlapping pairs.
+/// The pairs only change when endpoints swap places while sorting, so objects that don't move cost almost nothing to find pairs for.
+/// Works well for piles of resting objects, but objects moving quickly past a lot of others cause a lot of swaps.
+CP_EXPORT cpSpatialIndex* cpSweep2DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Same as cpSweep2DNew(), but the broadphase and all of its memory are allocated using @c allocator.
+CP_EXPORT cpSpatialIndex* cpSweep2DNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator);
+
+//MARK: Uniform Grid
+
+typedef struct cpUniformGrid cpUniformGrid;
+
+/// Allocate a uniform grid.
+CP_EXPORT cpUniformGrid* cpUniformGridAlloc(void);
+/// Initialize a uniform grid.
+CP_EXPORT cpSpatialIndex* cpUniformGridInit(cpUniformGrid *grid, cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Allocate and initialize a uniform grid.
+/// The grid covers @c bounds with square cells of size @c celldim stored in a flat array.
+/// Each reindex counting sorts the objects into the cells, so there are no hash collisions or per object allocations.
+/// Works best for lots of objects of about the same size, such as particles, with cells about as big as the objects.
+/// Objects that stick out of the bounds are checked one by one, so the bounds should cover the whole simulation.
+CP_EXPORT cpSpatialIndex* cpUniformGridNew(cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex);
+/// Same as cpUniformGridNew(), but the grid and all of its memory are allocated using @c allocator.
+CP_EXPORT cpSpatialIndex* cpUniformGridNewWithAllocator(cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator);
+
+/// Change the cell size and bounds of the uniform grid.
+CP_EXPORT void cpUniformGridResize(cpUniformGrid *grid, cpFloat celldim, cpBB bounds);
 
 //MARK: Spatial Index Implementation
 
@@ -337,6 +337,7 @@ cpArbiterInit(cpArbiter *arb, cpShape *a, cpShape *b)
 	
 	arb->stamp = 0;
 	arb->state = CP_ARBITER_STATE_FIRST_COLLISION;
+	arb->id = 0;
 	
 	arb->data = NULL;
 	
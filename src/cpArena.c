@@ -0,0 +1,247 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+// Blocks are bumped out of large chunks in power of two size classes, with a header in front of each one that records its class.
+// Freed blocks are kept on a list for their class and reused, and the chunks are only returned when the arena is freed.
+
+// The headers keep the blocks aligned for the SIMD code in the spatial indexes.
+#define CHUNK_HEADER_BYTES 16
+#define BLOCK_HEADER_BYTES 16
+#define MIN_BLOCK_BYTES 16
+#define CLASS_COUNT (8*sizeof(size_t))
+// Largest allocation whose size class and block header don't overflow a size_t.
+#define MAX_BLOCK_BYTES ((size_t)1 << (CLASS_COUNT - 2))
+
+#define DEFAULT_CHUNK_BYTES (1024*1024)
+
+typedef struct Chunk Chunk;
+
+struct Chunk {
+	Chunk *next;
+};
+
+struct cpArena {
+	// Must be the first member so the allocator callbacks can find the arena.
+	cpAllocator allocator;
+
+	size_t chunkBytes, limit;
+	size_t bytesAllocated, bytesReserved;
+
+	Chunk *chunks;
+	// The unused part of the newest chunk.
+	char *cursor, *end;
+
+	// Linked lists of freed blocks, stored in the blocks themselves.
+	void *freeBlocks[CLASS_COUNT];
+};
+
+static inline unsigned int
+SizeClass(size_t bytes)
+{
+	unsigned int sizeClass = 0;
+	while(((size_t)MIN_BLOCK_BYTES << sizeClass) < bytes) sizeClass++;
+	return sizeClass;
+}
+
+static inline size_t
+ClassBytes(unsigned int sizeClass)
+{
+	return (size_t)MIN_BLOCK_BYTES << sizeClass;
+}
+
+static inline unsigned int
+BlockClass(void *ptr)
+{
+	return (unsigned int)*(size_t *)((char *)ptr - BLOCK_HEADER_BYTES);
+}
+
+static inline void
+BlockPushFree(cpArena *arena, char *block, unsigned int sizeClass)
+{
+	void *ptr = block + BLOCK_HEADER_BYTES;
+	*(size_t *)block = sizeClass;
+	*(void **)ptr = arena->freeBlocks[sizeClass];
+	arena->freeBlocks[sizeClass] = ptr;
+}
+
+static char *
+ChunkNew(cpArena *arena, size_t bytes)
+{
+	size_t total = CHUNK_HEADER_BYTES + bytes;
+	cpAssertHard(arena->limit == 0 || arena->bytesReserved + total <= arena->limit, "The arena's memory limit was exceeded.");
+
+	Chunk *chunk = (Chunk *)cpcalloc(1, total);
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->bytesReserved += total;
+
+	return (char *)chunk + CHUNK_HEADER_BYTES;
+}
+
+static void *
+ArenaAlloc(cpArena *arena, size_t bytes)
+{
+	cpAssertHard(bytes <= MAX_BLOCK_BYTES, "Allocation is too large for the arena.");
+	
+	unsigned int sizeClass = SizeClass(bytes);
+	size_t blockBytes = BLOCK_HEADER_BYTES + ClassBytes(sizeClass);
+	arena->bytesAllocated += ClassBytes(sizeClass);
+
+	void *ptr = arena->freeBlocks[sizeClass];
+	if(ptr){
+		arena->freeBlocks[sizeClass] = *(void **)ptr;
+		memset(ptr, 0, bytes);
+		return ptr;
+	}
+
+	char *block;
+	if(blockBytes > arena->chunkBytes/4){
+		// Large blocks get a chunk of their own so they don't cut the current chunk short.
+		block = ChunkNew(arena, blockBytes);
+	} else {
+		if((size_t)(arena->end - arena->cursor) < blockBytes){
+			// Give the rest of the current chunk to the free lists instead of wasting it.
+			for(size_t remaining; (remaining = arena->end - arena->cursor) >= BLOCK_HEADER_BYTES + MIN_BLOCK_BYTES;){
+				unsigned int restClass = SizeClass(remaining - BLOCK_HEADER_BYTES + 1) - 1;
+				BlockPushFree(arena, arena->cursor, restClass);
+				arena->cursor += BLOCK_HEADER_BYTES + ClassBytes(restClass);
+			}
+
+			arena->cursor = ChunkNew(arena, arena->chunkBytes);
+			arena->end = arena->cursor + arena->chunkBytes;
+		}
+
+		block = arena->cursor;
+		arena->cursor += blockBytes;
+	}
+
+	// Chunk memory comes from cpcalloc() and is already zeroed.
+	*(size_t *)block = sizeClass;
+	return block + BLOCK_HEADER_BYTES;
+}
+
+static void
+ArenaFreeBlock(cpArena *arena, void *ptr)
+{
+	if(ptr){
+		unsigned int sizeClass = BlockClass(ptr);
+		arena->bytesAllocated -= ClassBytes(sizeClass);
+		BlockPushFree(arena, (char *)ptr - BLOCK_HEADER_BYTES, sizeClass);
+	}
+}
+
+//MARK: Allocator Callbacks
+
+static void *
+ArenaCalloc(cpArena *arena, size_t count, size_t size)
+{
+	cpAssertHard(size == 0 || count <= MAX_BLOCK_BYTES/size, "Allocation is too large for the arena.");
+	return ArenaAlloc(arena, count*size);
+}
+
+static void *
+ArenaRealloc(cpArena *arena, void *ptr, size_t size)
+{
+	if(!ptr) return ArenaAlloc(arena, size);
+
+	// Blocks are never shrunk, and can grow up to the size of their class in place.
+	size_t classBytes = ClassBytes(BlockClass(ptr));
+	if(size <= classBytes) return ptr;
+
+	void *block = ArenaAlloc(arena, size);
+	memcpy(block, ptr, classBytes);
+	ArenaFreeBlock(arena, ptr);
+
+	return block;
+}
+
+static void
+ArenaFree(cpArena *arena, void *ptr)
+{
+	ArenaFreeBlock(arena, ptr);
+}
+
+//MARK: Memory Management Functions
+
+cpArena *
+cpArenaNew(size_t chunkBytes)
+{
+	cpArena *arena = (cpArena *)cpcalloc(1, sizeof(cpArena));
+
+	arena->allocator.callocFunc = (void *(*)(cpAllocator *, size_t, size_t))ArenaCalloc;
+	arena->allocator.reallocFunc = (void *(*)(cpAllocator *, void *, size_t))ArenaRealloc;
+	arena->allocator.freeFunc = (void (*)(cpAllocator *, void *))ArenaFree;
+
+	arena->chunkBytes = (chunkBytes ? chunkBytes : DEFAULT_CHUNK_BYTES);
+	arena->limit = 0;
+
+	arena->bytesAllocated = arena->bytesReserved = 0;
+
+	arena->chunks = NULL;
+	arena->cursor = arena->end = NULL;
+
+	return arena;
+}
+
+void
+cpArenaFree(cpArena *arena)
+{
+	if(arena){
+		Chunk *chunk = arena->chunks;
+		while(chunk){
+			Chunk *next = chunk->next;
+			cpfree(chunk);
+			chunk = next;
+		}
+
+		cpfree(arena);
+	}
+}
+
+//MARK: Getters and Setters
+
+cpAllocator *
+cpArenaGetAllocator(cpArena *arena)
+{
+	return &arena->allocator;
+}
+
+size_t
+cpArenaGetBytesAllocated(cpArena *arena)
+{
+	return arena->bytesAllocated;
+}
+
+size_t
+cpArenaGetBytesReserved(cpArena *arena)
+{
+	return arena->bytesReserved;
+}
+
+void
+cpArenaSetLimit(cpArena *arena, size_t limit)
+{
+	arena->limit = limit;
+}
@@ -21,17 +21,22 @@
 
 #include "stdlib.h"
 #include "stdio.h"
+#include "string.h"
 
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass *Klass();
+static void OptimizeIncremental(cpBBTree *tree, int passes);
 
 typedef struct Node Node;
 typedef struct Pair Pair;
+typedef struct FlatNode FlatNode;
+typedef struct FlatFilter FlatFilter;
 
 struct cpBBTree {
 	cpSpatialIndex spatialIndex;
 	cpBBTreeVelocityFunc velocityFunc;
+	cpBBTreeFilterFunc filterFunc;
 	
 	cpHashSet *leaves;
 	Node *root;
@@ -41,11 +46,35 @@ struct cpBBTree {
 	cpArray *allocatedBuffers;
 	
 	cpTimestamp stamp;
+	
+	// Incremental optimization passes to run after each reindex, and the path counter for the next pass.
+	int optimizationPasses;
+	unsigned int opath;
+	
+	// See cpBBTreeSetUpdateMode(). Refitting is deferred until all of the leaves have been updated.
+	cpBBTreeUpdateMode updateMode;
+	cpBool refitPending;
+	
+	// Quality of the tree and leaf count after the last rebuild in refit mode, see RefitNeedsRebuild().
+	cpFloat refitRebuildRatio, refitBaseQuality;
+	int refitBaseCount;
+	
+	// Array copy of the tree used for queries, see cpBBTreeSetFlatLayout().
+	cpBool flatEnabled, flatDirty;
+	FlatNode *flatNodes;
+	FlatFilter *flatFilters;
+	Node **flatLeaves;
+	int flatNodesMax, flatLeavesMax;
+	
+	// Leaves passed to cpBBTreeUpdateFilter() that still need their exact filter and pairs updated.
+	cpArray *filterDirtyLeaves;
 };
 
 struct Node {
 	void *obj;
 	cpBB bb;
+	// Filter of a leaf's object, or the filters of the leaves below a node merged with FilterMerge().
+	cpShapeFilter filter;
 	Node *parent;
 	
 	union {
@@ -55,6 +84,7 @@ struct Node {
 		// Leaves
 		struct {
 			cpTimestamp stamp;
+			cpBool filterDirty;
 			Pair *pairs;
 		} leaf;
 	} node;
@@ -65,6 +95,7 @@ struct Node {
 #define B node.children.b
 #define STAMP node.leaf.stamp
 #define PAIRS node.leaf.pairs
+#define FILTER_DIRTY node.leaf.filterDirty
 
 typedef struct Thread {
 	Pair *prev;
@@ -77,6 +108,43 @@ struct Pair {
 	cpCollisionID id;
 };
 
+#ifndef CP_BBTREE_QUANTIZED_BOUNDS
+	#define CP_BBTREE_QUANTIZED_BOUNDS 0
+#endif
+
+#if CP_BBTREE_QUANTIZED_BOUNDS
+	typedef float FlatFloat;
+	typedef int32_t FlatInt;
+#else
+	typedef cpFloat FlatFloat;
+	#if CP_USE_DOUBLES
+		typedef int64_t FlatInt;
+	#else
+		typedef int32_t FlatInt;
+	#endif
+#endif
+
+typedef struct FlatBB {FlatFloat l, b, r, t;} FlatBB;
+
+// Number of children of each node in the flat layout.
+#define FLAT_WIDTH 4
+
+struct FlatNode {
+	// Bounds of the children stored by component so a query can test them all at once.
+	FlatFloat l[FLAT_WIDTH], b[FLAT_WIDTH], r[FLAT_WIDTH], t[FLAT_WIDTH];
+	// Index of each child node, or for leaves, -1 - the index of the leaf in the flatLeaves array.
+	// The root is never a child, so 0 marks the unused children at the end.
+	int32_t index[FLAT_WIDTH];
+	// Bit mask of the used children. Their inverted bounds still intersect an infinite query box, so queries must mask them out.
+	uint32_t used;
+};
+
+// Filters of the children of the flat node with the same index.
+// Only filtered traversals need them, so they are kept out of the way of the bounds.
+struct FlatFilter {
+	cpShapeFilter child[FLAT_WIDTH];
+};
+
 //MARK: Misc Functions
 
 static inline cpBB
@@ -97,6 +165,28 @@ GetBB(cpBBTree *tree, void *obj)
 	}
 }
 
+static inline cpShapeFilter
+GetFilter(cpBBTree *tree, void *obj)
+{
+	cpBBTreeFilterFunc filterFunc = tree->filterFunc;
+	return (filterFunc ? filterFunc(obj) : CP_SHAPE_FILTER_ALL);
+}
+
+// The group is kept only if both filters share it, and the categories and masks are combined.
+// When cpShapeFilterReject() rejects a merged filter, it rejects every filter that was merged into it too.
+static inline cpShapeFilter
+FilterMerge(cpShapeFilter a, cpShapeFilter b)
+{
+	cpShapeFilter filter = {(a.group == b.group ? a.group : CP_NO_GROUP), a.categories | b.categories, a.mask | b.mask};
+	return filter;
+}
+
+static inline cpBool
+FilterEqual(cpShapeFilter a, cpShapeFilter b)
+{
+	return (a.group == b.group && a.categories == b.categories && a.mask == b.mask);
+}
+
 static inline cpBBTree *
 GetTree(cpSpatialIndex *index)
 {
@@ -156,7 +246,7 @@ PairFromPool(cpBBTree *tree)
 		int count = CP_BUFFER_BYTES/sizeof(Pair);
 		cpAssertHard(count, "Internal Error: Buffer size is too small.");
 		
-		Pair *buffer = (Pair *)cpcalloc(1, CP_BUFFER_BYTES);
+		Pair *buffer = (Pair *)cpAllocatorCalloc(tree->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
 		cpArrayPush(tree->allocatedBuffers, buffer);
 		
 		// push all but the first one, return the first instead
@@ -245,7 +335,7 @@ NodeFromPool(cpBBTree *tree)
 		int count = CP_BUFFER_BYTES/sizeof(Node);
 		cpAssertHard(count, "Internal Error: Buffer size is too small.");
 		
-		Node *buffer = (Node *)cpcalloc(1, CP_BUFFER_BYTES);
+		Node *buffer = (Node *)cpAllocatorCalloc(tree->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
 		cpArrayPush(tree->allocatedBuffers, buffer);
 		
 		// push all but the first one, return the first instead
@@ -268,6 +358,13 @@ NodeSetB(Node *node, Node *value)
 	value->parent = node;
 }
 
+static inline void
+NodeMergeChildren(Node *node)
+{
+	node->bb = cpBBMerge(node->A->bb, node->B->bb);
+	node->filter = FilterMerge(node->A->filter, node->B->filter);
+}
+
 static Node *
 NodeNew(cpBBTree *tree, Node *a, Node *b)
 {
@@ -275,6 +372,7 @@ NodeNew(cpBBTree *tree, Node *a, Node *b)
 	
 	node->obj = NULL;
 	node->bb = cpBBMerge(a->bb, b->bb);
+	node->filter = FilterMerge(a->filter, b->filter);
 	node->parent = NULL;
 	
 	NodeSetA(node, a);
@@ -309,9 +407,7 @@ NodeReplaceChild(Node *parent, Node *child, Node *value, cpBBTree *tree)
 		NodeSetB(parent, value);
 	}
 	
-	for(Node *node=parent; node; node = node->parent){
-		node->bb = cpBBMerge(node->A->bb, node->B->bb);
-	}
+	for(Node *node=parent; node; node = node->parent) NodeMergeChildren(node);
 }
 
 //MARK: Subtree Functions
@@ -345,39 +441,48 @@ SubtreeInsert(Node *subtree, Node *leaf, cpBBTree *tree)
 		}
 		
 		subtree->bb = cpBBMerge(subtree->bb, leaf->bb);
+		subtree->filter = FilterMerge(subtree->filter, leaf->filter);
 		return subtree;
 	}
 }
 
+// Queries with a non-NULL filter skip the subtrees it rejects.
 static void
-SubtreeQuery(Node *subtree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+SubtreeQuery(Node *subtree, void *obj, cpBB bb, const cpShapeFilter *filter, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(cpBBIntersects(subtree->bb, bb)){
+	if(cpBBIntersects(subtree->bb, bb) && !(filter && cpShapeFilterReject(*filter, subtree->filter))){
 		if(NodeIsLeaf(subtree)){
 			func(obj, subtree->obj, 0, data);
 		} else {
-			SubtreeQuery(subtree->A, obj, bb, func, data);
-			SubtreeQuery(subtree->B, obj, bb, func, data);
+			SubtreeQuery(subtree->A, obj, bb, filter, func, data);
+			SubtreeQuery(subtree->B, obj, bb, filter, func, data);
 		}
 	}
 }
 
 
+static inline cpFloat
+NodeSegmentQuery(Node *node, cpVect a, cpVect b, const cpShapeFilter *filter)
+{
+	return (filter && cpShapeFilterReject(*filter, node->filter) ? INFINITY : cpBBSegmentQuery(node->bb, a, b));
+}
+
+// The root isn't checked against the filter, the caller has to do that.
 static cpFloat
-SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+SubtreeSegmentQuery(Node *subtree, void *obj, cpVect a, cpVect b, cpFloat t_exit, const cpShapeFilter *filter, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	if(NodeIsLeaf(subtree)){
 		return func(obj, subtree->obj, data);
 	} else {
-		cpFloat t_a = cpBBSegmentQuery(subtree->A->bb, a, b);
-		cpFloat t_b = cpBBSegmentQuery(subtree->B->bb, a, b);
+		cpFloat t_a = NodeSegmentQuery(subtree->A, a, b, filter);
+		cpFloat t_b = NodeSegmentQuery(subtree->B, a, b, filter);
 		
 		if(t_a < t_b){
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, filter, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, filter, func, data));
 		} else {
-			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, func, data));
-			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, func, data));
+			if(t_b < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->B, obj, a, b, t_exit, filter, func, data));
+			if(t_a < t_exit) t_exit = cpfmin(t_exit, SubtreeSegmentQuery(subtree->A, obj, a, b, t_exit, filter, func, data));
 		}
 		
 		return t_exit;
@@ -413,6 +518,278 @@ SubtreeRemove(Node *subtree, Node *leaf, cpBBTree *tree)
 	}
 }
 
+//MARK: Refit Functions
+
+// Recalculate the bounds of the internal nodes from the bottom up.
+// Returns the total area of the internal nodes, which is proportional to the expected cost of querying the subtree.
+static cpFloat
+SubtreeRefit(Node *subtree)
+{
+	if(NodeIsLeaf(subtree)) return 0.0f;
+	
+	cpFloat cost = SubtreeRefit(subtree->A) + SubtreeRefit(subtree->B);
+	NodeMergeChildren(subtree);
+	return cost + cpBBArea(subtree->bb);
+}
+
+static cpFloat
+SubtreeCost(Node *subtree)
+{
+	return (NodeIsLeaf(subtree) ? 0.0f : cpBBArea(subtree->bb) + SubtreeCost(subtree->A) + SubtreeCost(subtree->B));
+}
+
+// Cost of the tree relative to the area of its root so that it doesn't change when all of the leaves spread out or move together.
+static inline cpFloat
+TreeQuality(Node *root, cpFloat cost)
+{
+	cpFloat area = cpBBArea(root->bb);
+	return (area > 0.0f ? cost/area : 0.0f);
+}
+
+static void
+RefitResetQuality(cpBBTree *tree)
+{
+	tree->refitBaseQuality = (tree->root ? TreeQuality(tree->root, SubtreeCost(tree->root)) : 0.0f);
+	tree->refitBaseCount = cpHashSetCount(tree->leaves);
+}
+
+static cpBool
+RefitNeedsRebuild(cpBBTree *tree, cpFloat cost)
+{
+	// Rebuild the first time, and when the number of leaves has changed a lot since the last rebuild.
+	int count = cpHashSetCount(tree->leaves), base = tree->refitBaseCount;
+	if(base == 0 || count > 2*base || 2*count < base) return cpTrue;
+	
+	return (TreeQuality(tree->root, cost) > tree->refitRebuildRatio*tree->refitBaseQuality);
+}
+
+//MARK: Flat Layout
+
+#if CP_BBTREE_QUANTIZED_BOUNDS
+static inline FlatBB
+FlatBBNew(cpBB bb)
+{
+	// Round outwards so the float bounds always contain the exact bounds.
+	FlatBB flat = {(float)bb.l, (float)bb.b, (float)bb.r, (float)bb.t};
+	if(flat.l > bb.l) flat.l = nextafterf(flat.l, -INFINITY);
+	if(flat.b > bb.b) flat.b = nextafterf(flat.b, -INFINITY);
+	if(flat.r < bb.r) flat.r = nextafterf(flat.r, INFINITY);
+	if(flat.t < bb.t) flat.t = nextafterf(flat.t, INFINITY);
+	
+	return flat;
+}
+#else
+static inline FlatBB FlatBBNew(cpBB bb){FlatBB flat = {bb.l, bb.b, bb.r, bb.t}; return flat;}
+#endif
+
+static inline cpBB
+FlatNodeChildBB(FlatNode *node, int i)
+{
+	return cpBBNew(node->l[i], node->b[i], node->r[i], node->t[i]);
+}
+
+#if defined(__GNUC__) && !defined(CP_BBTREE_NO_SIMD)
+typedef FlatFloat FlatVec __attribute__((vector_size(FLAT_WIDTH*sizeof(FlatFloat))));
+typedef FlatInt FlatVecMask __attribute__((vector_size(FLAT_WIDTH*sizeof(FlatFloat))));
+
+// Returns a bit mask of the children of the node with bounds that intersect bb.
+// Tests all of the children at once using SSE2 on x86-64, NEON on ARM64, or whatever else the compiler targets.
+static inline unsigned int
+FlatNodeIntersects(FlatNode *node, FlatBB bb)
+{
+	// The node array is only aligned to the allocator's alignment, memcpy() lets the compiler use unaligned loads.
+	FlatVec l, b, r, t;
+	memcpy(&l, node->l, sizeof(l));
+	memcpy(&b, node->b, sizeof(b));
+	memcpy(&r, node->r, sizeof(r));
+	memcpy(&t, node->t, sizeof(t));
+	
+	FlatVec ql = {bb.l, bb.l, bb.l, bb.l};
+	FlatVec qb = {bb.b, bb.b, bb.b, bb.b};
+	FlatVec qr = {bb.r, bb.r, bb.r, bb.r};
+	FlatVec qt = {bb.t, bb.t, bb.t, bb.t};
+	
+	FlatVecMask hit = (l <= qr) & (ql <= r) & (b <= qt) & (qb <= t);
+	return (unsigned int)((hit[0] & 1) | (hit[1] & 2) | (hit[2] & 4) | (hit[3] & 8)) & node->used;
+}
+#else
+static inline unsigned int
+FlatNodeIntersects(FlatNode *node, FlatBB bb)
+{
+	unsigned int mask = 0;
+	for(int i=0; i<FLAT_WIDTH; i++){
+		mask |= (unsigned int)(node->l[i] <= bb.r && bb.l <= node->r[i] && node->b[i] <= bb.t && bb.b <= node->t[i]) << i;
+	}
+	
+	return mask & node->used;
+}
+#endif
+
+// Collapse the top levels of a subtree into at most FLAT_WIDTH children by repeatedly opening the child with the largest area.
+// Opened children are replaced in place so the leaves stay in the same order as in the binary tree.
+static int
+FlatCollectChildren(Node *subtree, Node **children)
+{
+	int count = 1;
+	children[0] = subtree;
+	
+	while(count < FLAT_WIDTH){
+		int open = -1;
+		cpFloat area = -1.0f;
+		for(int i=0; i<count; i++){
+			if(!NodeIsLeaf(children[i]) && cpBBArea(children[i]->bb) > area){
+				open = i;
+				area = cpBBArea(children[i]->bb);
+			}
+		}
+		
+		if(open < 0) break;
+		
+		Node *node = children[open];
+		memmove(children + open + 2, children + open + 1, (count - open - 1)*sizeof(Node *));
+		children[open + 0] = node->A;
+		children[open + 1] = node->B;
+		count++;
+	}
+	
+	return count;
+}
+
+static void
+FlatFill(cpBBTree *tree, Node *subtree, int index, int *nodeCount, int *leafCount)
+{
+	FlatNode *flat = tree->flatNodes + index;
+	FlatFilter *filters = tree->flatFilters + index;
+	
+	Node *children[FLAT_WIDTH];
+	int count = FlatCollectChildren(subtree, children);
+	flat->used = (1u << count) - 1;
+	
+	for(int i=0; i<FLAT_WIDTH; i++){
+		if(i < count){
+			Node *child = children[i];
+			FlatBB bb = FlatBBNew(child->bb);
+			flat->l[i] = bb.l; flat->b[i] = bb.b; flat->r[i] = bb.r; flat->t[i] = bb.t;
+			filters->child[i] = child->filter;
+			
+			if(NodeIsLeaf(child)){
+				int leaf = (*leafCount)++;
+				tree->flatLeaves[leaf] = child;
+				flat->index[i] = -1 - leaf;
+			} else {
+				// Allocate the children of a node together so that they are adjacent.
+				flat->index[i] = (*nodeCount)++;
+			}
+		} else {
+			// Unused children have inverted bounds so they don't intersect any finite box, and are masked out by used.
+			flat->l[i] = flat->b[i] = INFINITY;
+			flat->r[i] = flat->t[i] = -INFINITY;
+			flat->index[i] = 0;
+			filters->child[i] = CP_SHAPE_FILTER_NONE;
+		}
+	}
+	
+	for(int i=0; i<count; i++){
+		if(flat->index[i] > 0) FlatFill(tree, children[i], flat->index[i], nodeCount, leafCount);
+	}
+}
+
+// Returns true if the flat copy of the tree is enabled and up to date, rebuilding it if needed.
+static cpBool
+FlatUpdate(cpBBTree *tree)
+{
+	if(!tree->flatEnabled || !tree->root) return cpFalse;
+	
+	if(tree->flatDirty){
+		int leaves = cpHashSetCount(tree->leaves);
+		// Every node has at least two children except for a root with a single leaf.
+		int nodes = (leaves > 1 ? leaves - 1 : 1);
+		
+		if(tree->flatLeavesMax < leaves){
+			tree->flatLeavesMax = leaves + leaves/2;
+			tree->flatLeaves = (Node **)cpAllocatorRealloc(tree->spatialIndex.allocator, tree->flatLeaves, tree->flatLeavesMax*sizeof(Node *));
+		}
+		
+		if(tree->flatNodesMax < nodes){
+			tree->flatNodesMax = nodes + nodes/2;
+			tree->flatNodes = (FlatNode *)cpAllocatorRealloc(tree->spatialIndex.allocator, tree->flatNodes, tree->flatNodesMax*sizeof(FlatNode));
+			tree->flatFilters = (FlatFilter *)cpAllocatorRealloc(tree->spatialIndex.allocator, tree->flatFilters, tree->flatNodesMax*sizeof(FlatFilter));
+		}
+		
+		int nodeCount = 1, leafCount = 0;
+		FlatFill(tree, tree->root, 0, &nodeCount, &leafCount);
+		cpAssertSoft(nodeCount <= nodes && leafCount == leaves, "Internal Error: Tree and leaf set are out of sync.");
+		
+		tree->flatDirty = cpFalse;
+	}
+	
+	return cpTrue;
+}
+
+static void
+FlatQuery(cpBBTree *tree, int index, void *obj, cpBB bb, FlatBB flatBB, const cpShapeFilter *filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	FlatNode *node = tree->flatNodes + index;
+	unsigned int mask = FlatNodeIntersects(node, flatBB);
+	
+	for(int i=0; mask; i++, mask >>= 1){
+		if(!(mask & 1)) continue;
+		if(filter && cpShapeFilterReject(*filter, tree->flatFilters[index].child[i])) continue;
+		
+		int child = node->index[i];
+		if(child < 0){
+			Node *leaf = tree->flatLeaves[-1 - child];
+#if CP_BBTREE_QUANTIZED_BOUNDS
+			if(!cpBBIntersects(leaf->bb, bb)) continue;
+#endif
+			func(obj, leaf->obj, 0, data);
+		} else {
+			FlatQuery(tree, child, obj, bb, flatBB, filter, func, data);
+		}
+	}
+}
+
+static cpFloat
+FlatSegmentQuery(cpBBTree *tree, int index, void *obj, cpVect a, cpVect b, cpFloat t_exit, const cpShapeFilter *filter, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	FlatNode *node = tree->flatNodes + index;
+	
+	// Sort the children that the segment hits by their distance along it.
+	cpFloat times[FLAT_WIDTH];
+	int order[FLAT_WIDTH], count = 0;
+	for(int i=0; i<FLAT_WIDTH && node->index[i] != 0; i++){
+		if(filter && cpShapeFilterReject(*filter, tree->flatFilters[index].child[i])) continue;
+		
+		cpFloat t = cpBBSegmentQuery(FlatNodeChildBB(node, i), a, b);
+		if(t >= t_exit) continue;
+		
+		int j = count++;
+		for(; j > 0 && times[j - 1] > t; j--){
+			times[j] = times[j - 1];
+			order[j] = order[j - 1];
+		}
+		
+		times[j] = t;
+		order[j] = i;
+	}
+	
+	for(int j=0; j<count && times[j] < t_exit; j++){
+		int child = node->index[order[j]];
+		
+		if(child < 0){
+			Node *leaf = tree->flatLeaves[-1 - child];
+#if CP_BBTREE_QUANTIZED_BOUNDS
+			if(cpBBSegmentQuery(leaf->bb, a, b) >= t_exit) continue;
+#endif
+			t_exit = cpfmin(t_exit, func(obj, leaf->obj, data));
+		} else {
+			t_exit = cpfmin(t_exit, FlatSegmentQuery(tree, child, obj, a, b, t_exit, filter, func, data));
+		}
+	}
+	
+	return t_exit;
+}
+
 //MARK: Marking Functions
 
 typedef struct MarkContext {
@@ -420,12 +797,15 @@ typedef struct MarkContext {
 	Node *staticRoot;
 	cpSpatialIndexQueryFunc func;
 	void *data;
+	// Static tree to query using its flat layout instead of staticRoot, or NULL.
+	cpBBTree *staticFlatTree;
 } MarkContext;
 
 static void
 MarkLeafQuery(Node *subtree, Node *leaf, cpBool left, MarkContext *context)
 {
-	if(cpBBIntersects(leaf->bb, subtree->bb)){
+	// Leaves without a filter function have filters that never reject anything.
+	if(cpBBIntersects(leaf->bb, subtree->bb) && !cpShapeFilterReject(leaf->filter, subtree->filter)){
 		if(NodeIsLeaf(subtree)){
 			if(left){
 				PairInsert(leaf, subtree, context->tree);
@@ -440,13 +820,43 @@ MarkLeafQuery(Node *subtree, Node *leaf, cpBool left, MarkContext *context)
 	}
 }
 
+// Same as MarkLeafQuery() with left == false, but walks the flat layout of a static tree.
+static void
+FlatMarkLeafQuery(cpBBTree *staticTree, int index, Node *leaf, FlatBB flatBB, MarkContext *context)
+{
+	FlatNode *node = staticTree->flatNodes + index;
+	unsigned int mask = FlatNodeIntersects(node, flatBB);
+	FlatFilter *filters = (staticTree->filterFunc ? staticTree->flatFilters + index : NULL);
+	
+	for(int i=0; mask; i++, mask >>= 1){
+		if(!(mask & 1)) continue;
+		if(filters && cpShapeFilterReject(leaf->filter, filters->child[i])) continue;
+		
+		int child = node->index[i];
+		if(child < 0){
+			Node *subtree = staticTree->flatLeaves[-1 - child];
+#if CP_BBTREE_QUANTIZED_BOUNDS
+			if(!cpBBIntersects(leaf->bb, subtree->bb)) continue;
+#endif
+			if(subtree->STAMP < leaf->STAMP) PairInsert(subtree, leaf, context->tree);
+			context->func(leaf->obj, subtree->obj, 0, context->data);
+		} else {
+			FlatMarkLeafQuery(staticTree, child, leaf, flatBB, context);
+		}
+	}
+}
+
 static void
 MarkLeaf(Node *leaf, MarkContext *context)
 {
 	cpBBTree *tree = context->tree;
 	if(leaf->STAMP == GetMasterTree(tree)->stamp){
 		Node *staticRoot = context->staticRoot;
-		if(staticRoot) MarkLeafQuery(staticRoot, leaf, cpFalse, context);
+		if(context->staticFlatTree){
+			FlatMarkLeafQuery(context->staticFlatTree, 0, leaf, FlatBBNew(leaf->bb), context);
+		} else if(staticRoot){
+			MarkLeafQuery(staticRoot, leaf, cpFalse, context);
+		}
 		
 		for(Node *node = leaf; node->parent; node = node->parent){
 			if(node == node->parent->A){
@@ -487,9 +897,11 @@ LeafNew(cpBBTree *tree, void *obj, cpBB bb)
 	Node *node = NodeFromPool(tree);
 	node->obj = obj;
 	node->bb = GetBB(tree, obj);
+	node->filter = GetFilter(tree, obj);
 	
 	node->parent = NULL;
 	node->STAMP = 0;
+	node->FILTER_DIRTY = cpFalse;
 	node->PAIRS = NULL;
 	
 	return node;
@@ -500,15 +912,23 @@ LeafUpdate(Node *leaf, cpBBTree *tree)
 {
 	Node *root = tree->root;
 	cpBB bb = tree->spatialIndex.bbfunc(leaf->obj);
+	cpShapeFilter filter = GetFilter(tree, leaf->obj);
 	
-	if(!cpBBContainsBB(leaf->bb, bb)){
+	// A leaf with a new filter may have pairs that were skipped before, so it's handled the same as one that moved.
+	if(!cpBBContainsBB(leaf->bb, bb) || !FilterEqual(leaf->filter, filter) || leaf->FILTER_DIRTY){
 		leaf->bb = GetBB(tree, leaf->obj);
+		leaf->filter = filter;
 		
-		root = SubtreeRemove(root, leaf, tree);
-		tree->root = SubtreeInsert(root, leaf, tree);
+		if(tree->updateMode == CP_BBTREE_UPDATE_REFIT){
+			tree->refitPending = cpTrue;
+		} else {
+			root = SubtreeRemove(root, leaf, tree);
+			tree->root = SubtreeInsert(root, leaf, tree);
+		}
 		
 		PairsClear(leaf, tree);
 		leaf->STAMP = GetMasterTree(tree)->stamp;
+		tree->flatDirty = cpTrue;
 		
 		return cpTrue;
 	} else {
@@ -516,6 +936,15 @@ LeafUpdate(Node *leaf, cpBBTree *tree)
 	}
 }
 
+// Refit the ancestors of a leaf that was updated outside of cpBBTreeReindexQuery().
+static void
+LeafRefit(Node *leaf, cpBBTree *tree)
+{
+	for(Node *node = leaf->parent; node; node = node->parent) NodeMergeChildren(node);
+	
+	tree->refitPending = cpFalse;
+}
+
 static cpCollisionID VoidQueryFunc(void *obj1, void *obj2, cpCollisionID id, void *data){return id;}
 
 static void
@@ -526,12 +955,12 @@ LeafAddPairs(Node *leaf, cpBBTree *tree)
 		Node *dynamicRoot = GetRootIfTree(dynamicIndex);
 		if(dynamicRoot){
 			cpBBTree *dynamicTree = GetTree(dynamicIndex);
-			MarkContext context = {dynamicTree, NULL, NULL, NULL};
+			MarkContext context = {dynamicTree, NULL, NULL, NULL, NULL};
 			MarkLeafQuery(dynamicRoot, leaf, cpTrue, &context);
 		}
 	} else {
 		Node *staticRoot = GetRootIfTree(tree->spatialIndex.staticIndex);
-		MarkContext context = {tree, staticRoot, VoidQueryFunc, NULL};
+		MarkContext context = {tree, staticRoot, VoidQueryFunc, NULL, NULL};
 		MarkLeaf(leaf, &context);
 	}
 }
@@ -562,15 +991,34 @@ cpBBTreeInit(cpBBTree *tree, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *static
 	cpSpatialIndexInit((cpSpatialIndex *)tree, Klass(), bbfunc, staticIndex);
 	
 	tree->velocityFunc = NULL;
+	tree->filterFunc = NULL;
 	
-	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql);
+	tree->leaves = cpHashSetNew(0, (cpHashSetEqlFunc)leafSetEql, tree->spatialIndex.allocator);
 	tree->root = NULL;
 	
 	tree->pooledNodes = NULL;
-	tree->allocatedBuffers = cpArrayNew(0);
+	tree->allocatedBuffers = cpArrayNew(0, tree->spatialIndex.allocator);
 	
 	tree->stamp = 0;
 	
+	tree->optimizationPasses = 0;
+	tree->opath = 0;
+	
+	tree->updateMode = CP_BBTREE_UPDATE_REINSERT;
+	tree->refitPending = cpFalse;
+	tree->refitRebuildRatio = 1.5f;
+	tree->refitBaseQuality = 0.0f;
+	tree->refitBaseCount = 0;
+	
+	tree->flatEnabled = cpFalse;
+	tree->flatDirty = cpTrue;
+	tree->flatNodes = NULL;
+	tree->flatFilters = NULL;
+	tree->flatLeaves = NULL;
+	tree->flatNodesMax = tree->flatLeavesMax = 0;
+	
+	tree->filterDirtyLeaves = cpArrayNew(0, tree->spatialIndex.allocator);
+	
 	return (cpSpatialIndex *)tree;
 }
 
@@ -585,10 +1033,103 @@ cpBBTreeSetVelocityFunc(cpSpatialIndex *index, cpBBTreeVelocityFunc func)
 	((cpBBTree *)index)->velocityFunc = func;
 }
 
+void
+cpBBTreeSetFilterFunc(cpSpatialIndex *index, cpBBTreeFilterFunc func)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetFilterFunc() call to non-tree spatial index.");
+		return;
+	}
+	
+	((cpBBTree *)index)->filterFunc = func;
+}
+
+void
+cpBBTreeUpdateFilter(cpSpatialIndex *index, void *obj, cpHashValue hashid)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeUpdateFilter() call to non-tree spatial index.");
+		return;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	Node *leaf = (Node *)cpHashSetFind(tree->leaves, hashid, obj);
+	if(!leaf) return;
+	
+	// This can be called from a query or collision callback, so the pairs and tree structure can't be touched yet.
+	// Widening the filters never makes a traversal skip anything it shouldn't, the exact filter is set when the leaf is reindexed.
+	cpShapeFilter filter = FilterMerge(leaf->filter, GetFilter(tree, obj));
+	for(Node *node = leaf; node; node = node->parent) node->filter = FilterMerge(node->filter, filter);
+	tree->flatDirty = cpTrue;
+	
+	if(!leaf->FILTER_DIRTY){
+		leaf->FILTER_DIRTY = cpTrue;
+		cpArrayPush(tree->filterDirtyLeaves, leaf);
+	}
+}
+
+void
+cpBBTreeSetFlatLayout(cpSpatialIndex *index, cpBool enabled)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetFlatLayout() call to non-tree spatial index.");
+		return;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	tree->flatEnabled = enabled;
+	tree->flatDirty = cpTrue;
+	
+	if(!enabled){
+		cpAllocatorFree(tree->spatialIndex.allocator, tree->flatNodes);
+		cpAllocatorFree(tree->spatialIndex.allocator, tree->flatFilters);
+		cpAllocatorFree(tree->spatialIndex.allocator, tree->flatLeaves);
+		tree->flatNodes = NULL;
+		tree->flatFilters = NULL;
+		tree->flatLeaves = NULL;
+		tree->flatNodesMax = tree->flatLeavesMax = 0;
+	}
+}
+
+void
+cpBBTreeSetUpdateMode(cpSpatialIndex *index, cpBBTreeUpdateMode mode)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetUpdateMode() call to non-tree spatial index.");
+		return;
+	}
+	
+	cpBBTree *tree = (cpBBTree *)index;
+	tree->updateMode = mode;
+	
+	// Rebuild the tree the next time it's refitted since its current quality is unknown.
+	tree->refitBaseCount = 0;
+}
+
+void
+cpBBTreeSetRefitRebuildRatio(cpSpatialIndex *index, cpFloat ratio)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetRefitRebuildRatio() call to non-tree spatial index.");
+		return;
+	}
+	
+	((cpBBTree *)index)->refitRebuildRatio = ratio;
+}
+
 cpSpatialIndex *
 cpBBTreeNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
 {
-	return cpBBTreeInit(cpBBTreeAlloc(), bbfunc, staticIndex);
+	return cpBBTreeNewWithAllocator(bbfunc, staticIndex, NULL);
+}
+
+cpSpatialIndex *
+cpBBTreeNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator)
+{
+	cpBBTree *tree = (cpBBTree *)cpAllocatorCalloc(allocator, 1, sizeof(cpBBTree));
+	tree->spatialIndex.allocator = allocator;
+	
+	return cpBBTreeInit(tree, bbfunc, staticIndex);
 }
 
 static void
@@ -596,8 +1137,14 @@ cpBBTreeDestroy(cpBBTree *tree)
 {
 	cpHashSetFree(tree->leaves);
 	
-	if(tree->allocatedBuffers) cpArrayFreeEach(tree->allocatedBuffers, cpfree);
+	if(tree->allocatedBuffers) cpArrayFreeElements(tree->allocatedBuffers);
 	cpArrayFree(tree->allocatedBuffers);
+	
+	cpAllocatorFree(tree->spatialIndex.allocator, tree->flatNodes);
+	cpAllocatorFree(tree->spatialIndex.allocator, tree->flatFilters);
+	cpAllocatorFree(tree->spatialIndex.allocator, tree->flatLeaves);
+	
+	cpArrayFree(tree->filterDirtyLeaves);
 }
 
 //MARK: Insert/Remove
@@ -613,6 +1160,8 @@ cpBBTreeInsert(cpBBTree *tree, void *obj, cpHashValue hashid)
 	leaf->STAMP = GetMasterTree(tree)->stamp;
 	LeafAddPairs(leaf, tree);
 	IncrementStamp(tree);
+	
+	tree->flatDirty = cpTrue;
 }
 
 static void
@@ -622,7 +1171,10 @@ cpBBTreeRemove(cpBBTree *tree, void *obj, cpHashValue hashid)
 	
 	tree->root = SubtreeRemove(tree->root, leaf, tree);
 	PairsClear(leaf, tree);
+	if(leaf->FILTER_DIRTY) cpArrayDeleteObj(tree->filterDirtyLeaves, leaf);
 	NodeRecycle(tree, leaf);
+	
+	tree->flatDirty = cpTrue;
 }
 
 static cpBool
@@ -635,22 +1187,64 @@ cpBBTreeContains(cpBBTree *tree, void *obj, cpHashValue hashid)
 
 static void LeafUpdateWrap(Node *leaf, cpBBTree *tree) {LeafUpdate(leaf, tree);}
 
+static void
+FilterDirtyLeavesClear(cpBBTree *tree)
+{
+	cpArray *leaves = tree->filterDirtyLeaves;
+	for(int i=0; i<leaves->num; i++) ((Node *)leaves->arr[i])->FILTER_DIRTY = cpFalse;
+	leaves->num = 0;
+}
+
+// Static leaves aren't updated every step, so the ones with new filters are reindexed individually.
+static void
+StaticFilterDirtyLeavesReindex(cpBBTree *staticTree)
+{
+	cpArray *leaves = staticTree->filterDirtyLeaves;
+	if(leaves->num == 0) return;
+	
+	for(int i=0; i<leaves->num; i++){
+		Node *leaf = (Node *)leaves->arr[i];
+		LeafUpdate(leaf, staticTree);
+		if(staticTree->refitPending) LeafRefit(leaf, staticTree);
+		LeafAddPairs(leaf, staticTree);
+	}
+	
+	FilterDirtyLeavesClear(staticTree);
+	IncrementStamp(staticTree);
+}
+
 static void
 cpBBTreeReindexQuery(cpBBTree *tree, cpSpatialIndexQueryFunc func, void *data)
 {
+	cpBBTree *staticTree = GetTree(tree->spatialIndex.staticIndex);
+	if(staticTree) StaticFilterDirtyLeavesReindex(staticTree);
+	if(tree->spatialIndex.dynamicIndex) StaticFilterDirtyLeavesReindex(tree);
+	
 	if(!tree->root) return;
 	
 	// LeafUpdate() may modify tree->root. Don't cache it.
 	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)LeafUpdateWrap, tree);
+	FilterDirtyLeavesClear(tree);
+	
+	// In refit mode the leaves have new bounds, but the internal nodes above them don't yet.
+	cpBool rebuild = cpFalse;
+	if(tree->refitPending){
+		rebuild = RefitNeedsRebuild(tree, SubtreeRefit(tree->root));
+		tree->refitPending = cpFalse;
+	}
 	
 	cpSpatialIndex *staticIndex = tree->spatialIndex.staticIndex;
 	Node *staticRoot = (staticIndex && staticIndex->klass == Klass() ? ((cpBBTree *)staticIndex)->root : NULL);
 	
-	MarkContext context = {tree, staticRoot, func, data};
+	MarkContext context = {tree, staticRoot, func, data, (staticTree && FlatUpdate(staticTree) ? staticTree : NULL)};
 	MarkSubtree(tree->root, &context);
 	if(staticIndex && !staticRoot) cpSpatialIndexCollideStatic((cpSpatialIndex *)tree, staticIndex, func, data);
 	
 	IncrementStamp(tree);
+	
+	// Restructuring the tree doesn't affect the pairs, but it must not happen while they are being marked.
+	if(rebuild) cpBBTreeOptimize((cpSpatialIndex *)tree);
+	OptimizeIncremental(tree, tree->optimizationPasses);
 }
 
 static void
@@ -664,7 +1258,10 @@ cpBBTreeReindexObject(cpBBTree *tree, void *obj, cpHashValue hashid)
 {
 	Node *leaf = (Node *)cpHashSetFind(tree->leaves, hashid, obj);
 	if(leaf){
-		if(LeafUpdate(leaf, tree)) LeafAddPairs(leaf, tree);
+		if(LeafUpdate(leaf, tree)){
+			if(tree->refitPending) LeafRefit(leaf, tree);
+			LeafAddPairs(leaf, tree);
+		}
 		IncrementStamp(tree);
 	}
 }
@@ -672,16 +1269,58 @@ cpBBTreeReindexObject(cpBBTree *tree, void *obj, cpHashValue hashid)
 //MARK: Query
 
 static void
-cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+SegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, const cpShapeFilter *filter, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	Node *root = tree->root;
-	if(root) SubtreeSegmentQuery(root, obj, a, b, t_exit, func, data);
+	if(FlatUpdate(tree)){
+		FlatSegmentQuery(tree, 0, obj, a, b, t_exit, filter, func, data);
+	} else if(root && !(filter && cpShapeFilterReject(*filter, root->filter))){
+		SubtreeSegmentQuery(root, obj, a, b, t_exit, filter, func, data);
+	}
+}
+
+static void
+Query(cpBBTree *tree, void *obj, cpBB bb, const cpShapeFilter *filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(FlatUpdate(tree)){
+		FlatQuery(tree, 0, obj, bb, FlatBBNew(bb), filter, func, data);
+	} else if(tree->root){
+		SubtreeQuery(tree->root, obj, bb, filter, func, data);
+	}
+}
+
+static void
+cpBBTreeSegmentQuery(cpBBTree *tree, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	SegmentQuery(tree, obj, a, b, t_exit, NULL, func, data);
 }
 
 static void
 cpBBTreeQuery(cpBBTree *tree, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	if(tree->root) SubtreeQuery(tree->root, obj, bb, func, data);
+	Query(tree, obj, bb, NULL, func, data);
+}
+
+void
+cpBBTreeQueryFiltered(cpSpatialIndex *index, void *obj, cpBB bb, cpShapeFilter filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeQueryFiltered() call to non-tree spatial index.");
+		return;
+	}
+	
+	Query((cpBBTree *)index, obj, bb, &filter, func, data);
+}
+
+void
+cpBBTreeSegmentQueryFiltered(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpShapeFilter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(index->klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSegmentQueryFiltered() call to non-tree spatial index.");
+		return;
+	}
+	
+	SegmentQuery((cpBBTree *)index, obj, a, b, t_exit, &filter, func, data);
 }
 
 //MARK: Misc
@@ -726,13 +1365,14 @@ static cpSpatialIndexClass klass = {
 
 static inline cpSpatialIndexClass *Klass(){return &klass;}
 
+cpBool
+cpSpatialIndexIsBBTree(cpSpatialIndex *index)
+{
+	return (index->klass == Klass());
+}
 
-//MARK: Tree Optimization
 
-static int
-cpfcompare(const cpFloat *a, const cpFloat *b){
-	return (*a < *b ? -1 : (*b < *a ? 1 : 0));
-}
+//MARK: Tree Optimization
 
 static void
 fillNodeArray(Node *node, Node ***cursor){
@@ -740,92 +1380,187 @@ fillNodeArray(Node *node, Node ***cursor){
 	(*cursor)++;
 }
 
-static Node *
-partitionNodes(cpBBTree *tree, Node **nodes, int count)
+// Number of bins used to estimate the surface area heuristic when splitting a set of leaves.
+#define SAH_BINS 16
+
+// Subtrees with at most this many leaves are built by a single task in cpBBTreeOptimizeParallel().
+#define SAH_TASK_LEAVES 1024
+
+typedef struct SAHBin {
+	cpBB bb;
+	int count;
+} SAHBin;
+
+static inline cpFloat
+LeafCenter(Node *leaf, int axis)
 {
-	if(count == 1){
-		return nodes[0];
-	} else if(count == 2) {
-		return NodeNew(tree, nodes[0], nodes[1]);
+	// Scaled by 2, but only the relative positions matter.
+	return (axis == 0 ? leaf->bb.l + leaf->bb.r : leaf->bb.b + leaf->bb.t);
+}
+
+static inline void
+SAHBinAdd(SAHBin *bin, cpBB bb)
+{
+	bin->bb = (bin->count ? cpBBMerge(bin->bb, bb) : bb);
+	bin->count++;
+}
+
+static inline void
+SAHBinMerge(SAHBin *bin, SAHBin *other)
+{
+	if(other->count == 0) return;
+	
+	bin->bb = (bin->count ? cpBBMerge(bin->bb, other->bb) : other->bb);
+	bin->count += other->count;
+}
+
+static inline int
+SAHBinIndex(cpFloat center, cpFloat min, cpFloat scale)
+{
+	// Clamp before converting to an int. Infinite boxes have NaN or infinite centers, and the negated test catches NaN too.
+	cpFloat offset = (center - min)*scale;
+	if(!(offset >= 0.0f)) return 0;
+	return (offset < SAH_BINS ? (int)offset : SAH_BINS - 1);
+}
+
+// Reorder the leaves so that the first half of the best binned SAH split comes first, and return the size of the first half.
+// Also sets the bounds and filter of the node the leaves are being partitioned for.
+static int
+SAHPartition(Node **leaves, int count, Node *node)
+{
+	cpBB bounds = leaves[0]->bb;
+	cpShapeFilter filter = leaves[0]->filter;
+	cpBB centers = cpBBNew(LeafCenter(leaves[0], 0), LeafCenter(leaves[0], 1), LeafCenter(leaves[0], 0), LeafCenter(leaves[0], 1));
+	for(int i=1; i<count; i++){
+		bounds = cpBBMerge(bounds, leaves[i]->bb);
+		filter = FilterMerge(filter, leaves[i]->filter);
+		centers = cpBBExpand(centers, cpv(LeafCenter(leaves[i], 0), LeafCenter(leaves[i], 1)));
 	}
 	
-	// Find the AABB for these nodes
-	cpBB bb = nodes[0]->bb;
-	for(int i=1; i<count; i++) bb = cpBBMerge(bb, nodes[i]->bb);
+	node->bb = bounds;
+	node->filter = filter;
+	if(count == 2) return 1;
 	
-	// Split it on it's longest axis
-	cpBool splitWidth = (bb.r - bb.l > bb.t - bb.b);
+	cpFloat best_cost = INFINITY;
+	int best_axis = -1, best_split = 0;
 	
-	// Sort the bounds and use the median as the splitting point
-	cpFloat *bounds = (cpFloat *)cpcalloc(count*2, sizeof(cpFloat));
-	if(splitWidth){
-		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.l;
-			bounds[2*i + 1] = nodes[i]->bb.r;
+	for(int axis=0; axis<2; axis++){
+		cpFloat min = (axis == 0 ? centers.l : centers.b);
+		cpFloat max = (axis == 0 ? centers.r : centers.t);
+		if(max <= min) continue;
+		
+		cpFloat scale = SAH_BINS/(max - min);
+		SAHBin bins[SAH_BINS];
+		for(int i=0; i<SAH_BINS; i++) bins[i].count = 0;
+		for(int i=0; i<count; i++) SAHBinAdd(bins + SAHBinIndex(LeafCenter(leaves[i], axis), min, scale), leaves[i]->bb);
+		
+		// Sweep from the right to find the cost of the right side of each split.
+		cpFloat right_costs[SAH_BINS];
+		SAHBin right = {cpBBNew(0.0f, 0.0f, 0.0f, 0.0f), 0};
+		for(int split=SAH_BINS - 1; split>0; split--){
+			SAHBinMerge(&right, bins + split);
+			right_costs[split] = cpBBArea(right.bb)*right.count;
 		}
-	} else {
-		for(int i=0; i<count; i++){
-			bounds[2*i + 0] = nodes[i]->bb.b;
-			bounds[2*i + 1] = nodes[i]->bb.t;
+		
+		// Then sweep from the left and add the costs of the left sides.
+		SAHBin left = {cpBBNew(0.0f, 0.0f, 0.0f, 0.0f), 0};
+		for(int split=1; split<SAH_BINS; split++){
+			SAHBinMerge(&left, bins + split - 1);
+			
+			cpFloat cost = cpBBArea(left.bb)*left.count + right_costs[split];
+			if(left.count > 0 && left.count < count && cost < best_cost){
+				best_cost = cost;
+				best_axis = axis;
+				best_split = split;
+			}
 		}
 	}
 	
-	qsort(bounds, count*2, sizeof(cpFloat), (int (*)(const void *, const void *))cpfcompare);
-	cpFloat split = (bounds[count - 1] + bounds[count])*0.5f; // use the medain as the split
-	cpfree(bounds);
-
-	// Generate the child BBs
-	cpBB a = bb, b = bb;
-	if(splitWidth) a.r = b.l = split; else a.t = b.b = split;
+	// All of the centers are in the same spot. Any split is as good as any other.
+	if(best_axis < 0) return count/2;
+	
+	cpFloat min = (best_axis == 0 ? centers.l : centers.b);
+	cpFloat max = (best_axis == 0 ? centers.r : centers.t);
+	cpFloat scale = SAH_BINS/(max - min);
 	
-	// Partition the nodes
 	int right = count;
 	for(int left=0; left < right;){
-		Node *node = nodes[left];
-		if(cpBBMergedArea(node->bb, b) < cpBBMergedArea(node->bb, a)){
-//		if(cpBBProximity(node->bb, b) < cpBBProximity(node->bb, a)){
+		Node *leaf = leaves[left];
+		if(SAHBinIndex(LeafCenter(leaf, best_axis), min, scale) >= best_split){
 			right--;
-			nodes[left] = nodes[right];
-			nodes[right] = node;
+			leaves[left] = leaves[right];
+			leaves[right] = leaf;
 		} else {
 			left++;
 		}
 	}
 	
-	if(right == count){
-		Node *node = NULL;
-		for(int i=0; i<count; i++) node = SubtreeInsert(node, nodes[i], tree);
-		return node;
+	return right;
+}
+
+typedef struct SAHTask {
+	Node **leaves;
+	int count;
+	Node **internal;
+	Node *parent;
+	cpBool sideA;
+} SAHTask;
+
+typedef struct SAHContext {
+	// Subtrees to build later as parallel tasks, or NULL to build everything immediately.
+	SAHTask *tasks;
+	int taskCount, taskMax;
+	cpAllocator *allocator;
+	
+	Node *root;
+} SAHContext;
+
+// Build a subtree from the leaves and link it to its parent.
+// A tree with n leaves needs exactly n - 1 internal nodes, so each subtree takes a fixed slice of the internal node array.
+// That lets separate subtrees be built at the same time without sharing the node pool.
+static void
+SAHBuild(SAHContext *context, Node **leaves, int count, Node **internal, Node *parent, cpBool sideA)
+{
+	Node *node;
+	
+	if(count == 1){
+		node = leaves[0];
+	} else if(context->tasks && count <= SAH_TASK_LEAVES){
+		if(context->taskCount == context->taskMax){
+			context->taskMax *= 2;
+			context->tasks = (SAHTask *)cpAllocatorRealloc(context->allocator, context->tasks, context->taskMax*sizeof(SAHTask));
+		}
+		
+		SAHTask task = {leaves, count, internal, parent, sideA};
+		context->tasks[context->taskCount++] = task;
+		return;
+	} else {
+		node = internal[0];
+		node->obj = NULL;
+		
+		int split = SAHPartition(leaves, count, node);
+		SAHBuild(context, leaves, split, internal + 1, node, cpTrue);
+		SAHBuild(context, leaves + split, count - split, internal + split, node, cpFalse);
 	}
 	
-	// Recurse and build the node!
-	return NodeNew(tree,
-		partitionNodes(tree, nodes, right),
-		partitionNodes(tree, nodes + right, count - right)
-	);
-}
-
-//static void
-//cpBBTreeOptimizeIncremental(cpBBTree *tree, int passes)
-//{
-//	for(int i=0; i<passes; i++){
-//		Node *root = tree->root;
-//		Node *node = root;
-//		int bit = 0;
-//		unsigned int path = tree->opath;
-//		
-//		while(!NodeIsLeaf(node)){
-//			node = (path&(1<<bit) ? node->a : node->b);
-//			bit = (bit + 1)&(sizeof(unsigned int)*8 - 1);
-//		}
-//		
-//		root = subtreeRemove(root, node, tree);
-//		tree->root = subtreeInsert(root, node, tree);
-//	}
-//}
+	if(parent){
+		if(sideA) NodeSetA(parent, node); else NodeSetB(parent, node);
+	} else {
+		node->parent = NULL;
+		context->root = node;
+	}
+}
+
+static void
+SAHBuildTask(SAHContext *context, unsigned long index, unsigned long thread)
+{
+	SAHTask *task = context->tasks + index;
+	SAHContext serial = {NULL, 0, 0, NULL, NULL};
+	SAHBuild(&serial, task->leaves, task->count, task->internal, task->parent, task->sideA);
+}
 
 void
-cpBBTreeOptimize(cpSpatialIndex *index)
+cpBBTreeOptimizeParallel(cpSpatialIndex *index, cpBBTreeRunTasksFunc run, void *runner)
 {
 	if(index->klass != &klass){
 		cpAssertWarn(cpFalse, "Ignoring cpBBTreeOptimize() call to non-tree spatial index.");
@@ -837,14 +1572,126 @@ cpBBTreeOptimize(cpSpatialIndex *index)
 	if(!root) return;
 	
 	int count = cpBBTreeCount(tree);
-	Node **nodes = (Node **)cpcalloc(count, sizeof(Node *));
+	Node **nodes = (Node **)cpAllocatorCalloc(tree->spatialIndex.allocator, 2*count, sizeof(Node *));
 	Node **cursor = nodes;
 	
 	cpHashSetEach(tree->leaves, (cpHashSetIteratorFunc)fillNodeArray, &cursor);
 	
+	// Reuse the old internal nodes for the new tree.
 	SubtreeRecycle(tree, root);
-	tree->root = partitionNodes(tree, nodes, count);
-	cpfree(nodes);
+	Node **internal = nodes + count;
+	for(int i=0; i<count - 1; i++) internal[i] = NodeFromPool(tree);
+	
+	SAHContext context = {NULL, 0, 0, tree->spatialIndex.allocator, NULL};
+	if(run && count > SAH_TASK_LEAVES){
+		context.taskMax = 16;
+		context.tasks = (SAHTask *)cpAllocatorCalloc(context.allocator, context.taskMax, sizeof(SAHTask));
+	}
+	
+	SAHBuild(&context, nodes, count, internal, NULL, cpFalse);
+	
+	if(context.tasks){
+		run(runner, context.taskCount, (cpBBTreeTaskFunc)SAHBuildTask, &context);
+		cpAllocatorFree(context.allocator, context.tasks);
+	}
+	
+	tree->root = context.root;
+	cpAllocatorFree(tree->spatialIndex.allocator, nodes);
+	
+	tree->flatDirty = cpTrue;
+	if(tree->updateMode == CP_BBTREE_UPDATE_REFIT) RefitResetQuality(tree);
+}
+
+void
+cpBBTreeOptimize(cpSpatialIndex *index)
+{
+	cpBBTreeOptimizeParallel(index, NULL, NULL);
+}
+
+// Swap the child of node with the grandchild under its other child that reduces the area of the tree the most.
+// The bounds of node don't change since it still contains the same leaves.
+static void
+NodeRotate(Node *node)
+{
+	Node *a = node->A, *b = node->B;
+	cpFloat best = 0.0f;
+	int rotation = 0;
+	
+	if(!NodeIsLeaf(a)){
+		cpFloat area = cpBBArea(a->bb);
+		cpFloat cost_b_a1 = cpBBMergedArea(b->bb, a->B->bb) - area;
+		cpFloat cost_b_a2 = cpBBMergedArea(b->bb, a->A->bb) - area;
+		if(cost_b_a1 < best){best = cost_b_a1; rotation = 1;}
+		if(cost_b_a2 < best){best = cost_b_a2; rotation = 2;}
+	}
+	
+	if(!NodeIsLeaf(b)){
+		cpFloat area = cpBBArea(b->bb);
+		cpFloat cost_a_b1 = cpBBMergedArea(a->bb, b->B->bb) - area;
+		cpFloat cost_a_b2 = cpBBMergedArea(a->bb, b->A->bb) - area;
+		if(cost_a_b1 < best){best = cost_a_b1; rotation = 3;}
+		if(cost_a_b2 < best){best = cost_a_b2; rotation = 4;}
+	}
+	
+	switch(rotation){
+		case 1: NodeSetB(node, a->A); NodeSetA(a, b); break;
+		case 2: NodeSetB(node, a->B); NodeSetB(a, b); break;
+		case 3: NodeSetA(node, b->A); NodeSetA(b, a); break;
+		case 4: NodeSetA(node, b->B); NodeSetB(b, a); break;
+		default: return;
+	}
+	
+	NodeMergeChildren(rotation <= 2 ? a : b);
+}
+
+static void
+OptimizeIncremental(cpBBTree *tree, int passes)
+{
+	if(passes <= 0) return;
+	
+	for(int i=0; i<passes; i++){
+		if(!tree->root || NodeIsLeaf(tree->root)) break;
+		
+		// Walk down a different path each pass, using the bits of the counter to pick the children.
+		// Incrementing the counter flips the low bits first, so consecutive passes spread out across the top of the tree.
+		unsigned int path = tree->opath++;
+		int bit = 0;
+		
+		Node *node = tree->root;
+		while(!NodeIsLeaf(node)){
+			NodeRotate(node);
+			node = (path&(1u<<bit) ? node->B : node->A);
+			bit = (bit + 1)&(sizeof(unsigned int)*8 - 1);
+		}
+		
+		// Reinsert the leaf at the end of the path to find it a better spot.
+		Node *root = SubtreeRemove(tree->root, node, tree);
+		tree->root = SubtreeInsert(root, node, tree);
+	}
+	
+	tree->flatDirty = cpTrue;
+}
+
+void
+cpBBTreeOptimizeIncremental(cpSpatialIndex *index, int passes)
+{
+	if(index->klass != &klass){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeOptimizeIncremental() call to non-tree spatial index.");
+		return;
+	}
+	
+	OptimizeIncremental((cpBBTree *)index, passes);
+}
+
+void
+cpBBTreeSetOptimizationPasses(cpSpatialIndex *index, int passes)
+{
+	if(index->klass != &klass){
+		cpAssertWarn(cpFalse, "Ignoring cpBBTreeSetOptimizationPasses() call to non-tree spatial index.");
+		return;
+	}
+	
+	((cpBBTree *)index)->optimizationPasses = passes;
 }
 
 //MARK: Debug Draw
@@ -40,6 +40,7 @@ cpBodyInit(cpBody *body, cpFloat mass, cpFloat moment)
 	
 	body->velocity_func = cpBodyUpdateVelocity;
 	body->position_func = cpBodyUpdatePosition;
+	body->threadSafeFuncs = cpFalse;
 	
 	body->sleeping.root = NULL;
 	body->sleeping.next = NULL;
@@ -57,6 +58,9 @@ cpBodyInit(cpBody *body, cpFloat mass, cpFloat moment)
 	
 	body->userData = NULL;
 	
+	// Not in a hasty space's solver until it steps.
+	body->solverIndex = -1;
+	
 	// Setters must be called after full initialization so the sanity checks don't assert on garbage data.
 	cpBodySetMass(body, mass);
 	cpBodySetMoment(body, moment);
@@ -490,6 +494,18 @@ cpBodySetPositionUpdateFunc(cpBody *body, cpBodyPositionFunc positionFunc)
 	body->position_func = positionFunc;
 }
 
+cpBool
+cpBodyGetThreadSafeUpdateFuncs(const cpBody *body)
+{
+	return body->threadSafeFuncs;
+}
+
+void
+cpBodySetThreadSafeUpdateFuncs(cpBody *body, cpBool threadSafe)
+{
+	body->threadSafeFuncs = threadSafe;
+}
+
 void
 cpBodyUpdateVelocity(cpBody *body, cpVect gravity, cpFloat damping, cpFloat dt)
 {
@@ -127,6 +127,9 @@ cpConstraintSetCollideBodies(cpConstraint *constraint, cpBool collideBodies)
 {
 	cpConstraintActivateBodies(constraint);
 	constraint->collideBodies = collideBodies;
+	
+	cpSpace *space = constraint->space;
+	if(space) cpSpaceUpdateNoCollidePair(space, constraint->a, constraint->b);
 }
 
 cpConstraintPreSolveFunc
@@ -99,6 +99,7 @@ cpDampedRotarySpringInit(cpDampedRotarySpring *spring, cpBody *a, cpBody *b, cpF
 	spring->stiffness = stiffness;
 	spring->damping = damping;
 	spring->springTorqueFunc = (cpDampedRotarySpringTorqueFunc)defaultSpringTorque;
+	spring->threadSafeFunc = cpFalse;
 	
 	spring->jAcc = 0.0f;
 	
@@ -176,3 +177,24 @@ cpDampedRotarySpringSetSpringTorqueFunc(cpConstraint *constraint, cpDampedRotary
 	cpConstraintActivateBodies(constraint);
 	((cpDampedRotarySpring *)constraint)->springTorqueFunc = springTorqueFunc;
 }
+
+cpBool
+cpDampedRotarySpringGetThreadSafeSpringTorqueFunc(const cpConstraint *constraint)
+{
+	cpAssertHard(cpConstraintIsDampedRotarySpring(constraint), "Constraint is not a damped rotary spring.");
+	return ((cpDampedRotarySpring *)constraint)->threadSafeFunc;
+}
+
+void
+cpDampedRotarySpringSetThreadSafeSpringTorqueFunc(cpConstraint *constraint, cpBool threadSafe)
+{
+	cpAssertHard(cpConstraintIsDampedRotarySpring(constraint), "Constraint is not a damped rotary spring.");
+	((cpDampedRotarySpring *)constraint)->threadSafeFunc = threadSafe;
+}
+
+cpBool
+cpDampedRotarySpringPreStepThreadSafe(const cpConstraint *constraint)
+{
+	cpDampedRotarySpring *spring = (cpDampedRotarySpring *)constraint;
+	return (spring->springTorqueFunc == (cpDampedRotarySpringTorqueFunc)defaultSpringTorque || spring->threadSafeFunc);
+}
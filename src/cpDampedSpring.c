@@ -107,6 +107,7 @@ cpDampedSpringInit(cpDampedSpring *spring, cpBody *a, cpBody *b, cpVect anchorA,
 	spring->stiffness = stiffness;
 	spring->damping = damping;
 	spring->springForceFunc = (cpDampedSpringForceFunc)defaultSpringForce;
+	spring->threadSafeFunc = cpFalse;
 	
 	spring->jAcc = 0.0f;
 	
@@ -214,3 +215,24 @@ cpDampedSpringSetSpringForceFunc(cpConstraint *constraint, cpDampedSpringForceFu
 	cpConstraintActivateBodies(constraint);
 	((cpDampedSpring *)constraint)->springForceFunc = springForceFunc;
 }
+
+cpBool
+cpDampedSpringGetThreadSafeSpringForceFunc(const cpConstraint *constraint)
+{
+	cpAssertHard(cpConstraintIsDampedSpring(constraint), "Constraint is not a damped spring.");
+	return ((cpDampedSpring *)constraint)->threadSafeFunc;
+}
+
+void
+cpDampedSpringSetThreadSafeSpringForceFunc(cpConstraint *constraint, cpBool threadSafe)
+{
+	cpAssertHard(cpConstraintIsDampedSpring(constraint), "Constraint is not a damped spring.");
+	((cpDampedSpring *)constraint)->threadSafeFunc = threadSafe;
+}
+
+cpBool
+cpDampedSpringPreStepThreadSafe(const cpConstraint *constraint)
+{
+	cpDampedSpring *spring = (cpDampedSpring *)constraint;
+	return (spring->springForceFunc == (cpDampedSpringForceFunc)defaultSpringForce || spring->threadSafeFunc);
+}
@@ -20,12 +20,14 @@
  */
 
 #include "chipmunk/chipmunk_private.h"
-#include "prime.h"
 
+// Open addressed table using robin hood hashing.
+// Elements are moved towards the start of their probe sequence when one before them is removed, so no tombstones are needed.
 typedef struct cpHashSetBin {
-	void *elt;
+	// Mixed hash of the element, the low bits give the index of the bin it would ideally be in.
 	cpHashValue hash;
-	struct cpHashSetBin *next;
+	// NULL for an empty bin.
+	void *elt;
 } cpHashSetBin;
 
 struct cpHashSet {
@@ -34,40 +36,43 @@ struct cpHashSet {
 	cpHashSetEqlFunc eql;
 	void *default_value;
 	
-	cpHashSetBin **table;
-	cpHashSetBin *pooledBins;
+	// size is a power of two.
+	cpHashSetBin *table;
 	
-	cpArray *allocatedBuffers;
+	cpAllocator *allocator;
 };
 
 void
 cpHashSetFree(cpHashSet *set)
 {
 	if(set){
-		cpfree(set->table);
-		
-		cpArrayFreeEach(set->allocatedBuffers, cpfree);
-		cpArrayFree(set->allocatedBuffers);
-		
-		cpfree(set);
+		cpAllocator *allocator = set->allocator;
+		cpAllocatorFree(allocator, set->table);
+		cpAllocatorFree(allocator, set);
 	}
 }
 
+static unsigned int
+tableSizeFor(unsigned int entries)
+{
+	unsigned int size = 8;
+	while(size*3 < entries*4) size *= 2;
+	return size;
+}
+
 cpHashSet *
-cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc)
+cpHashSetNew(int size, cpHashSetEqlFunc eqlFunc, cpAllocator *allocator)
 {
-	cpHashSet *set = (cpHashSet *)cpcalloc(1, sizeof(cpHashSet));
+	cpHashSet *set = (cpHashSet *)cpAllocatorCalloc(allocator, 1, sizeof(cpHashSet));
 	
-	set->size = next_prime(size);
+	set->size = tableSizeFor(size);
 	set->entries = 0;
 	
 	set->eql = eqlFunc;
 	set->default_value = NULL;
 	
-	set->table = (cpHashSetBin **)cpcalloc(set->size, sizeof(cpHashSetBin *));
-	set->pooledBins = NULL;
-	
-	set->allocatedBuffers = cpArrayNew(0);
+	set->allocator = allocator;
+	set->table = (cpHashSetBin *)cpAllocatorCalloc(allocator, set->size, sizeof(cpHashSetBin));
 	
 	return set;
 }
@@ -78,69 +83,106 @@ cpHashSetSetDefaultValue(cpHashSet *set, void *default_value)
 	set->default_value = default_value;
 }
 
+// Most hashes are sums or products of sequential IDs, so the high bits are mixed into the low ones used for the index.
+// The mixing can be undone, so two elements have the same mixed hash only if they have the same hash.
+static inline cpHashValue
+hashMix(cpHashValue hash)
+{
+	hash ^= hash >> (sizeof(cpHashValue)*4);
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+	return hash;
+}
+
+// How far a bin is from the one its element would ideally be in.
+static inline unsigned int
+binDistance(cpHashSet *set, unsigned int idx)
+{
+	return (idx - (unsigned int)set->table[idx].hash) & (set->size - 1);
+}
+
 static int
 setIsFull(cpHashSet *set)
 {
-	return (set->entries >= set->size);
+	return (set->entries*4 > set->size*3);
 }
 
+// Insert an element that isn't in the set yet.
 static void
-cpHashSetResize(cpHashSet *set)
+setPlace(cpHashSet *set, cpHashValue hash, void *elt)
 {
-	// Get the next approximate doubled prime.
-	unsigned int newSize = next_prime(set->size + 1);
-	// Allocate a new table.
-	cpHashSetBin **newTable = (cpHashSetBin **)cpcalloc(newSize, sizeof(cpHashSetBin *));
-	
-	// Iterate over the chains.
-	for(unsigned int i=0; i<set->size; i++){
-		// Rehash the bins into the new table.
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			
-			cpHashValue idx = bin->hash%newSize;
-			bin->next = newTable[idx];
-			newTable[idx] = bin;
+	unsigned int mask = set->size - 1;
+	unsigned int idx = hash & mask;
+	
+	for(unsigned int dist = 0;; idx = (idx + 1) & mask, dist++){
+		cpHashSetBin *bin = set->table + idx;
+		if(!bin->elt){
+			bin->hash = hash;
+			bin->elt = elt;
+			return;
+		}
+		
+		// Take the bin from elements that are closer to their ideal bin, and keep going with the one that was displaced.
+		unsigned int binDist = binDistance(set, idx);
+		if(binDist < dist){
+			cpHashSetBin displaced = (*bin);
+			bin->hash = hash;
+			bin->elt = elt;
 			
-			bin = next;
+			hash = displaced.hash;
+			elt = displaced.elt;
+			dist = binDist;
 		}
 	}
+}
+
+static void
+cpHashSetResize(cpHashSet *set)
+{
+	cpHashSetBin *oldTable = set->table;
+	unsigned int oldSize = set->size;
 	
-	cpfree(set->table);
+	set->size = oldSize*2;
+	set->table = (cpHashSetBin *)cpAllocatorCalloc(set->allocator, set->size, sizeof(cpHashSetBin));
 	
-	set->table = newTable;
-	set->size = newSize;
+	for(unsigned int i=0; i<oldSize; i++){
+		if(oldTable[i].elt) setPlace(set, oldTable[i].hash, oldTable[i].elt);
+	}
+	
+	cpAllocatorFree(set->allocator, oldTable);
 }
 
-static inline void
-recycleBin(cpHashSet *set, cpHashSetBin *bin)
+// Returns the index of the bin with the matching element, or -1.
+static inline int
+setLookup(cpHashSet *set, cpHashValue hash, void *ptr)
 {
-	bin->next = set->pooledBins;
-	set->pooledBins = bin;
-	bin->elt = NULL;
+	unsigned int mask = set->size - 1;
+	unsigned int idx = hash & mask;
+	
+	for(unsigned int dist = 0;; idx = (idx + 1) & mask, dist++){
+		cpHashSetBin *bin = set->table + idx;
+		
+		// A matching element would have displaced any element closer to its ideal bin than this.
+		if(!bin->elt || binDistance(set, idx) < dist) return -1;
+		// Comparing the hashes first skips calling eql() for almost all of the other elements.
+		if(bin->hash == hash && set->eql(ptr, bin->elt)) return (int)idx;
+	}
 }
 
-static cpHashSetBin *
-getUnusedBin(cpHashSet *set)
+// Shift the elements after a removed one back towards their ideal bins.
+static void
+setRemoveBin(cpHashSet *set, unsigned int idx)
 {
-	cpHashSetBin *bin = set->pooledBins;
+	unsigned int mask = set->size - 1;
+	cpHashSetBin *table = set->table;
 	
-	if(bin){
-		set->pooledBins = bin->next;
-		return bin;
-	} else {
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpHashSetBin);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		cpHashSetBin *buffer = (cpHashSetBin *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(set->allocatedBuffers, buffer);
-		
-		// push all but the first one, return it instead
-		for(int i=1; i<count; i++) recycleBin(set, buffer + i);
-		return buffer;
+	for(unsigned int next = (idx + 1) & mask; table[next].elt && binDistance(set, next) > 0; next = (next + 1) & mask){
+		table[idx] = table[next];
+		idx = next;
 	}
+	
+	table[idx].elt = NULL;
+	set->entries--;
 }
 
 int
@@ -152,51 +194,31 @@ cpHashSetCount(cpHashSet *set)
 void *
 cpHashSetInsert(cpHashSet *set, cpHashValue hash, void *ptr, cpHashSetTransFunc trans, void *data)
 {
-	cpHashValue idx = hash%set->size;
+	hash = hashMix(hash);
 	
 	// Find the bin with the matching element.
-	cpHashSetBin *bin = set->table[idx];
-	while(bin && !set->eql(ptr, bin->elt))
-		bin = bin->next;
+	int idx = setLookup(set, hash, ptr);
+	if(idx >= 0) return set->table[idx].elt;
 	
 	// Create it if necessary.
-	if(!bin){
-		bin = getUnusedBin(set);
-		bin->hash = hash;
-		bin->elt = (trans ? trans(ptr, data) : data);
-		
-		bin->next = set->table[idx];
-		set->table[idx] = bin;
-		
-		set->entries++;
-		if(setIsFull(set)) cpHashSetResize(set);
-	}
+	void *elt = (trans ? trans(ptr, data) : data);
+	
+	set->entries++;
+	if(setIsFull(set)) cpHashSetResize(set);
+	setPlace(set, hash, elt);
 	
-	return bin->elt;
+	return elt;
 }
 
 void *
 cpHashSetRemove(cpHashSet *set, cpHashValue hash, void *ptr)
 {
-	cpHashValue idx = hash%set->size;
-	
-	cpHashSetBin **prev_ptr = &set->table[idx];
-	cpHashSetBin *bin = set->table[idx];
-	
-	// Find the bin
-	while(bin && !set->eql(ptr, bin->elt)){
-		prev_ptr = &bin->next;
-		bin = bin->next;
-	}
+	int idx = setLookup(set, hashMix(hash), ptr);
 	
 	// Remove it if it exists.
-	if(bin){
-		// Update the previous linked list pointer
-		(*prev_ptr) = bin->next;
-		set->entries--;
-		
-		void *elt = bin->elt;
-		recycleBin(set, bin);
+	if(idx >= 0){
+		void *elt = set->table[idx].elt;
+		setRemoveBin(set, idx);
 		
 		return elt;
 	}
@@ -206,48 +228,46 @@ cpHashSetRemove(cpHashSet *set, cpHashValue hash, void *ptr)
 
 void *
 cpHashSetFind(cpHashSet *set, cpHashValue hash, void *ptr)
-{	
-	cpHashValue idx = hash%set->size;
-	cpHashSetBin *bin = set->table[idx];
-	while(bin && !set->eql(ptr, bin->elt))
-		bin = bin->next;
-		
-	return (bin ? bin->elt : set->default_value);
+{
+	int idx = setLookup(set, hashMix(hash), ptr);
+	return (idx >= 0 ? set->table[idx].elt : set->default_value);
 }
 
+// Index of an empty bin. The table is never full, so there is always one.
+static unsigned int
+setEmptyBin(cpHashSet *set)
+{
+	unsigned int idx = 0;
+	while(set->table[idx].elt) idx++;
+	return idx;
+}
+
+// Both of the iterators walk the table backwards starting from an empty bin.
+// Removing an element only shifts elements that come after it in the table, and those have already been visited.
+// This lets the callbacks remove the element they were called with, the same as when the set was chained.
+
 void
 cpHashSetEach(cpHashSet *set, cpHashSetIteratorFunc func, void *data)
 {
-	for(unsigned int i=0; i<set->size; i++){
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			func(bin->elt, data);
-			bin = next;
-		}
+	if(set->entries == 0) return;
+	
+	unsigned int mask = set->size - 1;
+	unsigned int empty = setEmptyBin(set);
+	for(unsigned int idx = (empty - 1) & mask; idx != empty; idx = (idx - 1) & mask){
+		void *elt = set->table[idx].elt;
+		if(elt) func(elt, data);
 	}
 }
 
 void
 cpHashSetFilter(cpHashSet *set, cpHashSetFilterFunc func, void *data)
 {
-	for(unsigned int i=0; i<set->size; i++){
-		// The rest works similarly to cpHashSetRemove() above.
-		cpHashSetBin **prev_ptr = &set->table[i];
-		cpHashSetBin *bin = set->table[i];
-		while(bin){
-			cpHashSetBin *next = bin->next;
-			
-			if(func(bin->elt, data)){
-				prev_ptr = &bin->next;
-			} else {
-				(*prev_ptr) = next;
-
-				set->entries--;
-				recycleBin(set, bin);
-			}
-			
-			bin = next;
-		}
+	if(set->entries == 0) return;
+	
+	unsigned int mask = set->size - 1;
+	unsigned int empty = setEmptyBin(set);
+	for(unsigned int idx = (empty - 1) & mask; idx != empty; idx = (idx - 1) & mask){
+		void *elt = set->table[idx].elt;
+		if(elt && !func(elt, data)) setRemoveBin(set, idx);
 	}
 }
@@ -4,16 +4,126 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+
 #include <pthread.h>
 //#include <sys/param.h >
-#ifndef _WIN32
-#include <sys/sysctl.h>
+#if defined(__APPLE__)
+	#include <sys/sysctl.h>
+#elif defined(_WIN32)
+	#include <windows.h>
+#else
+	#include <unistd.h>
 #endif
 
 #include "chipmunk/chipmunk_private.h"
 #include "chipmunk/cpHastySpace.h"
 
 
+//MARK: Solver Data
+
+// Compact copy of the velocity state of a body that the solver iterates on.
+// cpBody is a large struct and the velocities are spread over several cache lines, so they are copied into an array
+// indexed by cpBody.solverIndex before the iterations and copied back afterwards.
+struct SolverBody {
+	cpVect v, v_bias;
+	cpFloat w, w_bias;
+	cpFloat m_inv, i_inv;
+};
+
+// Copy of the arbiter state used by the solver, referencing its bodies by solver index.
+struct SolverArbiter {
+	int body_a, body_b;
+	int count;
+	// True if the arbiter has no cached impulses to apply.
+	cpBool first_collision;
+	cpFloat u;
+	cpVect n, surface_vr;
+	struct cpContact *contacts;
+};
+
+static inline void
+solver_apply_impulse(struct SolverBody *body, cpVect j, cpVect r){
+	body->v = cpvadd(body->v, cpvmult(j, body->m_inv));
+	body->w += body->i_inv*cpvcross(r, j);
+}
+
+static inline void
+solver_apply_bias_impulse(struct SolverBody *body, cpVect j, cpVect r)
+{
+	body->v_bias = cpvadd(body->v_bias, cpvmult(j, body->m_inv));
+	body->w_bias += body->i_inv*cpvcross(r, j);
+}
+
+// Same as cpArbiterApplyCachedImpulse(), but operating on solver bodies.
+static void
+SolverArbiterApplyCachedImpulse(struct SolverArbiter *arb, struct SolverBody *bodies, cpFloat dt_coef)
+{
+	if(arb->first_collision) return;
+	
+	struct SolverBody *a = bodies + arb->body_a;
+	struct SolverBody *b = bodies + arb->body_b;
+	cpVect n = arb->n;
+	
+	for(int i=0; i<arb->count; i++){
+		struct cpContact *con = &arb->contacts[i];
+		cpVect j = cpvmult(cpvrotate(n, cpv(con->jnAcc, con->jtAcc)), dt_coef);
+		solver_apply_impulse(a, cpvneg(j), con->r1);
+		solver_apply_impulse(b, j, con->r2);
+	}
+}
+
+// Same as cpArbiterApplyImpulse(), but operating on solver bodies.
+static void
+SolverArbiterApplyImpulse(struct SolverArbiter *arb, struct SolverBody *bodies)
+{
+	struct SolverBody *a = bodies + arb->body_a;
+	struct SolverBody *b = bodies + arb->body_b;
+	cpVect n = arb->n;
+	cpVect surface_vr = arb->surface_vr;
+	cpFloat friction = arb->u;
+
+	for(int i=0; i<arb->count; i++){
+		struct cpContact *con = &arb->contacts[i];
+		cpFloat nMass = con->nMass;
+		cpVect r1 = con->r1;
+		cpVect r2 = con->r2;
+		
+		cpVect vb1 = cpvadd(a->v_bias, cpvmult(cpvperp(r1), a->w_bias));
+		cpVect vb2 = cpvadd(b->v_bias, cpvmult(cpvperp(r2), b->w_bias));
+		cpVect v1 = cpvadd(a->v, cpvmult(cpvperp(r1), a->w));
+		cpVect v2 = cpvadd(b->v, cpvmult(cpvperp(r2), b->w));
+		cpVect vr = cpvadd(cpvsub(v2, v1), surface_vr);
+		
+		cpFloat vbn = cpvdot(cpvsub(vb2, vb1), n);
+		cpFloat vrn = cpvdot(vr, n);
+		cpFloat vrt = cpvdot(vr, cpvperp(n));
+		
+		cpFloat jbn = (con->bias - vbn)*nMass;
+		cpFloat jbnOld = con->jBias;
+		con->jBias = cpfmax(jbnOld + jbn, 0.0f);
+		
+		cpFloat jn = -(con->bounce + vrn)*nMass;
+		cpFloat jnOld = con->jnAcc;
+		con->jnAcc = cpfmax(jnOld + jn, 0.0f);
+		
+		cpFloat jtMax = friction*con->jnAcc;
+		cpFloat jt = -vrt*con->tMass;
+		cpFloat jtOld = con->jtAcc;
+		con->jtAcc = cpfclamp(jtOld + jt, -jtMax, jtMax);
+		
+		cpVect jb = cpvmult(n, con->jBias - jbnOld);
+		solver_apply_bias_impulse(a, cpvneg(jb), r1);
+		solver_apply_bias_impulse(b, jb, r2);
+		
+		cpVect j = cpvrotate(n, cpv(con->jnAcc - jnOld, con->jtAcc - jtOld));
+		solver_apply_impulse(a, cpvneg(j), r1);
+		solver_apply_impulse(b, j, r2);
+	}
+}
+
 //MARK: ARM NEON Solver
 
 #if __ARM_NEON__
@@ -84,10 +194,10 @@ vmake(cpFloat_t x, cpFloat_t y)
 }
 
 static void
-cpArbiterApplyImpulse_NEON(cpArbiter *arb)
+SolverArbiterApplyImpulse_NEON(struct SolverArbiter *arb, struct SolverBody *bodies)
 {
-	cpBody *a = arb->body_a;
-	cpBody *b = arb->body_b;
+	struct SolverBody *a = bodies + arb->body_a;
+	struct SolverBody *b = bodies + arb->body_b;
 	cpFloatx2_t surface_vr = vld((cpFloat_t *)&arb->surface_vr);
 	cpFloatx2_t n = vld((cpFloat_t *)&arb->n);
 	cpFloat_t friction = arb->u;
@@ -174,63 +284,328 @@ cpArbiterApplyImpulse_NEON(cpArbiter *arb)
 
 #endif
 
-//MARK: PThreads
+//MARK: x86 SIMD Solver
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(CP_HASTY_NO_SIMD)
+#define CP_HASTY_X86_SIMD 1
+
+// The arbiters in a color share no dynamic bodies, so they are solved with one arbiter per SIMD lane.
+// Each arbiter's contacts are still solved in order, and the math is done in the same order as SolverArbiterApplyImpulse()
+// so the results match the scalar solver.
+
+#if CP_USE_DOUBLES
+	typedef int64_t cpWideInt;
+#else
+	typedef int32_t cpWideInt;
+#endif
+
+#define WIDE_SELECT(mask, a, b) ((vf)(((mask) & (vi)(a)) | (~(mask) & (vi)(b))))
+#define WIDE_MAX(a, b) WIDE_SELECT((vi)((a) > (b)), a, b)
+#define WIDE_MIN(a, b) WIDE_SELECT((vi)((a) < (b)), a, b)
+
+#define WIDE_LOAD_BODY(prefix, body) \
+	prefix##vx[l] = body->v.x; prefix##vy[l] = body->v.y; prefix##w[l] = body->w; \
+	prefix##vbx[l] = body->v_bias.x; prefix##vby[l] = body->v_bias.y; prefix##wb[l] = body->w_bias; \
+	prefix##m[l] = body->m_inv; prefix##i[l] = body->i_inv;
+
+#define WIDE_STORE_BODY(prefix, body) \
+	body->v.x = prefix##vx[l]; body->v.y = prefix##vy[l]; body->w = prefix##w[l]; \
+	body->v_bias.x = prefix##vbx[l]; body->v_bias.y = prefix##vby[l]; body->w_bias = prefix##wb[l];
+
+// Defines a function that solves a batch of arbiters from the same color using vectors of the given size in bytes.
+// Returns the number of arbiters it solved, the remainder that doesn't fill the lanes must be solved by the scalar solver.
+#define DEFINE_WIDE_SOLVER(name, target_name, bytes) \
+static __attribute__((target(target_name))) int \
+name(struct SolverArbiter *arbiters, int count, struct SolverBody *bodies) \
+{ \
+	typedef cpFloat vf __attribute__((vector_size(bytes))); \
+	typedef cpWideInt vi __attribute__((vector_size(bytes))); \
+	enum {LANES = bytes/sizeof(cpFloat)}; \
+	const vf zero = {}; \
+	\
+	int solved = 0; \
+	for(; solved + LANES <= count; solved += LANES){ \
+		struct SolverArbiter *batch = arbiters + solved; \
+		vf a_vx, a_vy, a_w, a_vbx, a_vby, a_wb, a_m, a_i; \
+		vf b_vx, b_vy, b_w, b_vbx, b_vby, b_wb, b_m, b_i; \
+		vf nx, ny, svx, svy, u; \
+		int max_count = 0; \
+		\
+		for(int l=0; l<LANES; l++){ \
+			struct SolverArbiter *arb = batch + l; \
+			struct SolverBody *a = bodies + arb->body_a, *b = bodies + arb->body_b; \
+			WIDE_LOAD_BODY(a_, a); \
+			WIDE_LOAD_BODY(b_, b); \
+			nx[l] = arb->n.x; ny[l] = arb->n.y; \
+			svx[l] = arb->surface_vr.x; svy[l] = arb->surface_vr.y; \
+			u[l] = arb->u; \
+			if(arb->count > max_count) max_count = arb->count; \
+		} \
+		\
+		for(int k=0; k<max_count; k++){ \
+			vi active; \
+			vf r1x, r1y, r2x, r2y, nMass, tMass, bias, bounce, jnOld, jtOld, jbnOld; \
+			\
+			for(int l=0; l<LANES; l++){ \
+				struct SolverArbiter *arb = batch + l; \
+				active[l] = (k < arb->count ? -1 : 0); \
+				struct cpContact *con = arb->contacts + (k < arb->count ? k : 0); \
+				r1x[l] = con->r1.x; r1y[l] = con->r1.y; r2x[l] = con->r2.x; r2y[l] = con->r2.y; \
+				nMass[l] = con->nMass; tMass[l] = con->tMass; bias[l] = con->bias; bounce[l] = con->bounce; \
+				jnOld[l] = con->jnAcc; jtOld[l] = con->jtAcc; jbnOld[l] = con->jBias; \
+			} \
+			\
+			vf vb1x = a_vbx + (-r1y)*a_wb, vb1y = a_vby + r1x*a_wb; \
+			vf vb2x = b_vbx + (-r2y)*b_wb, vb2y = b_vby + r2x*b_wb; \
+			vf vrx = ((b_vx + (-r2y)*b_w) - (a_vx + (-r1y)*a_w)) + svx; \
+			vf vry = ((b_vy + r2x*b_w) - (a_vy + r1x*a_w)) + svy; \
+			\
+			vf vbn = (vb2x - vb1x)*nx + (vb2y - vb1y)*ny; \
+			vf vrn = vrx*nx + vry*ny; \
+			vf vrt = vrx*(-ny) + vry*nx; \
+			\
+			vf jbn = (bias - vbn)*nMass; \
+			vf jBias = WIDE_MAX(jbnOld + jbn, zero); \
+			\
+			vf jn = -(bounce + vrn)*nMass; \
+			vf jnAcc = WIDE_MAX(jnOld + jn, zero); \
+			\
+			vf jtMax = u*jnAcc; \
+			vf jt = -vrt*tMass; \
+			vf jtAcc = WIDE_MIN(WIDE_MAX(jtOld + jt, -jtMax), jtMax); \
+			\
+			vf jbx = nx*(jBias - jbnOld), jby = ny*(jBias - jbnOld); \
+			vf dn = jnAcc - jnOld, dt = jtAcc - jtOld; \
+			vf jx = nx*dn - ny*dt, jy = nx*dt + ny*dn; \
+			\
+			/* Inactive lanes keep their old velocities. */ \
+			a_vbx = WIDE_SELECT(active, a_vbx + (-jbx)*a_m, a_vbx); \
+			a_vby = WIDE_SELECT(active, a_vby + (-jby)*a_m, a_vby); \
+			a_wb = WIDE_SELECT(active, a_wb + a_i*(r1x*(-jby) - r1y*(-jbx)), a_wb); \
+			b_vbx = WIDE_SELECT(active, b_vbx + jbx*b_m, b_vbx); \
+			b_vby = WIDE_SELECT(active, b_vby + jby*b_m, b_vby); \
+			b_wb = WIDE_SELECT(active, b_wb + b_i*(r2x*jby - r2y*jbx), b_wb); \
+			\
+			a_vx = WIDE_SELECT(active, a_vx + (-jx)*a_m, a_vx); \
+			a_vy = WIDE_SELECT(active, a_vy + (-jy)*a_m, a_vy); \
+			a_w = WIDE_SELECT(active, a_w + a_i*(r1x*(-jy) - r1y*(-jx)), a_w); \
+			b_vx = WIDE_SELECT(active, b_vx + jx*b_m, b_vx); \
+			b_vy = WIDE_SELECT(active, b_vy + jy*b_m, b_vy); \
+			b_w = WIDE_SELECT(active, b_w + b_i*(r2x*jy - r2y*jx), b_w); \
+			\
+			for(int l=0; l<LANES; l++){ \
+				struct SolverArbiter *arb = batch + l; \
+				if(k < arb->count){ \
+					struct cpContact *con = arb->contacts + k; \
+					con->jnAcc = jnAcc[l]; con->jtAcc = jtAcc[l]; con->jBias = jBias[l]; \
+				} \
+			} \
+		} \
+		\
+		for(int l=0; l<LANES; l++){ \
+			struct SolverArbiter *arb = batch + l; \
+			struct SolverBody *a = bodies + arb->body_a, *b = bodies + arb->body_b; \
+			WIDE_STORE_BODY(a_, a); \
+			WIDE_STORE_BODY(b_, b); \
+		} \
+	} \
+	\
+	return solved; \
+}
+
+DEFINE_WIDE_SOLVER(SolverArbiterApplyImpulsesSSE, "sse2", 16)
+DEFINE_WIDE_SOLVER(SolverArbiterApplyImpulsesAVX, "avx", 32)
+
+#endif
+
+typedef int (*WideSolverFunc)(struct SolverArbiter *arbiters, int count, struct SolverBody *bodies);
+
+// Wide solver for the CPU, or NULL if there isn't one. Chosen when the first hasty space is created.
+static WideSolverFunc WideApplyImpulses = NULL;
+
+static void
+ChooseWideSolver(void)
+{
+#if CP_HASTY_X86_SIMD
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx")){
+		WideApplyImpulses = SolverArbiterApplyImpulsesAVX;
+	} else if(__builtin_cpu_supports("sse2")){
+		WideApplyImpulses = SolverArbiterApplyImpulsesSSE;
+	}
+#endif
+}
+
+//MARK: Atomics
+
+static inline unsigned long AtomicLoad(volatile unsigned long *ptr){return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);}
+static inline unsigned long AtomicIncrement(volatile unsigned long *ptr){return __atomic_add_fetch(ptr, 1, __ATOMIC_ACQ_REL);}
+static inline unsigned long AtomicDecrement(volatile unsigned long *ptr){return __atomic_sub_fetch(ptr, 1, __ATOMIC_ACQ_REL);}
+
+#if defined(__i386__) || defined(__x86_64__)
+	#define SpinPause() __builtin_ia32_pause()
+#else
+	#define SpinPause()
+#endif
+
+// Number of times a thread polls for new work (or for the workers to finish) before parking on a condition variable.
+// At 60 Hz the gaps between the parallel sections of a step are short enough that spinning avoids most of the wake up latency.
+#define SPIN_COUNT 4096
+
+//MARK: Work Stealing Task Queues
+
+// Each job is a range of task indexes that is split evenly between the threads.
+// A thread pops tasks off of the front of its own range and steals the back half of another thread's range when it runs dry.
+// Both ends of a range are packed into a single word so that they can be updated with a single CAS.
+typedef uint64_t TaskRange;
+
+static inline TaskRange TaskRangeMake(uint32_t begin, uint32_t end){return (TaskRange)end<<32 | begin;}
+static inline uint32_t TaskRangeBegin(TaskRange range){return (uint32_t)range;}
+static inline uint32_t TaskRangeEnd(TaskRange range){return (uint32_t)(range>>32);}
+
+// Padded out to a cache line to avoid false sharing between the threads.
+struct TaskQueue {
+	volatile TaskRange range;
+	char padding[64 - sizeof(TaskRange)];
+};
+
+static inline TaskRange TaskQueueLoad(struct TaskQueue *queue){return __atomic_load_n(&queue->range, __ATOMIC_ACQUIRE);}
+static inline void TaskQueueStore(struct TaskQueue *queue, TaskRange range){__atomic_store_n(&queue->range, range, __ATOMIC_RELEASE);}
+
+static inline cpBool
+TaskQueueCAS(struct TaskQueue *queue, TaskRange expected, TaskRange value)
+{
+	return __atomic_compare_exchange_n(&queue->range, &expected, value, cpFalse, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+static cpBool
+TaskQueuePop(struct TaskQueue *queue, unsigned long *task)
+{
+	for(;;){
+		TaskRange range = TaskQueueLoad(queue);
+		uint32_t begin = TaskRangeBegin(range), end = TaskRangeEnd(range);
+		if(begin >= end) return cpFalse;
+		
+		if(TaskQueueCAS(queue, range, TaskRangeMake(begin + 1, end))){
+			(*task) = begin;
+			return cpTrue;
+		}
+	}
+}
+
+// Steal the back half of the victim's tasks into the thief's (empty) queue.
+static cpBool
+TaskQueueSteal(struct TaskQueue *victim, struct TaskQueue *thief)
+{
+	for(;;){
+		TaskRange range = TaskQueueLoad(victim);
+		uint32_t begin = TaskRangeBegin(range), end = TaskRangeEnd(range);
+		if(begin >= end) return cpFalse;
+		
+		uint32_t split = end - (end - begin + 1)/2;
+		if(TaskQueueCAS(victim, range, TaskRangeMake(begin, split))){
+			TaskQueueStore(thief, TaskRangeMake(split, end));
+			return cpTrue;
+		}
+	}
+}
 
-// Right now using more than 2 threads probably wont help your performance any.
-// If you are using a ridiculous number of iterations it could help though.
-#define MAX_THREADS 2
+//MARK: Thread Pool
 
 struct ThreadContext {
 	pthread_t thread;
-	cpHastySpace *space;
+	cpHastyThreadPool *pool;
 	unsigned long thread_num;
 };
 
-typedef	void (*cpHastySpaceWorkFunction)(cpSpace *space, unsigned long worker, unsigned long worker_count);
-
-struct cpHastySpace {
-	cpSpace space;
-	
-	// Number of worker threads (including the main thread)
+struct cpHastyThreadPool {
+	// Number of threads including the thread that submits the work.
 	unsigned long num_threads;
 	
-	// Number of worker threads currently executing. (also including the main thread)
-	unsigned long num_working;
+	// Worker threads, (num_threads - 1) of them.
+	struct ThreadContext *workers;
+	// Task queues, one per thread.
+	struct TaskQueue *queues;
 	
-	// Number of constraints (plus contacts) that must exist per step to start the worker threads.
-	unsigned long constraint_count_threshold;
+	// Task function and context of the current job.
+	cpHastyTaskFunc func;
+	void *context;
+	
+	// Incremented each time a job is started. Idle workers spin on it before parking.
+	volatile unsigned long generation;
+	// Number of worker threads that have not yet finished the current job. (not including the submitting thread)
+	volatile unsigned long num_working;
+	// Set when the workers should exit.
+	cpBool halt;
+	
+	// Number of workers parked on cond_work.
+	unsigned long num_sleeping;
 	
 	pthread_mutex_t mutex;
 	pthread_cond_t cond_work, cond_resume;
 	
-	// Work function to invoke.
-	cpHastySpaceWorkFunction work;
-	
-	struct ThreadContext workers[MAX_THREADS - 1];
+	// Held while a job runs so that several spaces can share a pool.
+	pthread_mutex_t submit_mutex;
 };
 
+static void
+ThreadPoolRunTasks(cpHastyThreadPool *pool, unsigned long thread)
+{
+	cpHastyTaskFunc func = pool->func;
+	void *context = pool->context;
+	
+	unsigned long num_threads = pool->num_threads;
+	struct TaskQueue *queues = pool->queues;
+	struct TaskQueue *queue = queues + thread;
+	
+	for(;;){
+		unsigned long task;
+		while(TaskQueuePop(queue, &task)) func(context, task, thread);
+		
+		// Out of work, look for a victim to steal from.
+		cpBool stole = cpFalse;
+		for(unsigned long i=1; i<num_threads && !stole; i++){
+			stole = TaskQueueSteal(queues + (thread + i)%num_threads, queue);
+		}
+		
+		if(!stole) break;
+	}
+}
+
+static unsigned long
+ThreadPoolWaitForWork(cpHastyThreadPool *pool, unsigned long generation)
+{
+	for(int i=0; i<SPIN_COUNT; i++){
+		if(AtomicLoad(&pool->generation) != generation) return generation + 1;
+		SpinPause();
+	}
+	
+	pthread_mutex_lock(&pool->mutex); {
+		pool->num_sleeping++;
+		while(AtomicLoad(&pool->generation) == generation) pthread_cond_wait(&pool->cond_work, &pool->mutex);
+		pool->num_sleeping--;
+	} pthread_mutex_unlock(&pool->mutex);
+	
+	return generation + 1;
+}
+
 static void *
 WorkerThreadLoop(struct ThreadContext *context)
 {
-	cpHastySpace *hasty = context->space;
-	
+	cpHastyThreadPool *pool = context->pool;
 	unsigned long thread = context->thread_num;
-	unsigned long num_threads = hasty->num_threads;
+	unsigned long generation = 0;
 	
 	for(;;){
-		pthread_mutex_lock(&hasty->mutex); {
-			if(--hasty->num_working == 0){
-				pthread_cond_signal(&hasty->cond_resume);
-			}
-			
-			pthread_cond_wait(&hasty->cond_work, &hasty->mutex);
-		} pthread_mutex_unlock(&hasty->mutex);
+		generation = ThreadPoolWaitForWork(pool, generation);
+		if(pool->halt) break;
 		
-		cpHastySpaceWorkFunction func = hasty->work;
-		if(func){
-			hasty->work(&hasty->space, thread, num_threads);
-		} else {
-			break;
+		ThreadPoolRunTasks(pool, thread);
+		
+		if(AtomicDecrement(&pool->num_working) == 0){
+			pthread_mutex_lock(&pool->mutex); {
+				pthread_cond_signal(&pool->cond_resume);
+			} pthread_mutex_unlock(&pool->mutex);
 		}
 	}
 	
@@ -238,242 +613,1354 @@ WorkerThreadLoop(struct ThreadContext *context)
 }
 
 static void
-RunWorkers(cpHastySpace *hasty, cpHastySpaceWorkFunction func)
+ThreadPoolStart(cpHastyThreadPool *pool, cpHastyTaskFunc func, void *context)
 {
-	hasty->num_working = hasty->num_threads - 1;
-	hasty->work = func;
+	pool->func = func;
+	pool->context = context;
+	pool->num_working = pool->num_threads - 1;
 	
-	if(hasty->num_working > 0){
-		pthread_mutex_lock(&hasty->mutex); {
-			pthread_cond_broadcast(&hasty->cond_work);
-		} pthread_mutex_unlock(&hasty->mutex);
-		
-		func((cpSpace *)hasty, 0, hasty->num_threads);
-			
-		pthread_mutex_lock(&hasty->mutex); {
-			if(hasty->num_working > 0){
-				pthread_cond_wait(&hasty->cond_resume, &hasty->mutex);
-			}
-		} pthread_mutex_unlock(&hasty->mutex);
-	} else {
-		func((cpSpace *)hasty, 0, hasty->num_threads);
-	}
+	AtomicIncrement(&pool->generation);
 	
-	hasty->work = NULL;
+	pthread_mutex_lock(&pool->mutex); {
+		if(pool->num_sleeping > 0) pthread_cond_broadcast(&pool->cond_work);
+	} pthread_mutex_unlock(&pool->mutex);
 }
 
 static void
-Solver(cpSpace *space, unsigned long worker, unsigned long worker_count)
+ThreadPoolFinish(cpHastyThreadPool *pool)
 {
-	cpArray *constraints = space->constraints;
-	cpArray *arbiters = space->arbiters;
-	
-	cpFloat dt = space->curr_dt;
-	unsigned long iterations = (space->iterations + worker_count - 1)/worker_count;
-	
-	for(unsigned long i=0; i<iterations; i++){
-		for(int j=0; j<arbiters->num; j++){
-			cpArbiter *arb = (cpArbiter *)arbiters->arr[j];
-			#ifdef __ARM_NEON__
-				cpArbiterApplyImpulse_NEON(arb);
-			#else
-				cpArbiterApplyImpulse(arb);
-			#endif
-		}
-			
-		for(int j=0; j<constraints->num; j++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[j];
-			constraint->klass->applyImpulse(constraint, dt);
-		}
+	for(int i=0; i<SPIN_COUNT; i++){
+		if(AtomicLoad(&pool->num_working) == 0) return;
+		SpinPause();
 	}
+	
+	pthread_mutex_lock(&pool->mutex); {
+		while(AtomicLoad(&pool->num_working) > 0) pthread_cond_wait(&pool->cond_resume, &pool->mutex);
+	} pthread_mutex_unlock(&pool->mutex);
 }
 
-//MARK: Thread Management Functions
-
-static void
-HaltThreads(cpHastySpace *hasty)
+static unsigned long
+DetectThreadCount(void)
 {
-	pthread_mutex_t *mutex = &hasty->mutex;
-	pthread_mutex_lock(mutex); {
-		hasty->work = NULL; // NULL work function means break and exit
-		pthread_cond_broadcast(&hasty->cond_work);
-	} pthread_mutex_unlock(mutex);
+	unsigned long threads = 1;
 	
-	for(unsigned long i=0; i<(hasty->num_threads-1); i++){
-		pthread_join(hasty->workers[i].thread, NULL);
-	}
+#if defined(__APPLE__)
+	size_t size = sizeof(threads);
+	sysctlbyname("hw.ncpu", &threads, &size, NULL, 0);
+#elif defined(_WIN32)
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	threads = info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	if(count > 0) threads = count;
+#endif
+	
+	return (threads > 0 ? threads : 1);
 }
 
-void
-cpHastySpaceSetThreads(cpSpace *space, unsigned long threads)
+cpHastyThreadPool *
+cpHastyThreadPoolNew(unsigned long threads)
 {
 #if TARGET_IPHONE_SIMULATOR == 1
 	// Individual values appear to be written non-atomically when compiled as debug for the simulator.
 	// No idea why, so threads are disabled.
 	threads = 1;
-#endif	
+#endif
 	
-	cpHastySpace *hasty = (cpHastySpace *)space;
-	HaltThreads(hasty);
+	if(threads == 0) threads = DetectThreadCount();
 	
-#ifdef __APPLE__
-	if(threads == 0){
-		size_t size = sizeof(threads);
-		sysctlbyname("hw.ncpu", &threads, &size, NULL, 0);
-	}
-#else
-	if(threads == 0) threads = 1;
-#endif
+	cpHastyThreadPool *pool = (cpHastyThreadPool *)cpcalloc(1, sizeof(cpHastyThreadPool));
+	pool->num_threads = threads;
+	pool->queues = (struct TaskQueue *)cpcalloc(threads, sizeof(struct TaskQueue));
 	
-	hasty->num_threads = (threads < MAX_THREADS ? threads : MAX_THREADS);
-	hasty->num_working = hasty->num_threads - 1;
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_mutex_init(&pool->submit_mutex, NULL);
+	pthread_cond_init(&pool->cond_work, NULL);
+	pthread_cond_init(&pool->cond_resume, NULL);
 	
-	// Create the worker threads and wait for them to signal ready.
-	if(hasty->num_working > 0){
-		pthread_mutex_lock(&hasty->mutex);
-		for(unsigned long i=0; i<(hasty->num_threads-1); i++){
-			hasty->workers[i].space = hasty;
-			hasty->workers[i].thread_num = i + 1;
+	if(threads > 1){
+		pool->workers = (struct ThreadContext *)cpcalloc(threads - 1, sizeof(struct ThreadContext));
+		
+		for(unsigned long i=0; i<(threads - 1); i++){
+			pool->workers[i].pool = pool;
+			pool->workers[i].thread_num = i + 1;
 			
-			pthread_create(&hasty->workers[i].thread, NULL, (void *)WorkerThreadLoop, &hasty->workers[i]);
+			pthread_create(&pool->workers[i].thread, NULL, (void *)WorkerThreadLoop, &pool->workers[i]);
 		}
-		
-		pthread_cond_wait(&hasty->cond_resume, &hasty->mutex);
-		pthread_mutex_unlock(&hasty->mutex);
 	}
+	
+	return pool;
 }
 
-unsigned long
-cpHastySpaceGetThreads(cpSpace *space)
+void
+cpHastyThreadPoolFree(cpHastyThreadPool *pool)
 {
-	return ((cpHastySpace *)space)->num_threads;
+	if(pool == NULL) return;
+	
+	pthread_mutex_lock(&pool->submit_mutex); {
+		pool->halt = cpTrue;
+		ThreadPoolStart(pool, NULL, NULL);
+		
+		for(unsigned long i=0; i<(pool->num_threads - 1); i++){
+			pthread_join(pool->workers[i].thread, NULL);
+		}
+	} pthread_mutex_unlock(&pool->submit_mutex);
+	
+	pthread_mutex_destroy(&pool->mutex);
+	pthread_mutex_destroy(&pool->submit_mutex);
+	pthread_cond_destroy(&pool->cond_work);
+	pthread_cond_destroy(&pool->cond_resume);
+	
+	cpfree(pool->workers);
+	cpfree(pool->queues);
+	cpfree(pool);
 }
 
-//MARK: Overriden cpSpace Functions.
+unsigned long
+cpHastyThreadPoolGetThreads(cpHastyThreadPool *pool)
+{
+	return pool->num_threads;
+}
 
-cpSpace *
-cpHastySpaceNew(void)
+void
+cpHastyThreadPoolRun(cpHastyThreadPool *pool, unsigned long count, cpHastyTaskFunc func, void *context)
 {
-	cpHastySpace *hasty = (cpHastySpace *)cpcalloc(1, sizeof(cpHastySpace));
-	cpSpaceInit((cpSpace *)hasty);
+	unsigned long num_threads = pool->num_threads;
 	
-	pthread_mutex_init(&hasty->mutex, NULL);
-	pthread_cond_init(&hasty->cond_work, NULL);
-	pthread_cond_init(&hasty->cond_resume, NULL);
+	// Run the tasks inline if there is nothing to split up, or if another space is already using the pool.
+	if(num_threads == 1 || count <= 1 || pthread_mutex_trylock(&pool->submit_mutex) != 0){
+		for(unsigned long i=0; i<count; i++) func(context, i, 0);
+		return;
+	}
 	
-	// TODO magic number, should test this more thoroughly.
-	hasty->constraint_count_threshold = 50;
+	for(unsigned long i=0; i<num_threads; i++){
+		TaskQueueStore(pool->queues + i, TaskRangeMake((uint32_t)(count*i/num_threads), (uint32_t)(count*(i + 1)/num_threads)));
+	}
 	
-	// Default to 1 thread for determinism.
-	hasty->num_threads = 1;
-	cpHastySpaceSetThreads((cpSpace *)hasty, 1);
-
-	return (cpSpace *)hasty;
+	ThreadPoolStart(pool, func, context);
+	ThreadPoolRunTasks(pool, 0);
+	ThreadPoolFinish(pool);
+	
+	pthread_mutex_unlock(&pool->submit_mutex);
 }
 
-void
-cpHastySpaceFree(cpSpace *space)
-{
-	cpHastySpace *hasty = (cpHastySpace *)space;
+//MARK: Hasty Space
+
+// The solver can use at most this many colors, see ColorSolverBatches().
+#define MAX_COLORS 64
+
+// Range of arbiters and constraints that are solved together, either a color or an island.
+struct SolverBatch {
+	int arbiter_offset, arbiter_count;
+	int constraint_offset, constraint_count;
+};
+
+// Sort key used to order the islands from the most to the least work.
+struct IslandKey {
+	int cost;
+	int island;
+};
+
+enum SolverBodyKind {
+	// Active dynamic body, only modified by the items in its color or island.
+	SOLVER_BODY_DYNAMIC,
+	// Static or kinematic body, never modified by the solver.
+	SOLVER_BODY_INFINITE_MASS,
+	// Dynamic body that is not in the space's active body list and cannot be safely solved in parallel.
+	SOLVER_BODY_ROGUE,
+};
+
+struct SolverBodyInfo {
+	cpBody *body;
+	enum SolverBodyKind kind;
+	// True if the body is attached to a constraint and must be synced with its cpBody around the constraint passes.
+	cpBool constrained;
+};
+
+struct cpHastySpace {
+	cpSpace space;
 	
-	HaltThreads(hasty);
+	// Pool that runs the parallel parts of the step.
+	cpHastyThreadPool *pool;
+	// True if the pool was created by the space and should be freed with it.
+	cpBool owns_pool;
 	
-	pthread_mutex_destroy(&hasty->mutex);
-	pthread_cond_destroy(&hasty->cond_work);
-	pthread_cond_destroy(&hasty->cond_resume);
+	// Number of constraints (plus contacts) that must exist per step to start the worker threads.
+	unsigned long constraint_count_threshold;
 	
-	cpSpaceFree(space);
+	cpHastySolverMode solver_mode;
+	// See cpHastySpaceSetWideSolver().
+	cpBool wide_solver;
+	
+	// True if the current step has enough work to run the solver passes on the pool.
+	cpBool threaded;
+	// True if the current step is solved using islands.
+	cpBool use_islands;
+	
+	// Bodies touched by the solver, indexed by cpBody.solverIndex.
+	// The space's dynamic bodies come first, followed by any other bodies the arbiters and constraints reference.
+	struct SolverBody *solver_bodies;
+	struct SolverBodyInfo *solver_body_infos;
+	int solver_bodies_max;
+	int num_solver_bodies;
+	
+	// Solver indexes of the finite mass bodies attached to constraints.
+	int *constrained_bodies;
+	int constrained_bodies_max;
+	int num_constrained_bodies;
+	
+	// The step's arbiters in the same order as the space's arbiter list.
+	struct SolverArbiter *solver_arbiters;
+	int solver_arbiters_max;
+	
+	// Per body bitmasks of the colors used by the body's arbiters and constraints.
+	uint64_t *body_colors;
+	int body_colors_max;
+	
+	// Temporary color assignments for the arbiters followed by the constraints.
+	unsigned char *item_colors;
+	int item_colors_max;
+	
+	// Solver batches. The extra color holds the items that could not be colored and must be solved serially.
+	struct SolverBatch colors[MAX_COLORS + 1];
+	int num_colors;
+	int num_colored_constraints;
+	
+	// Arbiters and constraints sorted by color.
+	struct SolverArbiter *colored_arbiters;
+	int colored_arbiters_max;
+	cpConstraint **colored_constraints;
+	int colored_constraints_max;
+	
+	// Union-find parents of the bodies, then the island index of each body.
+	int *body_islands;
+	int body_islands_max;
+	
+	// Temporary island assignments for the arbiters followed by the constraints.
+	int *item_islands;
+	int item_islands_max;
+	
+	// Islands sorted from the most to the least work, and the island keys used to sort them.
+	struct SolverBatch *islands;
+	struct IslandKey *island_keys;
+	int islands_max;
+	int num_islands;
+	
+	// Number of islands at the start of the sorted list that are too big for one thread and are colored instead.
+	int num_colored_islands;
+	
+	// Arbiters and constraints sorted by island.
+	struct SolverArbiter *island_arbiters;
+	int island_arbiters_max;
+	cpConstraint **island_constraints;
+	int island_constraints_max;
+	
+	// The dynamic shapes to update the bounding boxes of.
+	cpShape **shapes;
+	int shapes_max;
+	int num_shapes;
+	
+	// Pairs of shapes found by the broadphase for the narrow phase to collide, and the ones from the previous step.
+	struct CollisionPair *pairs, *prev_pairs;
+	int pairs_max, prev_pairs_max;
+	int num_pairs, num_prev_pairs;
+};
+
+static inline void *
+GrowBuffer(cpAllocator *allocator, void *buffer, int *max, int count, size_t size)
+{
+	if(count > *max){
+		int grown = 3*(*max + 1)/2;
+		(*max) = (count > grown ? count : grown);
+		buffer = cpAllocatorRealloc(allocator, buffer, (*max)*size);
+	}
+	
+	return buffer;
 }
 
-void
-cpHastySpaceStep(cpSpace *space, cpFloat dt)
+//MARK: Solver Bodies
+
+static inline void
+SolverBodyLoad(struct SolverBody *solver_body, cpBody *body)
 {
-	// don't step if the timestep is 0!
-	if(dt == 0.0f) return;
+	solver_body->v = body->v;
+	solver_body->v_bias = body->v_bias;
+	solver_body->w = body->w;
+	solver_body->w_bias = body->w_bias;
+	solver_body->m_inv = body->m_inv;
+	solver_body->i_inv = body->i_inv;
+}
+
+static inline void
+SolverBodyStore(struct SolverBody *solver_body, cpBody *body)
+{
+	body->v = solver_body->v;
+	body->v_bias = solver_body->v_bias;
+	body->w = solver_body->w;
+	body->w_bias = solver_body->w_bias;
+}
+
+// Returns the body's solver index, adding it to the solver bodies the first time it's seen.
+static int
+SolverBodyIndex(cpHastySpace *hasty, cpBody *body)
+{
+	int index = body->solverIndex;
+	if(0 <= index && index < hasty->num_solver_bodies && hasty->solver_body_infos[index].body == body) return index;
 	
-	space->stamp++;
+	// Not one of the space's active dynamic bodies.
+	index = body->solverIndex = hasty->num_solver_bodies++;
+	cpBool infinite = (cpBodyGetType(body) != CP_BODY_TYPE_DYNAMIC);
+	hasty->solver_body_infos[index] = (struct SolverBodyInfo){body, infinite ? SOLVER_BODY_INFINITE_MASS : SOLVER_BODY_ROGUE, cpFalse};
 	
-	cpFloat prev_dt = space->curr_dt;
-	space->curr_dt = dt;
-		
+	return index;
+}
+
+// Assign the solver indexes of the bodies and convert the arbiters to use them.
+static void
+BuildSolverBodies(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
 	cpArray *bodies = space->dynamicBodies;
-	cpArray *constraints = space->constraints;
 	cpArray *arbiters = space->arbiters;
+	cpArray *constraints = space->constraints;
 	
-	// Reset and empty the arbiter list.
+	// Each arbiter or constraint can add at most two extra bodies.
+	// Both of the solver body arrays share solver_bodies_max, so they are grown from the same starting capacity.
+	int max_bodies = bodies->num + 2*(arbiters->num + constraints->num);
+	int max = hasty->solver_bodies_max;
+	hasty->solver_bodies = (struct SolverBody *)GrowBuffer(hasty->space.allocator, hasty->solver_bodies, &hasty->solver_bodies_max, max_bodies, sizeof(struct SolverBody));
+	hasty->solver_body_infos = (struct SolverBodyInfo *)GrowBuffer(hasty->space.allocator, hasty->solver_body_infos, &max, max_bodies, sizeof(struct SolverBodyInfo));
+	
+	for(int i=0; i<bodies->num; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		body->solverIndex = i;
+		
+		cpBool infinite = (cpBodyGetType(body) != CP_BODY_TYPE_DYNAMIC);
+		hasty->solver_body_infos[i] = (struct SolverBodyInfo){body, infinite ? SOLVER_BODY_INFINITE_MASS : SOLVER_BODY_DYNAMIC, cpFalse};
+	}
+	hasty->num_solver_bodies = bodies->num;
+	
+	hasty->solver_arbiters = (struct SolverArbiter *)GrowBuffer(hasty->space.allocator, hasty->solver_arbiters, &hasty->solver_arbiters_max, arbiters->num, sizeof(struct SolverArbiter));
 	for(int i=0; i<arbiters->num; i++){
 		cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
-		arb->state = CP_ARBITER_STATE_NORMAL;
-		
-		// If both bodies are awake, unthread the arbiter from the contact graph.
-		if(!cpBodyIsSleeping(arb->body_a) && !cpBodyIsSleeping(arb->body_b)){
-			cpArbiterUnthread(arb);
-		}
+		hasty->solver_arbiters[i] = (struct SolverArbiter){
+			SolverBodyIndex(hasty, arb->body_a), SolverBodyIndex(hasty, arb->body_b),
+			arb->count, cpArbiterIsFirstContact(arb), arb->u, arb->n, arb->surface_vr, arb->contacts,
+		};
 	}
-	arbiters->num = 0;
 	
-	cpSpaceLock(space); {
-		// Integrate positions
-		for(int i=0; i<bodies->num; i++){
-			cpBody *body = (cpBody *)bodies->arr[i];
-			body->position_func(body, dt);
-		}
+	hasty->constrained_bodies = (int *)GrowBuffer(hasty->space.allocator, hasty->constrained_bodies, &hasty->constrained_bodies_max, 2*constraints->num, sizeof(int));
+	hasty->num_constrained_bodies = 0;
+	for(int i=0; i<constraints->num; i++){
+		cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+		cpBody *pair[] = {constraint->a, constraint->b};
 		
-		// Find colliding pairs.
-		cpSpacePushFreshContactBuffer(space);
-		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
-		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
-	} cpSpaceUnlock(space, cpFalse);
-	
-	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
-	cpSpaceProcessComponents(space, dt);
-	
-	cpSpaceLock(space); {
-		// Clear out old cached arbiters and call separate callbacks
-		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
-
-		// Prestep the arbiters and constraints.
-		cpFloat slop = space->collisionSlop;
-		cpFloat biasCoef = 1.0f - cpfpow(space->collisionBias, dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterPreStep((cpArbiter *)arbiters->arr[i], dt, slop, biasCoef);
+		for(int j=0; j<2; j++){
+			struct SolverBodyInfo *info = hasty->solver_body_infos + SolverBodyIndex(hasty, pair[j]);
+			if(info->kind != SOLVER_BODY_INFINITE_MASS && !info->constrained){
+				info->constrained = cpTrue;
+				hasty->constrained_bodies[hasty->num_constrained_bodies++] = pair[j]->solverIndex;
+			}
 		}
+	}
+}
 
-		for(int i=0; i<constraints->num; i++){
+// Number of solver bodies to copy per task.
+#define SOLVER_BODY_TASK_SIZE 64
+
+static void
+LoadSolverBodiesTask(cpHastySpace *hasty, unsigned long task, unsigned long thread)
+{
+	int start = (int)task*SOLVER_BODY_TASK_SIZE;
+	int end = start + SOLVER_BODY_TASK_SIZE;
+	if(end > hasty->num_solver_bodies) end = hasty->num_solver_bodies;
+	
+	for(int i=start; i<end; i++) SolverBodyLoad(hasty->solver_bodies + i, hasty->solver_body_infos[i].body);
+}
+
+// Copy the integrated velocities into the solver bodies.
+static void
+LoadSolverBodies(cpHastySpace *hasty)
+{
+	unsigned long tasks = (hasty->num_solver_bodies + SOLVER_BODY_TASK_SIZE - 1)/SOLVER_BODY_TASK_SIZE;
+	cpHastyThreadPoolRun(hasty->pool, tasks, (cpHastyTaskFunc)LoadSolverBodiesTask, hasty);
+}
+
+static void
+StoreSolverBodiesTask(cpHastySpace *hasty, unsigned long task, unsigned long thread)
+{
+	int start = (int)task*SOLVER_BODY_TASK_SIZE;
+	int end = start + SOLVER_BODY_TASK_SIZE;
+	if(end > hasty->num_solver_bodies) end = hasty->num_solver_bodies;
+	
+	for(int i=start; i<end; i++){
+		struct SolverBodyInfo *info = hasty->solver_body_infos + i;
+		if(info->kind != SOLVER_BODY_INFINITE_MASS) SolverBodyStore(hasty->solver_bodies + i, info->body);
+	}
+}
+
+// Copy the solved velocities back to the bodies.
+static void
+StoreSolverBodies(cpHastySpace *hasty)
+{
+	unsigned long tasks = (hasty->num_solver_bodies + SOLVER_BODY_TASK_SIZE - 1)/SOLVER_BODY_TASK_SIZE;
+	cpHastyThreadPoolRun(hasty->pool, tasks, (cpHastyTaskFunc)StoreSolverBodiesTask, hasty);
+}
+
+// Constraints are solved using their cpBody structs, so the constrained bodies must be synced before and after solving them.
+static void
+StoreConstrainedBodies(cpHastySpace *hasty)
+{
+	for(int i=0; i<hasty->num_constrained_bodies; i++){
+		int index = hasty->constrained_bodies[i];
+		SolverBodyStore(hasty->solver_bodies + index, hasty->solver_body_infos[index].body);
+	}
+}
+
+static void
+LoadConstrainedBodies(cpHastySpace *hasty)
+{
+	for(int i=0; i<hasty->num_constrained_bodies; i++){
+		int index = hasty->constrained_bodies[i];
+		SolverBodyLoad(hasty->solver_bodies + index, hasty->solver_body_infos[index].body);
+	}
+}
+
+static inline void
+ArbiterApplyImpulse(struct SolverArbiter *arb, struct SolverBody *bodies)
+{
+#ifdef __ARM_NEON__
+	SolverArbiterApplyImpulse_NEON(arb, bodies);
+#else
+	SolverArbiterApplyImpulse(arb, bodies);
+#endif
+}
+
+//MARK: Graph Colored Solver
+
+// The arbiters and constraints are split into batches (colors) so that no two items in a batch share a dynamic body.
+// The items in a batch can be solved in parallel with no synchronization, so the result doesn't depend on the thread count.
+// Each pass runs all of the arbiter colors and then all of the constraint colors, like cpSpaceStep().
+
+// Number of items in a batch to solve per task.
+#define SOLVER_TASK_SIZE 32
+
+// Returns the first color not used by either body, or MAX_COLORS if there are none left.
+static int
+ColorPair(cpHastySpace *hasty, int index_a, int index_b)
+{
+	struct SolverBodyInfo *infos = hasty->solver_body_infos;
+	enum SolverBodyKind kind_a = infos[index_a].kind, kind_b = infos[index_b].kind;
+	if(kind_a == SOLVER_BODY_ROGUE || kind_b == SOLVER_BODY_ROGUE) return MAX_COLORS;
+	
+	uint64_t *mask_a = (kind_a == SOLVER_BODY_DYNAMIC ? hasty->body_colors + index_a : NULL);
+	uint64_t *mask_b = (kind_b == SOLVER_BODY_DYNAMIC ? hasty->body_colors + index_b : NULL);
+	
+	uint64_t used = (mask_a ? *mask_a : 0) | (mask_b ? *mask_b : 0);
+	if(~used == 0) return MAX_COLORS;
+	
+	int color = __builtin_ctzll(~used);
+	if(mask_a) (*mask_a) |= (uint64_t)1<<color;
+	if(mask_b) (*mask_b) |= (uint64_t)1<<color;
+	
+	return color;
+}
+
+// Sort the given arbiters and constraints into colors.
+static void
+ColorSolverBatches(cpHastySpace *hasty, struct SolverArbiter *arbiters, int arbiter_count, cpConstraint **constraints, int constraint_count)
+{
+	int body_count = hasty->num_solver_bodies;
+	hasty->body_colors = (uint64_t *)GrowBuffer(hasty->space.allocator, hasty->body_colors, &hasty->body_colors_max, body_count, sizeof(uint64_t));
+	memset(hasty->body_colors, 0, body_count*sizeof(uint64_t));
+	
+	hasty->item_colors = (unsigned char *)GrowBuffer(hasty->space.allocator, hasty->item_colors, &hasty->item_colors_max, arbiter_count + constraint_count, sizeof(unsigned char));
+	hasty->colored_arbiters = (struct SolverArbiter *)GrowBuffer(hasty->space.allocator, hasty->colored_arbiters, &hasty->colored_arbiters_max, arbiter_count, sizeof(struct SolverArbiter));
+	hasty->colored_constraints = (cpConstraint **)GrowBuffer(hasty->space.allocator, hasty->colored_constraints, &hasty->colored_constraints_max, constraint_count, sizeof(cpConstraint *));
+	
+	struct SolverBatch *colors = hasty->colors;
+	memset(colors, 0, sizeof(hasty->colors));
+	
+	// Assign the colors and count the items in each.
+	unsigned char *item_colors = hasty->item_colors;
+	for(int i=0; i<arbiter_count; i++){
+		int color = item_colors[i] = ColorPair(hasty, arbiters[i].body_a, arbiters[i].body_b);
+		colors[color].arbiter_count++;
+	}
+	
+	for(int i=0; i<constraint_count; i++){
+		cpConstraint *constraint = constraints[i];
+		int color = item_colors[arbiter_count + i] = ColorPair(hasty, constraint->a->solverIndex, constraint->b->solverIndex);
+		colors[color].constraint_count++;
+	}
+	
+	// Lay the colors out one after another and fill them in.
+	int arbiter_offset = 0, constraint_offset = 0;
+	hasty->num_colors = 0;
+	for(int i=0; i<=MAX_COLORS; i++){
+		struct SolverBatch *color = colors + i;
+		color->arbiter_offset = arbiter_offset;
+		color->constraint_offset = constraint_offset;
+		arbiter_offset += color->arbiter_count;
+		constraint_offset += color->constraint_count;
+		
+		if(i < MAX_COLORS && color->arbiter_count + color->constraint_count > 0) hasty->num_colors = i + 1;
+		
+		// Reset the counts to use them as fill cursors.
+		color->arbiter_count = color->constraint_count = 0;
+	}
+	
+	for(int i=0; i<arbiter_count; i++){
+		struct SolverBatch *color = colors + item_colors[i];
+		hasty->colored_arbiters[color->arbiter_offset + color->arbiter_count++] = arbiters[i];
+	}
+	
+	for(int i=0; i<constraint_count; i++){
+		struct SolverBatch *color = colors + item_colors[arbiter_count + i];
+		hasty->colored_constraints[color->constraint_offset + color->constraint_count++] = constraints[i];
+	}
+	
+	hasty->num_colored_constraints = constraint_count;
+}
+
+static inline int
+TaskCount(int count)
+{
+	return (count + SOLVER_TASK_SIZE - 1)/SOLVER_TASK_SIZE;
+}
+
+enum SolverPass {
+	// Constraint pre-steps, run before the velocities are integrated.
+	SOLVER_PASS_PRE_STEP,
+	// Apply the cached impulses from the previous step.
+	SOLVER_PASS_WARM_START,
+	// One iteration of the impulse solver.
+	SOLVER_PASS_SOLVE,
+};
+
+struct SolverContext {
+	cpHastySpace *hasty;
+	struct SolverBatch *batch;
+	enum SolverPass pass;
+	cpFloat dt, dt_coef;
+	// True if the batch's arbiters share no dynamic bodies and can be solved with the wide solver.
+	cpBool wide;
+};
+
+// Springs with custom callbacks are pre-stepped serially after the parallel pass unless they are flagged as thread safe.
+static inline cpBool
+PreStepParallel(cpConstraint *constraint)
+{
+	if(cpConstraintIsDampedSpring(constraint)) return cpDampedSpringPreStepThreadSafe(constraint);
+	if(cpConstraintIsDampedRotarySpring(constraint)) return cpDampedRotarySpringPreStepThreadSafe(constraint);
+	return cpTrue;
+}
+
+static inline void
+ConstraintPass(struct SolverContext *context, cpConstraint *constraint)
+{
+	switch(context->pass){
+		case SOLVER_PASS_PRE_STEP: if(PreStepParallel(constraint)) constraint->klass->preStep(constraint, context->dt); break;
+		case SOLVER_PASS_WARM_START: constraint->klass->applyCachedImpulse(constraint, context->dt_coef); break;
+		case SOLVER_PASS_SOLVE: constraint->klass->applyImpulse(constraint, context->dt); break;
+	}
+}
+
+static void
+ArbiterColorTask(struct SolverContext *context, unsigned long task, unsigned long thread)
+{
+	cpHastySpace *hasty = context->hasty;
+	struct SolverBatch *color = context->batch;
+	struct SolverBody *bodies = hasty->solver_bodies;
+	
+	int start = (int)task*SOLVER_TASK_SIZE;
+	int end = start + SOLVER_TASK_SIZE;
+	if(end > color->arbiter_count) end = color->arbiter_count;
+	
+	struct SolverArbiter *arbiters = hasty->colored_arbiters + color->arbiter_offset;
+	if(context->pass == SOLVER_PASS_WARM_START){
+		for(int i=start; i<end; i++) SolverArbiterApplyCachedImpulse(arbiters + i, bodies, context->dt_coef);
+	} else {
+		if(context->wide) start += WideApplyImpulses(arbiters + start, end - start, bodies);
+		for(int i=start; i<end; i++) ArbiterApplyImpulse(arbiters + i, bodies);
+	}
+}
+
+static void
+ConstraintColorTask(struct SolverContext *context, unsigned long task, unsigned long thread)
+{
+	cpHastySpace *hasty = context->hasty;
+	struct SolverBatch *color = context->batch;
+	
+	int start = (int)task*SOLVER_TASK_SIZE;
+	int end = start + SOLVER_TASK_SIZE;
+	if(end > color->constraint_count) end = color->constraint_count;
+	
+	cpConstraint **constraints = hasty->colored_constraints + color->constraint_offset;
+	for(int i=start; i<end; i++) ConstraintPass(context, constraints[i]);
+}
+
+static void
+RunColor(cpHastySpace *hasty, struct SolverContext context, struct SolverBatch *color, cpBool constraints)
+{
+	// The last color holds the items that could not be colored.
+	cpBool serial = (color == hasty->colors + MAX_COLORS);
+	
+	context.batch = color;
+	context.wide = (WideApplyImpulses != NULL && hasty->wide_solver && !serial);
+	unsigned long tasks = TaskCount(constraints ? color->constraint_count : color->arbiter_count);
+	cpHastyTaskFunc func = (cpHastyTaskFunc)(constraints ? ConstraintColorTask : ArbiterColorTask);
+	
+	if(hasty->threaded && !serial){
+		cpHastyThreadPoolRun(hasty->pool, tasks, func, &context);
+	} else {
+		for(unsigned long i=0; i<tasks; i++) func(&context, i, 0);
+	}
+}
+
+// Run a pass over all of the colors. The uncolored items are run serially after the rest.
+static void
+RunColorPass(cpHastySpace *hasty, struct SolverContext *context)
+{
+	int num_colors = hasty->num_colors;
+	struct SolverBatch *colors = hasty->colors, *uncolored = colors + MAX_COLORS;
+	
+	// Constraint pre-steps run before the solver bodies are loaded and don't need to be synced.
+	cpBool pre_step = (context->pass == SOLVER_PASS_PRE_STEP);
+	
+	if(!pre_step){
+		for(int j=0; j<num_colors; j++) RunColor(hasty, *context, colors + j, cpFalse);
+		RunColor(hasty, *context, uncolored, cpFalse);
+	}
+	
+	if(hasty->num_colored_constraints > 0){
+		if(!pre_step) StoreConstrainedBodies(hasty);
+		for(int j=0; j<num_colors; j++) RunColor(hasty, *context, colors + j, cpTrue);
+		RunColor(hasty, *context, uncolored, cpTrue);
+		if(!pre_step) LoadConstrainedBodies(hasty);
+	}
+}
+
+//MARK: Island Solver
+
+// Bodies that are connected by arbiters or constraints are grouped into islands that don't share any dynamic bodies.
+// Each island is solved by a single thread using all of the solver iterations, in the same order as cpSpaceStep().
+// Items that only touch infinite mass bodies, and islands too big to be solved by a single thread, are colored instead.
+// The island split doesn't depend on the thread count, so neither do the results.
+
+// Islands with more arbiters and constraints than this are colored.
+#define MAX_ISLAND_COST 512
+
+static inline int
+IslandFind(int *parents, int index)
+{
+	while(parents[index] != index){
+		// Path halving.
+		parents[index] = parents[parents[index]];
+		index = parents[index];
+	}
+	
+	return index;
+}
+
+static inline void
+IslandUnion(int *parents, int index_a, int index_b)
+{
+	int root_a = IslandFind(parents, index_a);
+	int root_b = IslandFind(parents, index_b);
+	
+	// Always keep the lower index as the root so the islands don't depend on the item order.
+	if(root_a < root_b){
+		parents[root_b] = root_a;
+	} else {
+		parents[root_a] = root_b;
+	}
+}
+
+// Returns the island index for an item. Island 0 holds the items that only touch infinite mass bodies.
+static inline int
+IslandForPair(cpHastySpace *hasty, int index_a, int index_b)
+{
+	struct SolverBodyInfo *infos = hasty->solver_body_infos;
+	int index = (infos[index_a].kind == SOLVER_BODY_DYNAMIC ? index_a : index_b);
+	return (infos[index].kind == SOLVER_BODY_DYNAMIC ? hasty->body_islands[index] : 0);
+}
+
+static int
+IslandKeyCompare(const struct IslandKey *a, const struct IslandKey *b)
+{
+	if(a->cost != b->cost) return (a->cost > b->cost ? -1 : 1);
+	return (a->island < b->island ? -1 : (a->island > b->island));
+}
+
+// Sort the arbiters and constraints into islands.
+// Returns false if an item touches a dynamic body that isn't in the space's active body list.
+static cpBool
+BuildSolverIslands(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	struct SolverArbiter *arbiters = hasty->solver_arbiters;
+	cpConstraint **constraints = (cpConstraint **)space->constraints->arr;
+	struct SolverBodyInfo *infos = hasty->solver_body_infos;
+	int body_count = hasty->num_solver_bodies;
+	int arbiter_count = space->arbiters->num;
+	int constraint_count = space->constraints->num;
+	
+	for(int i=0; i<body_count; i++){
+		if(infos[i].kind == SOLVER_BODY_ROGUE) return cpFalse;
+	}
+	
+	hasty->body_islands = (int *)GrowBuffer(hasty->space.allocator, hasty->body_islands, &hasty->body_islands_max, body_count, sizeof(int));
+	int *parents = hasty->body_islands;
+	for(int i=0; i<body_count; i++) parents[i] = i;
+	
+	// Join the islands of the bodies connected by each item.
+	for(int i=0; i<arbiter_count + constraint_count; i++){
+		int index_a, index_b;
+		if(i < arbiter_count){
+			index_a = arbiters[i].body_a, index_b = arbiters[i].body_b;
+		} else {
+			cpConstraint *constraint = constraints[i - arbiter_count];
+			index_a = constraint->a->solverIndex, index_b = constraint->b->solverIndex;
+		}
+		
+		if(infos[index_a].kind == SOLVER_BODY_DYNAMIC && infos[index_b].kind == SOLVER_BODY_DYNAMIC){
+			IslandUnion(parents, index_a, index_b);
+		}
+	}
+	
+	// Parents always have lower indexes than their children, so a single pass in order can replace each body's parent
+	// with the island index of its root. Islands are numbered by their lowest body index after island 0.
+	int num_islands = 1;
+	for(int i=0; i<body_count; i++){
+		int parent = parents[i];
+		parents[i] = (parent == i ? num_islands++ : parents[parent]);
+	}
+	
+	// Assign the islands and count the items in each.
+	int max_islands = body_count + 1;
+	hasty->islands = (struct SolverBatch *)GrowBuffer(hasty->space.allocator, hasty->islands, &hasty->islands_max, max_islands, sizeof(struct SolverBatch));
+	hasty->island_keys = (struct IslandKey *)cpAllocatorRealloc(hasty->space.allocator, hasty->island_keys, hasty->islands_max*sizeof(struct IslandKey));
+	hasty->item_islands = (int *)GrowBuffer(hasty->space.allocator, hasty->item_islands, &hasty->item_islands_max, arbiter_count + constraint_count, sizeof(int));
+	hasty->island_arbiters = (struct SolverArbiter *)GrowBuffer(hasty->space.allocator, hasty->island_arbiters, &hasty->island_arbiters_max, arbiter_count, sizeof(struct SolverArbiter));
+	hasty->island_constraints = (cpConstraint **)GrowBuffer(hasty->space.allocator, hasty->island_constraints, &hasty->island_constraints_max, constraint_count, sizeof(cpConstraint *));
+	
+	struct SolverBatch *islands = hasty->islands;
+	memset(islands, 0, num_islands*sizeof(struct SolverBatch));
+	
+	int *item_islands = hasty->item_islands;
+	for(int i=0; i<arbiter_count; i++){
+		int island = item_islands[i] = IslandForPair(hasty, arbiters[i].body_a, arbiters[i].body_b);
+		islands[island].arbiter_count++;
+	}
+	
+	for(int i=0; i<constraint_count; i++){
+		cpConstraint *constraint = constraints[i];
+		int island = item_islands[arbiter_count + i] = IslandForPair(hasty, constraint->a->solverIndex, constraint->b->solverIndex);
+		islands[island].constraint_count++;
+	}
+	
+	// Sort the islands from the most to the least work so the big ones get started first.
+	// The items in island 0 must always be colored, so it sorts first.
+	struct IslandKey *keys = hasty->island_keys;
+	for(int i=0; i<num_islands; i++){
+		keys[i].cost = (i == 0 ? INT_MAX : islands[i].arbiter_count + islands[i].constraint_count);
+		keys[i].island = i;
+	}
+	qsort(keys, num_islands, sizeof(struct IslandKey), (int (*)(const void *, const void *))IslandKeyCompare);
+	
+	// Islands of lone bodies with no items sort last and can be dropped.
+	while(keys[num_islands - 1].cost == 0) num_islands--;
+	hasty->num_islands = num_islands;
+	
+	// Lay the islands out in sorted order so the colored ones form a contiguous run at the start.
+	hasty->num_colored_islands = 0;
+	int arbiter_offset = 0, constraint_offset = 0;
+	for(int i=0; i<num_islands; i++){
+		struct SolverBatch *island = islands + keys[i].island;
+		island->arbiter_offset = arbiter_offset;
+		island->constraint_offset = constraint_offset;
+		arbiter_offset += island->arbiter_count;
+		constraint_offset += island->constraint_count;
+		
+		if(keys[i].cost > MAX_ISLAND_COST) hasty->num_colored_islands = i + 1;
+		
+		// Reset the counts to use them as fill cursors.
+		island->arbiter_count = island->constraint_count = 0;
+	}
+	
+	for(int i=0; i<arbiter_count; i++){
+		struct SolverBatch *island = islands + item_islands[i];
+		hasty->island_arbiters[island->arbiter_offset + island->arbiter_count++] = arbiters[i];
+	}
+	
+	for(int i=0; i<constraint_count; i++){
+		struct SolverBatch *island = islands + item_islands[arbiter_count + i];
+		hasty->island_constraints[island->constraint_offset + island->constraint_count++] = constraints[i];
+	}
+	
+	return cpTrue;
+}
+
+static inline void
+SyncIslandBodies(cpConstraint **constraints, int count, struct SolverBody *bodies, struct SolverBodyInfo *infos, cpBool store)
+{
+	// Shared infinite mass bodies are never modified and are skipped.
+	for(int j=0; j<count; j++){
+		int index_a = constraints[j]->a->solverIndex, index_b = constraints[j]->b->solverIndex;
+		
+		if(infos[index_a].kind == SOLVER_BODY_DYNAMIC){
+			if(store) SolverBodyStore(bodies + index_a, infos[index_a].body); else SolverBodyLoad(bodies + index_a, infos[index_a].body);
+		}
+		
+		if(infos[index_b].kind == SOLVER_BODY_DYNAMIC){
+			if(store) SolverBodyStore(bodies + index_b, infos[index_b].body); else SolverBodyLoad(bodies + index_b, infos[index_b].body);
+		}
+	}
+}
+
+static void
+IslandTask(struct SolverContext *context, unsigned long task, unsigned long thread)
+{
+	cpHastySpace *hasty = context->hasty;
+	struct SolverBatch *island = hasty->islands + hasty->island_keys[hasty->num_colored_islands + task].island;
+	struct SolverBody *bodies = hasty->solver_bodies;
+	struct SolverBodyInfo *infos = hasty->solver_body_infos;
+	
+	struct SolverArbiter *arbiters = hasty->island_arbiters + island->arbiter_offset;
+	cpConstraint **constraints = hasty->island_constraints + island->constraint_offset;
+	int arbiter_count = island->arbiter_count, constraint_count = island->constraint_count;
+	
+	if(context->pass == SOLVER_PASS_PRE_STEP){
+		for(int j=0; j<constraint_count; j++) ConstraintPass(context, constraints[j]);
+		return;
+	}
+	
+	// Islands are small, so all of the solver iterations are run together by a single task.
+	int passes = (context->pass == SOLVER_PASS_SOLVE ? hasty->space.iterations : 1);
+	for(int i=0; i<passes; i++){
+		if(context->pass == SOLVER_PASS_WARM_START){
+			for(int j=0; j<arbiter_count; j++) SolverArbiterApplyCachedImpulse(arbiters + j, bodies, context->dt_coef);
+		} else {
+			for(int j=0; j<arbiter_count; j++) ArbiterApplyImpulse(arbiters + j, bodies);
+		}
+		
+		if(constraint_count == 0) continue;
+		
+		SyncIslandBodies(constraints, constraint_count, bodies, infos, cpTrue);
+		for(int j=0; j<constraint_count; j++) ConstraintPass(context, constraints[j]);
+		SyncIslandBodies(constraints, constraint_count, bodies, infos, cpFalse);
+	}
+}
+
+// Sort the arbiters and constraints into islands or colors. Called once per step before the first solver pass.
+static void
+BuildSolverSchedule(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	BuildSolverBodies(hasty);
+	
+	hasty->threaded = ((unsigned long)(space->arbiters->num + space->constraints->num) > hasty->constraint_count_threshold);
+	hasty->use_islands = (hasty->solver_mode == CP_HASTY_SOLVER_ISLANDS && BuildSolverIslands(hasty));
+	
+	if(hasty->use_islands){
+		// Color the items in the big islands at the start of the sorted list.
+		int colored_arbiters = 0, colored_constraints = 0;
+		if(hasty->num_colored_islands > 0){
+			struct SolverBatch *last = hasty->islands + hasty->island_keys[hasty->num_colored_islands - 1].island;
+			colored_arbiters = last->arbiter_offset + last->arbiter_count;
+			colored_constraints = last->constraint_offset + last->constraint_count;
+		}
+		
+		ColorSolverBatches(hasty, hasty->island_arbiters, colored_arbiters, hasty->island_constraints, colored_constraints);
+	} else {
+		ColorSolverBatches(hasty, hasty->solver_arbiters, space->arbiters->num, (cpConstraint **)space->constraints->arr, space->constraints->num);
+	}
+}
+
+static void
+RunSolverPass(cpHastySpace *hasty, enum SolverPass pass, cpFloat dt, cpFloat dt_coef)
+{
+	struct SolverContext context = {hasty, NULL, pass, dt, dt_coef, cpFalse};
+	
+	int passes = (pass == SOLVER_PASS_SOLVE ? hasty->space.iterations : 1);
+	for(int i=0; i<passes; i++) RunColorPass(hasty, &context);
+	
+	if(hasty->use_islands){
+		unsigned long tasks = hasty->num_islands - hasty->num_colored_islands;
+		
+		if(hasty->threaded){
+			cpHastyThreadPoolRun(hasty->pool, tasks, (cpHastyTaskFunc)IslandTask, &context);
+		} else {
+			for(unsigned long i=0; i<tasks; i++) IslandTask(&context, i, 0);
+		}
+	}
+}
+
+struct PreStepContext {
+	cpHastySpace *hasty;
+	cpFloat dt, slop, bias;
+};
+
+static void
+PreStepArbitersTask(struct PreStepContext *context, unsigned long task, unsigned long thread)
+{
+	cpArray *arbiters = context->hasty->space.arbiters;
+	
+	int start = (int)task*SOLVER_TASK_SIZE;
+	int end = start + SOLVER_TASK_SIZE;
+	if(end > arbiters->num) end = arbiters->num;
+	
+	// Each arbiter only writes to its own contacts.
+	for(int i=start; i<end; i++) cpArbiterPreStep((cpArbiter *)arbiters->arr[i], context->dt, context->slop, context->bias);
+}
+
+static void
+PreStepArbiters(cpHastySpace *hasty, cpFloat dt)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	struct PreStepContext context = {hasty, dt, space->collisionSlop, 1.0f - cpfpow(space->collisionBias, dt)};
+	unsigned long tasks = TaskCount(space->arbiters->num);
+	
+	if((unsigned long)space->arbiters->num > hasty->constraint_count_threshold){
+		cpHastyThreadPoolRun(hasty->pool, tasks, (cpHastyTaskFunc)PreStepArbitersTask, &context);
+	} else {
+		for(unsigned long i=0; i<tasks; i++) PreStepArbitersTask(&context, i, 0);
+	}
+}
+
+//MARK: Integration
+
+// Bodies and shapes are integrated and updated independently of each other, so they are split into chunks for the pool.
+// Custom update functions are called serially after the parallel pass unless they are flagged as thread safe.
+
+// Number of bodies or shapes to update per task.
+#define INTEGRATE_TASK_SIZE 64
+
+struct IntegrateContext {
+	cpHastySpace *hasty;
+	cpVect gravity;
+	cpFloat damping;
+	cpFloat dt;
+};
+
+static inline cpBool
+VelocityFuncParallel(cpBody *body)
+{
+	return (body->velocity_func == cpBodyUpdateVelocity || body->threadSafeFuncs);
+}
+
+static inline cpBool
+PositionFuncParallel(cpBody *body)
+{
+	return (body->position_func == cpBodyUpdatePosition || body->threadSafeFuncs);
+}
+
+static inline unsigned long
+IntegrateTaskCount(int count)
+{
+	return (count + INTEGRATE_TASK_SIZE - 1)/INTEGRATE_TASK_SIZE;
+}
+
+static void
+IntegratePositionsTask(struct IntegrateContext *context, unsigned long task, unsigned long thread)
+{
+	cpArray *bodies = context->hasty->space.dynamicBodies;
+	int start = (int)task*INTEGRATE_TASK_SIZE;
+	int end = start + INTEGRATE_TASK_SIZE;
+	if(end > bodies->num) end = bodies->num;
+	
+	for(int i=start; i<end; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		if(PositionFuncParallel(body)) body->position_func(body, context->dt);
+	}
+}
+
+static void
+IntegratePositions(cpHastySpace *hasty, cpFloat dt)
+{
+	cpArray *bodies = hasty->space.dynamicBodies;
+	struct IntegrateContext context = {hasty, cpvzero, 0.0f, dt};
+	cpHastyThreadPoolRun(hasty->pool, IntegrateTaskCount(bodies->num), (cpHastyTaskFunc)IntegratePositionsTask, &context);
+	
+	for(int i=0; i<bodies->num; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		if(!PositionFuncParallel(body)) body->position_func(body, dt);
+	}
+}
+
+static void
+IntegrateVelocitiesTask(struct IntegrateContext *context, unsigned long task, unsigned long thread)
+{
+	cpArray *bodies = context->hasty->space.dynamicBodies;
+	int start = (int)task*INTEGRATE_TASK_SIZE;
+	int end = start + INTEGRATE_TASK_SIZE;
+	if(end > bodies->num) end = bodies->num;
+	
+	for(int i=start; i<end; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		if(VelocityFuncParallel(body)) body->velocity_func(body, context->gravity, context->damping, context->dt);
+	}
+}
+
+static void
+IntegrateVelocities(cpHastySpace *hasty, cpVect gravity, cpFloat damping, cpFloat dt)
+{
+	cpArray *bodies = hasty->space.dynamicBodies;
+	struct IntegrateContext context = {hasty, gravity, damping, dt};
+	cpHastyThreadPoolRun(hasty->pool, IntegrateTaskCount(bodies->num), (cpHastyTaskFunc)IntegrateVelocitiesTask, &context);
+	
+	for(int i=0; i<bodies->num; i++){
+		cpBody *body = (cpBody *)bodies->arr[i];
+		if(!VelocityFuncParallel(body)) body->velocity_func(body, gravity, damping, dt);
+	}
+}
+
+static void
+CollectShape(cpShape *shape, cpHastySpace *hasty)
+{
+	int index = hasty->num_shapes++;
+	hasty->shapes = (cpShape **)GrowBuffer(hasty->space.allocator, hasty->shapes, &hasty->shapes_max, hasty->num_shapes, sizeof(cpShape *));
+	hasty->shapes[index] = shape;
+}
+
+static void
+UpdateShapesTask(cpHastySpace *hasty, unsigned long task, unsigned long thread)
+{
+	int start = (int)task*INTEGRATE_TASK_SIZE;
+	int end = start + INTEGRATE_TASK_SIZE;
+	if(end > hasty->num_shapes) end = hasty->num_shapes;
+	
+	for(int i=start; i<end; i++) cpShapeUpdateFunc(hasty->shapes[i], NULL);
+}
+
+// Parallel version of updating the bounding boxes with cpSpatialIndexEach() and cpShapeUpdateFunc().
+static void
+UpdateShapes(cpHastySpace *hasty)
+{
+	hasty->num_shapes = 0;
+	cpSpatialIndexEach(hasty->space.dynamicShapes, (cpSpatialIndexIteratorFunc)CollectShape, hasty);
+	cpHastyThreadPoolRun(hasty->pool, IntegrateTaskCount(hasty->num_shapes), (cpHastyTaskFunc)UpdateShapesTask, hasty);
+}
+
+//MARK: Narrow Phase
+
+// The broadphase only collects the pairs of shapes that pass cpSpaceQueryReject().
+// The pool then runs cpCollide() on the pairs in parallel, storing the contacts with each pair.
+// Finally the arbiters are updated and the collision handlers are called serially in broadphase order like cpSpaceStep().
+//
+// The spatial index stores the collision ID returned by the query callback to warm start the pair's next collision.
+// The real ID isn't known until after the callback returns, so a handle to the pair is returned in its place.
+// The next step uses the handle to look the ID and the pair's arbiter up in the previous step's pairs.
+
+// Number of pairs to collide per task.
+#define COLLIDE_TASK_SIZE 16
+
+struct CollisionPair {
+	cpShape *a, *b;
+	// Handle to the pair's arbiter so it doesn't need to be looked up in cachedArbiters, 0 if it doesn't have one.
+	cpCollisionID arbiter;
+	struct cpCollisionInfo info;
+	struct cpContact contacts[CP_MAX_CONTACTS_PER_ARBITER];
+};
+
+static struct CollisionPair *
+PrevPair(cpHastySpace *hasty, cpShape *a, cpShape *b, cpCollisionID handle)
+{
+	// Handles are the pair's index plus one so that 0 can still mean no ID.
+	unsigned int index = handle - 1;
+	struct CollisionPair *pair = hasty->prev_pairs + index;
+	
+	if(handle != 0 && index < (unsigned int)hasty->num_prev_pairs && pair->a == a && pair->b == b){
+		return pair;
+	} else {
+		return NULL;
+	}
+}
+
+static cpCollisionID
+CollectPair(cpShape *a, cpShape *b, cpCollisionID id, cpHastySpace *hasty)
+{
+	if(cpSpaceQueryReject(a, b)) return id;
+	
+	int index = hasty->num_pairs++;
+	hasty->pairs = (struct CollisionPair *)GrowBuffer(hasty->space.allocator, hasty->pairs, &hasty->pairs_max, hasty->num_pairs, sizeof(struct CollisionPair));
+	
+	struct CollisionPair *pair = hasty->pairs + index;
+	pair->a = a;
+	pair->b = b;
+	
+	struct CollisionPair *prev = PrevPair(hasty, a, b, id);
+	pair->arbiter = (prev ? prev->arbiter : 0);
+	pair->info.id = (prev ? prev->info.id : 0);
+	
+	return (cpCollisionID)(index + 1);
+}
+
+static void
+CollideTask(cpHastySpace *hasty, unsigned long task, unsigned long thread)
+{
+	int start = (int)task*COLLIDE_TASK_SIZE;
+	int end = start + COLLIDE_TASK_SIZE;
+	if(end > hasty->num_pairs) end = hasty->num_pairs;
+	
+	for(int i=start; i<end; i++){
+		struct CollisionPair *pair = hasty->pairs + i;
+		pair->info = cpCollide(pair->a, pair->b, pair->info.id, pair->contacts);
+	}
+}
+
+static void
+CollideShapes(cpHastySpace *hasty)
+{
+	cpSpace *space = (cpSpace *)hasty;
+	
+	// Keep the previous step's pairs to look up the warm starting IDs.
+	struct CollisionPair *pairs = hasty->prev_pairs;
+	int pairs_max = hasty->prev_pairs_max;
+	hasty->prev_pairs = hasty->pairs;
+	hasty->prev_pairs_max = hasty->pairs_max;
+	hasty->num_prev_pairs = hasty->num_pairs;
+	hasty->pairs = pairs;
+	hasty->pairs_max = pairs_max;
+	hasty->num_pairs = 0;
+	
+	cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)CollectPair, hasty);
+	CP_STEP_STATS_COUNT(space, pairsTested, hasty->num_pairs);
+	CP_STEP_STATS_MARK();
+	
+	unsigned long tasks = (hasty->num_pairs + COLLIDE_TASK_SIZE - 1)/COLLIDE_TASK_SIZE;
+	cpHastyThreadPoolRun(hasty->pool, tasks, (cpHastyTaskFunc)CollideTask, hasty);
+	
+	for(int i=0; i<hasty->num_pairs; i++){
+		struct CollisionPair *pair = hasty->pairs + i;
+		int count = pair->info.count;
+		if(count == 0) continue;
+		
+		struct cpContact *contacts = cpContactBufferGetArray(space);
+		memcpy(contacts, pair->contacts, count*sizeof(struct cpContact));
+		pair->info.arr = contacts;
+		
+		cpArbiter *arb = cpSpaceProcessCollision(space, &pair->info, cpSpaceArbiterForHandle(space, pair->a, pair->b, pair->arbiter));
+		pair->arbiter = (CP_ARBITER_HANDLE_TAG | (cpCollisionID)arb->handle);
+	}
+	
+	CP_STEP_STATS_LAP(space, narrowPhase);
+}
+
+//MARK: Thread Management Functions
+
+static void
+cpHastySpaceReleasePool(cpHastySpace *hasty)
+{
+	if(hasty->owns_pool) cpHastyThreadPoolFree(hasty->pool);
+	
+	hasty->pool = NULL;
+	hasty->owns_pool = cpFalse;
+}
+
+void
+cpHastySpaceSetThreads(cpSpace *space, unsigned long threads)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpHastySpaceReleasePool(hasty);
+	
+	hasty->pool = cpHastyThreadPoolNew(threads);
+	hasty->owns_pool = cpTrue;
+}
+
+unsigned long
+cpHastySpaceGetThreads(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->pool->num_threads;
+}
+
+void
+cpHastySpaceSetThreadPool(cpSpace *space, cpHastyThreadPool *pool)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	
+	if(pool){
+		cpHastySpaceReleasePool(hasty);
+		hasty->pool = pool;
+	} else {
+		cpHastySpaceSetThreads(space, 1);
+	}
+}
+
+cpHastyThreadPool *
+cpHastySpaceGetThreadPool(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->pool;
+}
+
+void
+cpHastySpaceSetSolverMode(cpSpace *space, cpHastySolverMode mode)
+{
+	((cpHastySpace *)space)->solver_mode = mode;
+}
+
+cpHastySolverMode
+cpHastySpaceGetSolverMode(cpSpace *space)
+{
+	return ((cpHastySpace *)space)->solver_mode;
+}
+
+void
+cpHastySpaceSetWideSolver(cpSpace *space, cpBool enabled)
+{
+	((cpHastySpace *)space)->wide_solver = enabled;
+}
+
+cpBool
+cpHastySpaceGetWideSolver(cpSpace *space)
+{
+	return (WideApplyImpulses != NULL && ((cpHastySpace *)space)->wide_solver);
+}
+
+//MARK: Overriden cpSpace Functions.
+
+cpSpace *
+cpHastySpaceNew(void)
+{
+	return cpHastySpaceNewWithAllocator(NULL);
+}
+
+cpSpace *
+cpHastySpaceNewWithAllocator(cpAllocator *allocator)
+{
+	cpHastySpace *hasty = (cpHastySpace *)cpAllocatorCalloc(allocator, 1, sizeof(cpHastySpace));
+	cpSpaceInitWithAllocator((cpSpace *)hasty, allocator);
+	
+	ChooseWideSolver();
+	hasty->wide_solver = cpTrue;
+	
+	// TODO magic number, should test this more thoroughly.
+	hasty->constraint_count_threshold = 50;
+	
+	// The solver's results don't depend on the thread count, so default to using all of the cores.
+	cpHastySpaceSetThreads((cpSpace *)hasty, 0);
+
+	return (cpSpace *)hasty;
+}
+
+void
+cpHastySpaceFree(cpSpace *space)
+{
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpHastySpaceReleasePool(hasty);
+	
+	cpAllocator *allocator = space->allocator;
+	cpAllocatorFree(allocator, hasty->shapes);
+	cpAllocatorFree(allocator, hasty->pairs);
+	cpAllocatorFree(allocator, hasty->prev_pairs);
+	cpAllocatorFree(allocator, hasty->solver_bodies);
+	cpAllocatorFree(allocator, hasty->solver_body_infos);
+	cpAllocatorFree(allocator, hasty->constrained_bodies);
+	cpAllocatorFree(allocator, hasty->solver_arbiters);
+	cpAllocatorFree(allocator, hasty->body_colors);
+	cpAllocatorFree(allocator, hasty->item_colors);
+	cpAllocatorFree(allocator, hasty->colored_arbiters);
+	cpAllocatorFree(allocator, hasty->colored_constraints);
+	cpAllocatorFree(allocator, hasty->body_islands);
+	cpAllocatorFree(allocator, hasty->item_islands);
+	cpAllocatorFree(allocator, hasty->islands);
+	cpAllocatorFree(allocator, hasty->island_keys);
+	cpAllocatorFree(allocator, hasty->island_arbiters);
+	cpAllocatorFree(allocator, hasty->island_constraints);
+	
+	cpSpaceFree(space);
+}
+
+void
+cpHastySpaceStep(cpSpace *space, cpFloat dt)
+{
+	// don't step if the timestep is 0!
+	if(dt == 0.0f) return;
+	
+	CP_STEP_STATS_START(space);
+	space->stamp++;
+	
+	cpFloat prev_dt = space->curr_dt;
+	space->curr_dt = dt;
+		
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpArray *constraints = space->constraints;
+	cpArray *arbiters = space->arbiters;
+	
+	// Reset and empty the arbiter list.
+	for(int i=0; i<arbiters->num; i++){
+		cpArbiter *arb = (cpArbiter *)arbiters->arr[i];
+		arb->state = CP_ARBITER_STATE_NORMAL;
+		
+		// If both bodies are awake, unthread the arbiter from the contact graph.
+		if(!cpBodyIsSleeping(arb->body_a) && !cpBodyIsSleeping(arb->body_b)){
+			cpArbiterUnthread(arb);
+		}
+	}
+	arbiters->num = 0;
+	CP_STEP_STATS_LAP(space, arbiterFilter);
+	
+	cpSpaceLock(space); {
+		// Integrate positions
+		IntegratePositions(hasty, dt);
+		CP_STEP_STATS_LAP(space, integratePositions);
+		
+		// Find colliding pairs.
+		cpSpacePushFreshContactBuffer(space);
+		UpdateShapes(hasty);
+		CP_STEP_STATS_LAP(space, updateBBs);
+		
+		CollideShapes(hasty);
+		CP_STEP_STATS_LAP(space, reindexQuery);
+		CP_STEP_STATS_EXCLUDE(space, reindexQuery, narrowPhase);
+	} cpSpaceUnlock(space, cpFalse);
+	
+	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
+	cpSpaceProcessComponents(space, dt);
+	CP_STEP_STATS_LAP(space, processComponents);
+	
+	cpSpaceLock(space); {
+		// Clear out old cached arbiters and call separate callbacks
+		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		CP_STEP_STATS_LAP(space, arbiterFilter);
+
+		// Prestep the arbiters and constraints.
+		PreStepArbiters(hasty, dt);
+		
+		for(int i=0; i<constraints->num; i++){
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 			
 			cpConstraintPreSolveFunc preSolve = constraint->preSolve;
 			if(preSolve) preSolve(constraint, space);
-			
-			constraint->klass->preStep(constraint, dt);
 		}
-	
+		
+		BuildSolverSchedule(hasty);
+		RunSolverPass(hasty, SOLVER_PASS_PRE_STEP, dt, 0.0f);
+		
+		for(int i=0; i<constraints->num; i++){
+			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
+			if(!PreStepParallel(constraint)) constraint->klass->preStep(constraint, dt);
+		}
+		CP_STEP_STATS_LAP(space, preStep);
+		
 		// Integrate velocities.
 		cpFloat damping = cpfpow(space->damping, dt);
 		cpVect gravity = space->gravity;
-		for(int i=0; i<bodies->num; i++){
-			cpBody *body = (cpBody *)bodies->arr[i];
-			body->velocity_func(body, gravity, damping, dt);
-		}
+		IntegrateVelocities(hasty, gravity, damping, dt);
+		LoadSolverBodies(hasty);
+		CP_STEP_STATS_LAP(space, integrateVelocities);
 		
 		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
-		for(int i=0; i<arbiters->num; i++){
-			cpArbiterApplyCachedImpulse((cpArbiter *)arbiters->arr[i], dt_coef);
-		}
-		
-		for(int i=0; i<constraints->num; i++){
-			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
-			constraint->klass->applyCachedImpulse(constraint, dt_coef);
-		}
+		RunSolverPass(hasty, SOLVER_PASS_WARM_START, dt, dt_coef);
+		CP_STEP_STATS_LAP(space, warmStart);
 		
 		// Run the impulse solver.
-		cpHastySpace *hasty = (cpHastySpace *)space;
-		if((unsigned long)(arbiters->num + constraints->num) > hasty->constraint_count_threshold){
-			RunWorkers(hasty, Solver);
-		} else {
-			Solver(space, 0, 1);
-		}
+		RunSolverPass(hasty, SOLVER_PASS_SOLVE, dt, 0.0f);
+		StoreSolverBodies(hasty);
+		CP_STEP_STATS_LAP(space, solve);
 		
 		// Run the constraint post-solve callbacks
 		for(int i=0; i<constraints->num; i++){
@@ -491,4 +1978,21 @@ cpHastySpaceStep(cpSpace *space, cpFloat dt)
 			handler->postSolveFunc(arb, space, handler->userData);
 		}
 	} cpSpaceUnlock(space, cpTrue);
+	CP_STEP_STATS_LAP(space, callbacks);
+	
+	CP_STEP_STATS_FINISH(space);
+}
+
+void
+cpHastySpaceReindexStatic(cpSpace *space)
+{
+	cpAssertHard(!space->locked, "You cannot manually reindex objects while the space is locked. Wait until the current query or step is complete.");
+	
+	cpHastySpace *hasty = (cpHastySpace *)space;
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)&cpShapeUpdateFunc, NULL);
+	cpSpatialIndexReindex(space->staticShapes);
+	
+	if(cpSpatialIndexIsBBTree(space->staticShapes)){
+		cpBBTreeOptimizeParallel(space->staticShapes, (cpBBTreeRunTasksFunc)cpHastyThreadPoolRun, hasty->pool);
+	}
 }
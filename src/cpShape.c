@@ -205,6 +205,13 @@ cpShapeSetFilter(cpShape *shape, cpShapeFilter filter)
 {
 	cpBodyActivate(shape->body);
 	shape->filter = filter;
+	
+	// The trees keep a copy of the filter to skip shapes that can't collide or match a query.
+	cpSpace *space = shape->space;
+	if(space){
+		if(cpSpatialIndexIsBBTree(space->dynamicShapes)) cpBBTreeUpdateFilter(space->dynamicShapes, shape, shape->hashid);
+		if(cpSpatialIndexIsBBTree(space->staticShapes)) cpBBTreeUpdateFilter(space->staticShapes, shape, shape->hashid);
+	}
 }
 
 cpBB
@@ -36,6 +36,16 @@ arbiterSetEql(cpShape **shapes, cpArbiter *arb)
 	return ((a == arb->a && b == arb->b) || (b == arb->a && a == arb->b));
 }
 
+// Equal function for noCollidePairs.
+static cpBool
+noCollidePairsEql(cpBody **bodies, cpConstraint *constraint)
+{
+	cpBody *a = bodies[0];
+	cpBody *b = bodies[1];
+	
+	return ((a == constraint->a && b == constraint->b) || (b == constraint->a && a == constraint->b));
+}
+
 //MARK: Collision Handler Set HelperFunctions
 
 // Equals function for collisionHandlers.
@@ -50,9 +60,9 @@ handlerSetEql(cpCollisionHandler *check, cpCollisionHandler *pair)
 
 // Transformation function for collisionHandlers.
 static void *
-handlerSetTrans(cpCollisionHandler *handler, void *unused)
+handlerSetTrans(cpCollisionHandler *handler, cpSpace *space)
 {
-	cpCollisionHandler *copy = (cpCollisionHandler *)cpcalloc(1, sizeof(cpCollisionHandler));
+	cpCollisionHandler *copy = (cpCollisionHandler *)cpAllocatorCalloc(space->allocator, 1, sizeof(cpCollisionHandler));
 	memcpy(copy, handler, sizeof(cpCollisionHandler));
 	
 	return copy;
@@ -106,7 +116,7 @@ cpCollisionHandler cpCollisionHandlerDoNothing = {
 static cpVect ShapeVelocityFunc(cpShape *shape){return shape->body->v;}
 
 // Used for disposing of collision handlers.
-static void FreeWrap(void *ptr, void *unused){cpfree(ptr);}
+static void FreeWrap(void *ptr, cpAllocator *allocator){cpAllocatorFree(allocator, ptr);}
 
 //MARK: Memory Management Functions
 
@@ -118,6 +128,12 @@ cpSpaceAlloc(void)
 
 cpSpace*
 cpSpaceInit(cpSpace *space)
+{
+	return cpSpaceInitWithAllocator(space, NULL);
+}
+
+cpSpace*
+cpSpaceInitWithAllocator(cpSpace *space, cpAllocator *allocator)
 {
 #ifndef NDEBUG
 	static cpBool done = cpFalse;
@@ -136,40 +152,51 @@ cpSpaceInit(cpSpace *space)
 	space->collisionSlop = 0.1f;
 	space->collisionBias = cpfpow(1.0f - 0.1f, 60.0f);
 	space->collisionPersistence = 3;
+	space->treeOptimizationPasses = 0;
+	space->treeUpdateMode = CP_BBTREE_UPDATE_REINSERT;
 	
 	space->locked = 0;
 	space->stamp = 0;
 	
+	space->allocator = allocator;
+	
 	space->shapeIDCounter = 0;
-	space->staticShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	space->dynamicShapes = cpBBTreeNew((cpSpatialIndexBBFunc)cpShapeGetBB, space->staticShapes);
+	space->staticShapes = cpBBTreeNewWithAllocator((cpSpatialIndexBBFunc)cpShapeGetBB, NULL, allocator);
+	cpBBTreeSetFlatLayout(space->staticShapes, cpTrue);
+	cpBBTreeSetFilterFunc(space->staticShapes, (cpBBTreeFilterFunc)cpShapeGetFilter);
+	space->dynamicShapes = cpBBTreeNewWithAllocator((cpSpatialIndexBBFunc)cpShapeGetBB, space->staticShapes, allocator);
 	cpBBTreeSetVelocityFunc(space->dynamicShapes, (cpBBTreeVelocityFunc)ShapeVelocityFunc);
+	cpBBTreeSetFilterFunc(space->dynamicShapes, (cpBBTreeFilterFunc)cpShapeGetFilter);
 	
-	space->allocatedBuffers = cpArrayNew(0);
+	space->allocatedBuffers = cpArrayNew(0, allocator);
 	
-	space->dynamicBodies = cpArrayNew(0);
-	space->staticBodies = cpArrayNew(0);
-	space->sleepingComponents = cpArrayNew(0);
-	space->rousedBodies = cpArrayNew(0);
+	space->dynamicBodies = cpArrayNew(0, allocator);
+	space->staticBodies = cpArrayNew(0, allocator);
+	space->sleepingComponents = cpArrayNew(0, allocator);
+	space->rousedBodies = cpArrayNew(0, allocator);
 	
 	space->sleepTimeThreshold = INFINITY;
 	space->idleSpeedThreshold = 0.0f;
 	
-	space->arbiters = cpArrayNew(0);
-	space->pooledArbiters = cpArrayNew(0);
+	space->arbiters = cpArrayNew(0, allocator);
+	space->pooledArbiters = cpArrayNew(0, allocator);
+	space->arbiterHandles = cpArrayNew(0, allocator);
 	
 	space->contactBuffersHead = NULL;
-	space->cachedArbiters = cpHashSetNew(0, (cpHashSetEqlFunc)arbiterSetEql);
+	space->cachedArbiters = cpHashSetNew(0, (cpHashSetEqlFunc)arbiterSetEql, allocator);
 	
-	space->constraints = cpArrayNew(0);
+	space->constraints = cpArrayNew(0, allocator);
+	space->noCollidePairs = cpHashSetNew(0, (cpHashSetEqlFunc)noCollidePairsEql, allocator);
 	
 	space->usesWildcards = cpFalse;
 	memcpy(&space->defaultHandler, &cpCollisionHandlerDoNothing, sizeof(cpCollisionHandler));
-	space->collisionHandlers = cpHashSetNew(0, (cpHashSetEqlFunc)handlerSetEql);
+	space->collisionHandlers = cpHashSetNew(0, (cpHashSetEqlFunc)handlerSetEql, allocator);
 	
-	space->postStepCallbacks = cpArrayNew(0);
+	space->postStepCallbacks = cpArrayNew(0, allocator);
 	space->skipPostStep = cpFalse;
 	
+	memset(&space->stepStats, 0, sizeof(cpSpaceStepStats));
+	
 	cpBody *staticBody = cpBodyInit(&space->_staticBody, 0.0f, 0.0f);
 	cpBodySetType(staticBody, CP_BODY_TYPE_STATIC);
 	cpSpaceSetStaticBody(space, staticBody);
@@ -183,6 +210,13 @@ cpSpaceNew(void)
 	return cpSpaceInit(cpSpaceAlloc());
 }
 
+cpSpace*
+cpSpaceNewWithAllocator(cpAllocator *allocator)
+{
+	cpSpace *space = (cpSpace *)cpAllocatorCalloc(allocator, 1, sizeof(cpSpace));
+	return cpSpaceInitWithAllocator(space, allocator);
+}
+
 static void cpBodyActivateWrap(cpBody *body, void *unused){cpBodyActivate(body);}
 
 void
@@ -199,23 +233,25 @@ cpSpaceDestroy(cpSpace *space)
 	cpArrayFree(space->rousedBodies);
 	
 	cpArrayFree(space->constraints);
+	cpHashSetFree(space->noCollidePairs);
 	
 	cpHashSetFree(space->cachedArbiters);
 	
 	cpArrayFree(space->arbiters);
 	cpArrayFree(space->pooledArbiters);
+	cpArrayFree(space->arbiterHandles);
 	
 	if(space->allocatedBuffers){
-		cpArrayFreeEach(space->allocatedBuffers, cpfree);
+		cpArrayFreeElements(space->allocatedBuffers);
 		cpArrayFree(space->allocatedBuffers);
 	}
 	
 	if(space->postStepCallbacks){
-		cpArrayFreeEach(space->postStepCallbacks, cpfree);
+		cpArrayFreeElements(space->postStepCallbacks);
 		cpArrayFree(space->postStepCallbacks);
 	}
 	
-	if(space->collisionHandlers) cpHashSetEach(space->collisionHandlers, FreeWrap, NULL);
+	if(space->collisionHandlers) cpHashSetEach(space->collisionHandlers, (cpHashSetIteratorFunc)FreeWrap, space->allocator);
 	cpHashSetFree(space->collisionHandlers);
 }
 
@@ -223,8 +259,9 @@ void
 cpSpaceFree(cpSpace *space)
 {
 	if(space){
+		cpAllocator *allocator = space->allocator;
 		cpSpaceDestroy(space);
-		cpfree(space);
+		cpAllocatorFree(allocator, space);
 	}
 }
 
@@ -335,6 +372,32 @@ cpSpaceSetCollisionPersistence(cpSpace *space, cpTimestamp collisionPersistence)
 	space->collisionPersistence = collisionPersistence;
 }
 
+int
+cpSpaceGetTreeOptimizationPasses(const cpSpace *space)
+{
+	return space->treeOptimizationPasses;
+}
+
+void
+cpSpaceSetTreeOptimizationPasses(cpSpace *space, int passes)
+{
+	space->treeOptimizationPasses = passes;
+	if(cpSpatialIndexIsBBTree(space->dynamicShapes)) cpBBTreeSetOptimizationPasses(space->dynamicShapes, passes);
+}
+
+cpBBTreeUpdateMode
+cpSpaceGetTreeUpdateMode(const cpSpace *space)
+{
+	return space->treeUpdateMode;
+}
+
+void
+cpSpaceSetTreeUpdateMode(cpSpace *space, cpBBTreeUpdateMode mode)
+{
+	space->treeUpdateMode = mode;
+	if(cpSpatialIndexIsBBTree(space->dynamicShapes)) cpBBTreeSetUpdateMode(space->dynamicShapes, mode);
+}
+
 cpDataPointer
 cpSpaceGetUserData(const cpSpace *space)
 {
@@ -347,6 +410,12 @@ cpSpaceSetUserData(cpSpace *space, cpDataPointer userData)
 	space->userData = userData;
 }
 
+cpAllocator *
+cpSpaceGetAllocator(const cpSpace *space)
+{
+	return space->allocator;
+}
+
 cpBody *
 cpSpaceGetStaticBody(const cpSpace *space)
 {
@@ -359,6 +428,12 @@ cpSpaceGetCurrentTimeStep(const cpSpace *space)
 	return space->curr_dt;
 }
 
+cpSpaceStepStats
+cpSpaceGetStepStats(const cpSpace *space)
+{
+	return space->stepStats;
+}
+
 void
 cpSpaceSetStaticBody(cpSpace *space, cpBody *body)
 {
@@ -399,7 +474,7 @@ cpCollisionHandler *cpSpaceAddCollisionHandler(cpSpace *space, cpCollisionType a
 {
 	cpHashValue hash = CP_HASH_PAIR(a, b);
 	cpCollisionHandler handler = {a, b, DefaultBegin, DefaultPreSolve, DefaultPostSolve, DefaultSeparate, NULL};
-	return (cpCollisionHandler*)cpHashSetInsert(space->collisionHandlers, hash, &handler, (cpHashSetTransFunc)handlerSetTrans, NULL);
+	return (cpCollisionHandler*)cpHashSetInsert(space->collisionHandlers, hash, &handler, (cpHashSetTransFunc)handlerSetTrans, space);
 }
 
 cpCollisionHandler *
@@ -409,7 +484,7 @@ cpSpaceAddWildcardHandler(cpSpace *space, cpCollisionType type)
 	
 	cpHashValue hash = CP_HASH_PAIR(type, CP_WILDCARD_COLLISION_TYPE);
 	cpCollisionHandler handler = {type, CP_WILDCARD_COLLISION_TYPE, AlwaysCollide, AlwaysCollide, DoNothing, DoNothing, NULL};
-	return (cpCollisionHandler*)cpHashSetInsert(space->collisionHandlers, hash, &handler, (cpHashSetTransFunc)handlerSetTrans, NULL);
+	return (cpCollisionHandler*)cpHashSetInsert(space->collisionHandlers, hash, &handler, (cpHashSetTransFunc)handlerSetTrans, space);
 }
 
 
@@ -469,9 +544,31 @@ cpSpaceAddConstraint(cpSpace *space, cpConstraint *constraint)
 	constraint->next_b = b->constraintList; b->constraintList = constraint;
 	constraint->space = space;
 	
+	if(!constraint->collideBodies) cpSpaceUpdateNoCollidePair(space, a, b);
+	
 	return constraint;
 }
 
+void
+cpSpaceUpdateNoCollidePair(cpSpace *space, cpBody *a, cpBody *b)
+{
+	cpBody *bodies[] = {a, b};
+	cpHashValue hash = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
+	cpHashSetRemove(space->noCollidePairs, hash, bodies);
+	
+	CP_BODY_FOREACH_CONSTRAINT(a, constraint){
+		if(
+			!constraint->collideBodies && (
+				(constraint->a == a && constraint->b == b) ||
+				(constraint->a == b && constraint->b == a)
+			)
+		){
+			cpHashSetInsert(space->noCollidePairs, hash, bodies, NULL, constraint);
+			return;
+		}
+	}
+}
+
 struct arbiterFilterContext {
 	cpSpace *space;
 	cpBody *body;
@@ -502,6 +599,7 @@ cachedArbitersFilter(cpArbiter *arb, struct arbiterFilterContext *context)
 		cpArbiterUnthread(arb);
 		cpArrayDeleteObj(context->space->arbiters, arb);
 		cpArrayPush(context->space->pooledArbiters, arb);
+		cpSpaceSetArbiterCached(context->space, arb, cpFalse);
 		
 		return cpFalse;
 	}
@@ -567,6 +665,8 @@ cpSpaceRemoveConstraint(cpSpace *space, cpConstraint *constraint)
 	cpBodyRemoveConstraint(constraint->a, constraint);
 	cpBodyRemoveConstraint(constraint->b, constraint);
 	constraint->space = NULL;
+	
+	if(!constraint->collideBodies) cpSpaceUpdateNoCollidePair(space, constraint->a, constraint->b);
 }
 
 cpBool cpSpaceContainsShape(cpSpace *space, cpShape *shape)
@@ -656,6 +756,8 @@ cpSpaceReindexStatic(cpSpace *space)
 	
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)&cpShapeUpdateFunc, NULL);
 	cpSpatialIndexReindex(space->staticShapes);
+	
+	if(cpSpatialIndexIsBBTree(space->staticShapes)) cpBBTreeOptimize(space->staticShapes);
 }
 
 void
@@ -683,14 +785,78 @@ copyShapes(cpShape *shape, cpSpatialIndex *index)
 	cpSpatialIndexInsert(index, shape, shape->hashid);
 }
 
+static void
+sumShapeSize(cpShape *shape, cpFloat *sum)
+{
+	cpBB bb = shape->bb;
+	cpFloat size = ((bb.r - bb.l) + (bb.t - bb.b))*0.5f;
+	
+	if(size < INFINITY){
+		sum[0] += size;
+		sum[1] += 1.0f;
+	}
+}
+
 void
 cpSpaceUseSpatialHash(cpSpace *space, cpFloat dim, int count)
 {
-	cpSpatialIndex *staticShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL);
-	cpSpatialIndex *dynamicShapes = cpSpaceHashNew(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes);
+	cpBool autoResize = (dim <= 0.0f || count <= 0);
+	if(autoResize){
+		// Guess using the dynamic shapes already in the space, the hash will correct itself as it goes.
+		cpFloat sum[2] = {0.0f, 0.0f};
+		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)sumShapeSize, sum);
+		
+		if(dim <= 0.0f) dim = (sum[0] > 0.0f ? sum[0]/sum[1] : 1.0f);
+		if(count <= 0) count = 10*(int)sum[1] + 1000;
+	}
+	
+	cpSpatialIndex *staticShapes = cpSpaceHashNewWithAllocator(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, NULL, space->allocator);
+	cpSpatialIndex *dynamicShapes = cpSpaceHashNewWithAllocator(dim, count, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes, space->allocator);
+	cpSpaceHashSetAutoResize((cpSpaceHash *)staticShapes, autoResize);
+	cpSpaceHashSetAutoResize((cpSpaceHash *)dynamicShapes, autoResize);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseSweep2D(cpSpace *space)
+{
+	// The pairs between static and dynamic shapes belong to both indexes, so the static index has to be replaced too.
+	cpSpatialIndex *staticShapes = cpBBTreeNewWithAllocator((cpSpatialIndexBBFunc)cpShapeGetBB, NULL, space->allocator);
+	cpBBTreeSetFlatLayout(staticShapes, cpTrue);
+	cpBBTreeSetFilterFunc(staticShapes, (cpBBTreeFilterFunc)cpShapeGetFilter);
+	cpSpatialIndex *dynamicShapes = cpSweep2DNewWithAllocator((cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes, space->allocator);
+	
+	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
+	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	cpBBTreeOptimize(staticShapes);
+	
+	cpSpatialIndexFree(space->staticShapes);
+	cpSpatialIndexFree(space->dynamicShapes);
+	
+	space->staticShapes = staticShapes;
+	space->dynamicShapes = dynamicShapes;
+}
+
+void
+cpSpaceUseUniformGrid(cpSpace *space, cpFloat dim, cpBB bounds)
+{
+	// A static index can only be paired with one dynamic index, so the static index has to be replaced too.
+	cpSpatialIndex *staticShapes = cpBBTreeNewWithAllocator((cpSpatialIndexBBFunc)cpShapeGetBB, NULL, space->allocator);
+	cpBBTreeSetFlatLayout(staticShapes, cpTrue);
+	cpBBTreeSetFilterFunc(staticShapes, (cpBBTreeFilterFunc)cpShapeGetFilter);
+	cpSpatialIndex *dynamicShapes = cpUniformGridNewWithAllocator(dim, bounds, (cpSpatialIndexBBFunc)cpShapeGetBB, staticShapes, space->allocator);
 	
 	cpSpatialIndexEach(space->staticShapes, (cpSpatialIndexIteratorFunc)copyShapes, staticShapes);
 	cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)copyShapes, dynamicShapes);
+	cpBBTreeOptimize(staticShapes);
 	
 	cpSpatialIndexFree(space->staticShapes);
 	cpSpatialIndexFree(space->dynamicShapes);
@@ -63,12 +63,13 @@ cpSpaceActivateBody(cpSpace *space, cpBody *body)
 				const cpShape *shape_pair[] = {a, b};
 				cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
 				cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, NULL, arb);
+				cpSpaceSetArbiterCached(space, arb, cpTrue);
 				
 				// Update the arbiter's state
 				arb->stamp = space->stamp;
 				cpArrayPush(space->arbiters, arb);
 				
-				cpfree(contacts);
+				cpAllocatorFree(space->allocator, contacts);
 			}
 		}
 		
@@ -98,7 +99,7 @@ cpSpaceDeactivateBody(cpSpace *space, cpBody *body)
 			
 			// Save contact values to a new block of memory so they won't time out
 			size_t bytes = arb->count*sizeof(struct cpContact);
-			struct cpContact *contacts = (struct cpContact *)cpcalloc(1, bytes);
+			struct cpContact *contacts = (struct cpContact *)cpAllocatorCalloc(space->allocator, 1, bytes);
 			memcpy(contacts, arb->contacts, bytes);
 			arb->contacts = contacts;
 		}
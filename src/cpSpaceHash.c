@@ -19,10 +19,12 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 #include "prime.h"
 
-typedef struct cpSpaceHashBin cpSpaceHashBin;
+typedef struct cpSpaceHashEntry cpSpaceHashEntry;
 typedef struct cpHandle cpHandle;
 
 struct cpSpaceHash {
@@ -31,14 +33,27 @@ struct cpSpaceHash {
 	int numcells;
 	cpFloat celldim;
 	
-	cpSpaceHashBin **table;
+	// Index of the first entry of each table cell followed by the total number of entries.
+	// The entries are counting sorted by table cell on every rehash, so each table cell's entries are next to each other.
+	int *table;
+	cpSpaceHashEntry *entries;
+	int entries_max;
+	
 	cpHashSet *handleSet;
 	
-	cpSpaceHashBin *pooledBins;
+	// The objects are stored in slots, a removed object leaves an empty slot until the next rehash.
+	// The slots after the first hashed ones were added since the last rehash and aren't in the table yet.
+	cpHandle **handles;
+	cpBB *bbs;
+	int count, max, hashed;
+	
 	cpArray *pooledHandles;
 	cpArray *allocatedBuffers;
 	
-	cpTimestamp stamp;
+	// Resize the hash automatically based on statistics gathered before each full rehash.
+	cpBool autoResize;
+	// Number of full rehashes in a row that the statistics were out of range for.
+	int outOfRange;
 };
 
 
@@ -46,29 +61,10 @@ struct cpSpaceHash {
 
 struct cpHandle {
 	void *obj;
-	int retain;
-	cpTimestamp stamp;
+	// Index of the slot the object is stored in.
+	int slot;
 };
 
-static cpHandle*
-cpHandleInit(cpHandle *hand, void *obj)
-{
-	hand->obj = obj;
-	hand->retain = 0;
-	hand->stamp = 0;
-	
-	return hand;
-}
-
-static inline void cpHandleRetain(cpHandle *hand){hand->retain++;}
-
-static inline void
-cpHandleRelease(cpHandle *hand, cpArray *pooledHandles)
-{
-	hand->retain--;
-	if(hand->retain == 0) cpArrayPush(pooledHandles, hand);
-}
-
 static int handleSetEql(void *obj, cpHandle *hand){return (obj == hand->obj);}
 
 static void *
@@ -79,75 +75,78 @@ handleSetTrans(void *obj, cpSpaceHash *hash)
 		int count = CP_BUFFER_BYTES/sizeof(cpHandle);
 		cpAssertHard(count, "Internal Error: Buffer size is too small.");
 		
-		cpHandle *buffer = (cpHandle *)cpcalloc(1, CP_BUFFER_BYTES);
+		cpHandle *buffer = (cpHandle *)cpAllocatorCalloc(hash->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
 		cpArrayPush(hash->allocatedBuffers, buffer);
 		
 		for(int i=0; i<count; i++) cpArrayPush(hash->pooledHandles, buffer + i);
 	}
 	
-	cpHandle *hand = cpHandleInit((cpHandle *)cpArrayPop(hash->pooledHandles), obj);
-	cpHandleRetain(hand);
+	cpHandle *hand = (cpHandle *)cpArrayPop(hash->pooledHandles);
+	hand->obj = obj;
+	hand->slot = -1;
 	
 	return hand;
 }
 
-//MARK: Bin Functions
+//MARK: Entry Functions
 
-struct cpSpaceHashBin {
-	cpHandle *handle;
-	cpSpaceHashBin *next;
+// A copy of an object's bounding box stored in the table for one of the grid cells it covers.
+// Several grid cells share each table cell, so the entry remembers which one it belongs to.
+struct cpSpaceHashEntry {
+	cpBB bb;
+	int slot;
+	int x, y;
 };
 
-static inline void
-recycleBin(cpSpaceHash *hash, cpSpaceHashBin *bin)
+// The range of grid cells covered by a bounding box, inclusive.
+typedef struct cellRange {
+	int l, b, r, t;
+} cellRange;
+
+// Much faster than (int)floor(f)
+// Profiling showed floor() to be a sizable performance hog
+static inline int
+floor_int(cpFloat f)
 {
-	bin->next = hash->pooledBins;
-	hash->pooledBins = bin;
+	int i = (int)f;
+	return (f < 0.0f && f != i ? i - 1 : i);
 }
 
-static inline void
-clearTableCell(cpSpaceHash *hash, int idx)
+static inline cellRange
+cellRangeForBB(cpSpaceHash *hash, cpBB bb)
 {
-	cpSpaceHashBin *bin = hash->table[idx];
-	while(bin){
-		cpSpaceHashBin *next = bin->next;
-		
-		cpHandleRelease(bin->handle, hash->pooledHandles);
-		recycleBin(hash, bin);
-		
-		bin = next;
-	}
+	cpFloat dim = hash->celldim;
+	cellRange range = {
+		floor_int(bb.l/dim), // Fix by ShiftZ
+		floor_int(bb.b/dim),
+		floor_int(bb.r/dim),
+		floor_int(bb.t/dim),
+	};
 	
-	hash->table[idx] = NULL;
+	return range;
 }
 
-static void
-clearTable(cpSpaceHash *hash)
+static inline cpBool
+rangeContains(cellRange range, int x, int y)
 {
-	for(int i=0; i<hash->numcells; i++) clearTableCell(hash, i);
+	return (range.l <= x && x <= range.r && range.b <= y && y <= range.t);
 }
 
-// Get a recycled or new bin.
-static inline cpSpaceHashBin *
-getEmptyBin(cpSpaceHash *hash)
+static inline int imax(int a, int b){return (a > b ? a : b);}
+
+// Two objects that cover several grid cells are found in every cell they share.
+// Only report them from the first one, the lower left cell of the overlap of their ranges.
+static inline cpBool
+firstSharedCell(cellRange a, cellRange b, int x, int y)
 {
-	cpSpaceHashBin *bin = hash->pooledBins;
-	
-	if(bin){
-		hash->pooledBins = bin->next;
-		return bin;
-	} else {
-		// Pool is exhausted, make more
-		int count = CP_BUFFER_BYTES/sizeof(cpSpaceHashBin);
-		cpAssertHard(count, "Internal Error: Buffer size is too small.");
-		
-		cpSpaceHashBin *buffer = (cpSpaceHashBin *)cpcalloc(1, CP_BUFFER_BYTES);
-		cpArrayPush(hash->allocatedBuffers, buffer);
-		
-		// push all but the first one, return the first instead
-		for(int i=1; i<count; i++) recycleBin(hash, buffer + i);
-		return buffer;
-	}
+	return (x == imax(a.l, b.l) && y == imax(a.b, b.b));
+}
+
+// The hash function itself.
+static inline cpHashValue
+hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
+{
+	return (x*1640531513ul ^ y*2654435789ul) % n;
 }
 
 //MARK: Memory Management Functions
@@ -159,13 +158,23 @@ cpSpaceHashAlloc(void)
 }
 
 // Frees the old table, and allocate a new one.
+// The table is empty until the next rehash.
 static void
 cpSpaceHashAllocTable(cpSpaceHash *hash, int numcells)
 {
-	cpfree(hash->table);
+	cpAllocatorFree(hash->spatialIndex.allocator, hash->table);
 	
 	hash->numcells = numcells;
-	hash->table = (cpSpaceHashBin **)cpcalloc(numcells, sizeof(cpSpaceHashBin *));
+	hash->table = (int *)cpAllocatorCalloc(hash->spatialIndex.allocator, numcells + 1, sizeof(int));
+	hash->hashed = 0;
+}
+
+static void
+resizeSlots(cpSpaceHash *hash, int max)
+{
+	hash->max = max;
+	hash->handles = (cpHandle **)cpAllocatorRealloc(hash->spatialIndex.allocator, hash->handles, max*sizeof(cpHandle *));
+	hash->bbs = (cpBB *)cpAllocatorRealloc(hash->spatialIndex.allocator, hash->bbs, max*sizeof(cpBB));
 }
 
 static inline cpSpatialIndexClass *Klass();
@@ -178,14 +187,19 @@ cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, int numcells, cpSpatialIndex
 	cpSpaceHashAllocTable(hash, next_prime(numcells));
 	hash->celldim = celldim;
 	
-	hash->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql);
+	hash->entries = NULL;
+	hash->entries_max = 0;
 	
-	hash->pooledHandles = cpArrayNew(0);
+	hash->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql, hash->spatialIndex.allocator);
 	
-	hash->pooledBins = NULL;
-	hash->allocatedBuffers = cpArrayNew(0);
+	resizeSlots(hash, 32);
+	hash->count = hash->hashed = 0;
 	
-	hash->stamp = 1;
+	hash->pooledHandles = cpArrayNew(0, hash->spatialIndex.allocator);
+	hash->allocatedBuffers = cpArrayNew(0, hash->spatialIndex.allocator);
+	
+	hash->autoResize = cpFalse;
+	hash->outOfRange = 0;
 	
 	return (cpSpatialIndex *)hash;
 }
@@ -193,78 +207,177 @@ cpSpaceHashInit(cpSpaceHash *hash, cpFloat celldim, int numcells, cpSpatialIndex
 cpSpatialIndex *
 cpSpaceHashNew(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
 {
-	return cpSpaceHashInit(cpSpaceHashAlloc(), celldim, cells, bbfunc, staticIndex);
+	return cpSpaceHashNewWithAllocator(celldim, cells, bbfunc, staticIndex, NULL);
+}
+
+cpSpatialIndex *
+cpSpaceHashNewWithAllocator(cpFloat celldim, int cells, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator)
+{
+	cpSpaceHash *hash = (cpSpaceHash *)cpAllocatorCalloc(allocator, 1, sizeof(cpSpaceHash));
+	hash->spatialIndex.allocator = allocator;
+	
+	return cpSpaceHashInit(hash, celldim, cells, bbfunc, staticIndex);
 }
 
 static void
 cpSpaceHashDestroy(cpSpaceHash *hash)
 {
-	if(hash->table) clearTable(hash);
-	cpfree(hash->table);
+	cpAllocatorFree(hash->spatialIndex.allocator, hash->table);
+	cpAllocatorFree(hash->spatialIndex.allocator, hash->entries);
+	cpAllocatorFree(hash->spatialIndex.allocator, hash->handles);
+	cpAllocatorFree(hash->spatialIndex.allocator, hash->bbs);
 	
 	cpHashSetFree(hash->handleSet);
 	
-	cpArrayFreeEach(hash->allocatedBuffers, cpfree);
+	cpArrayFreeElements(hash->allocatedBuffers);
 	cpArrayFree(hash->allocatedBuffers);
 	cpArrayFree(hash->pooledHandles);
 }
 
-//MARK: Helper Functions
+//MARK: Auto Resizing
 
-static inline cpBool
-containsHandle(cpSpaceHashBin *bin, cpHandle *hand)
+// Number of full rehashes in a row the statistics have to be out of range for before resizing.
+// Keeps the hash from resizing back and forth when the objects only change size briefly.
+#define AUTO_RESIZE_DELAY 16
+
+// Called before a full rehash with the bounding boxes of the objects in the first count slots.
+static void
+autoResize(cpSpaceHash *hash, int count)
 {
-	while(bin){
-		if(bin->handle == hand) return cpTrue;
-		bin = bin->next;
+	if(!hash->autoResize) return;
+	
+	// Sum up the sizes of the objects and the number of grid cells they cover, skipping infinite and NaN bounding boxes.
+	int finite = 0;
+	cpFloat size = 0.0f, bins = 0.0f, dim = hash->celldim;
+	for(int i=0; i<count; i++){
+		cpBB bb = hash->bbs[i];
+		cpFloat objSize = ((bb.r - bb.l) + (bb.t - bb.b))*0.5f;
+		
+		if(objSize < INFINITY){
+			finite++;
+			size += objSize;
+			bins += (cpffloor(bb.r/dim) - cpffloor(bb.l/dim) + 1.0f)*(cpffloor(bb.t/dim) - cpffloor(bb.b/dim) + 1.0f);
+		}
 	}
 	
-	return cpFalse;
+	if(finite == 0) return;
+	
+	// Cells about twice the size of the objects work best, smaller cells get expensive much faster than bigger ones.
+	// The table should have ~10 cells per object. Anything in a wide range around that works well enough to leave alone.
+	size /= finite;
+	cpFloat ratio = size/hash->celldim;
+	cpFloat load = (cpFloat)hash->numcells/(cpFloat)finite;
+	cpBool resizeCells = (size > 0.0f && (ratio < 0.2f || 1.25f < ratio));
+	cpBool resizeTable = (load < 2.5f || 40.0f < load || bins > 2.0f*hash->numcells);
+	
+	if(!resizeCells && !resizeTable){
+		hash->outOfRange = 0;
+		return;
+	}
+	
+	// Cells that are way off or long chains of bins make the hash so slow that it's not worth waiting.
+	cpBool urgent = ((resizeCells && (ratio < 0.0625f || 2.0f < ratio)) || bins > 2.0f*hash->numcells);
+	if(++hash->outOfRange < AUTO_RESIZE_DELAY && !urgent) return;
+	
+	if(resizeCells) hash->celldim = 2.0f*size;
+	if(resizeTable){
+		// Objects cover fewer than 4 cells each with the resized cells.
+		// Otherwise make sure there are enough cells for the bins they cover now so the table doesn't keep resizing.
+		cpFloat numcells = 10.0f*finite;
+		if(!resizeCells) numcells = cpfmax(numcells, cpfmin(bins, 1e8f));
+		cpSpaceHashAllocTable(hash, next_prime((int)numcells));
+	}
+	hash->outOfRange = 0;
 }
 
-// The hash function itself.
-static inline cpHashValue
-hash_func(cpHashValue x, cpHashValue y, cpHashValue n)
+void
+cpSpaceHashSetAutoResize(cpSpaceHash *hash, cpBool enabled)
 {
-	return (x*1640531513ul ^ y*2654435789ul) % n;
+	if(hash->spatialIndex.klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpSpaceHashSetAutoResize() call to non-cpSpaceHash spatial index.");
+		return;
+	}
+	
+	hash->autoResize = enabled;
+	hash->outOfRange = 0;
 }
 
-// Much faster than (int)floor(f)
-// Profiling showed floor() to be a sizable performance hog
-static inline int
-floor_int(cpFloat f)
-{
-	int i = (int)f;
-	return (f < 0.0f && f != i ? i - 1 : i);
-}
+//MARK: Rehashing Functions
 
-static inline void
-hashHandle(cpSpaceHash *hash, cpHandle *hand, cpBB bb)
+// Compacts the slots, updates the bounding boxes and counting sorts the objects into the table.
+static void
+rehash(cpSpaceHash *hash)
 {
-	// Find the dimensions in cell coordinates.
-	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim); // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
+	cpSpatialIndexBBFunc bbfunc = hash->spatialIndex.bbfunc;
+	cpHandle **handles = hash->handles;
+	cpBB *bbs = hash->bbs;
+	
+	int count = 0;
+	for(int i=0; i<hash->count; i++){
+		cpHandle *hand = handles[i];
+		if(!hand) continue;
+		
+		hand->slot = count;
+		handles[count] = hand;
+		bbs[count] = bbfunc(hand->obj);
+		count++;
+	}
+	
+	autoResize(hash, count);
+	hash->count = hash->hashed = count;
 	
 	int n = hash->numcells;
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			cpHashValue idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = hash->table[idx];
-			
-			// Don't add an object twice to the same cell.
-			if(containsHandle(bin, hand)) continue;
-
-			cpHandleRetain(hand);
-			// Insert a new bin for the handle in this cell.
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			hash->table[idx] = newBin;
+	int *table = hash->table;
+	memset(table, 0, (n + 1)*sizeof(int));
+	
+	// Count the entries in each table cell, offset by one so that the prefix sum leaves the start of each cell in place.
+	for(int slot=0; slot<count; slot++){
+		cellRange range = cellRangeForBB(hash, bbs[slot]);
+		for(int i=range.l; i<=range.r; i++){
+			for(int j=range.b; j<=range.t; j++) table[hash_func(i,j,n) + 1]++;
+		}
+	}
+	
+	for(int idx=0; idx<n; idx++) table[idx + 1] += table[idx];
+	
+	int total = table[n];
+	if(total > hash->entries_max){
+		hash->entries_max = (total > 2*hash->entries_max ? total : 2*hash->entries_max);
+		cpAllocatorFree(hash->spatialIndex.allocator, hash->entries);
+		hash->entries = (cpSpaceHashEntry *)cpAllocatorCalloc(hash->spatialIndex.allocator, hash->entries_max, sizeof(cpSpaceHashEntry));
+	}
+	
+	// Fill in the entries using the cell starts as cursors, which leaves each cell's start at the start of the next.
+	cpSpaceHashEntry *entries = hash->entries;
+	for(int slot=0; slot<count; slot++){
+		cpBB bb = bbs[slot];
+		cellRange range = cellRangeForBB(hash, bb);
+		for(int i=range.l; i<=range.r; i++){
+			for(int j=range.b; j<=range.t; j++){
+				cpSpaceHashEntry entry = {bb, slot, i, j};
+				entries[table[hash_func(i,j,n)]++] = entry;
+			}
 		}
 	}
+	
+	memmove(table + 1, table, n*sizeof(int));
+	table[0] = 0;
+}
+
+// Add an object to the end of the slots to be hashed in the next rehash.
+static void
+appendSlot(cpSpaceHash *hash, cpHandle *hand)
+{
+	if(hash->count == hash->max) resizeSlots(hash, 2*hash->max);
+	
+	int slot = hash->count++;
+	hash->handles[slot] = hand;
+	hash->bbs[slot] = hash->spatialIndex.bbfunc(hand->obj);
+	hand->slot = slot;
+	
+	// Queries check the objects that aren't in the table one by one, don't let too many of them pile up between rehashes.
+	// Static hashes are only rehashed when the space reindexes its static shapes, so this also applies to reindexed objects.
+	if(hash->count - hash->hashed > hash->hashed + 16) rehash(hash);
 }
 
 //MARK: Basic Operations
@@ -273,33 +386,25 @@ static void
 cpSpaceHashInsert(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
 	cpHandle *hand = (cpHandle *)cpHashSetInsert(hash->handleSet, hashid, obj, (cpHashSetTransFunc)handleSetTrans, hash);
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(obj));
+	appendSlot(hash, hand);
 }
 
 static void
 cpSpaceHashRehashObject(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 {
-	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
+	cpHandle *hand = (cpHandle *)cpHashSetFind(hash->handleSet, hashid, obj);
 	
 	if(hand){
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
-		
-		cpSpaceHashInsert(hash, obj, hashid);
+		// Move the object to a new slot so that it's checked with its new bounding box until the next rehash.
+		hash->handles[hand->slot] = NULL;
+		appendSlot(hash, hand);
 	}
 }
 
-static void
-rehash_helper(cpHandle *hand, cpSpaceHash *hash)
-{
-	hashHandle(hash, hand, hash->spatialIndex.bbfunc(hand->obj));
-}
-
 static void
 cpSpaceHashRehash(cpSpaceHash *hash)
 {
-	clearTable(hash);
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)rehash_helper, hash);
+	rehash(hash);
 }
 
 static void
@@ -308,226 +413,149 @@ cpSpaceHashRemove(cpSpaceHash *hash, void *obj, cpHashValue hashid)
 	cpHandle *hand = (cpHandle *)cpHashSetRemove(hash->handleSet, hashid, obj);
 	
 	if(hand){
-		hand->obj = NULL;
-		cpHandleRelease(hand, hash->pooledHandles);
+		hash->handles[hand->slot] = NULL;
+		cpArrayPush(hash->pooledHandles, hand);
 	}
 }
 
-typedef struct eachContext {
-	cpSpatialIndexIteratorFunc func;
-	void *data;
-} eachContext;
-
-static void eachHelper(cpHandle *hand, eachContext *context){context->func(hand->obj, context->data);}
-
 static void
 cpSpaceHashEach(cpSpaceHash *hash, cpSpatialIndexIteratorFunc func, void *data)
 {
-	eachContext context = {func, data};
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)eachHelper, &context);
-}
-
-static void
-remove_orphaned_handles(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr)
-{
-	cpSpaceHashBin *bin = *bin_ptr;
-	while(bin){
-		cpHandle *hand = bin->handle;
-		cpSpaceHashBin *next = bin->next;
-		
-		if(!hand->obj){
-			// orphaned handle, unlink and recycle the bin
-			(*bin_ptr) = bin->next;
-			recycleBin(hash, bin);
-			
-			cpHandleRelease(hand, hash->pooledHandles);
-		} else {
-			bin_ptr = &bin->next;
-		}
-		
-		bin = next;
+	for(int i=0; i<hash->count; i++){
+		cpHandle *hand = hash->handles[i];
+		if(hand) func(hand->obj, data);
 	}
 }
 
 //MARK: Query Functions
 
-static inline void
-query_helper(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpatialIndexQueryFunc func, void *data)
-{
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
-		
-		if(hand->stamp == hash->stamp || obj == other){
-			continue;
-		} else if(other){
-			func(obj, other, 0, data);
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
-		}
-	}
-}
-
 static void
 cpSpaceHashQuery(cpSpaceHash *hash, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	// Get the dimensions in cell coordinates.
-	cpFloat dim = hash->celldim;
-	int l = floor_int(bb.l/dim);  // Fix by ShiftZ
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
+	cellRange range = cellRangeForBB(hash, bb);
 	
 	int n = hash->numcells;
-	cpSpaceHashBin **table = hash->table;
+	int *table = hash->table;
+	cpSpaceHashEntry *entries = hash->entries;
+	cpHandle **handles = hash->handles;
 	
 	// Iterate over the cells and query them.
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
-			query_helper(hash, &table[hash_func(i,j,n)], obj, func, data);
-		}
-	}
-	
-	hash->stamp++;
-}
-
-// Similar to struct eachPair above.
-typedef struct queryRehashContext {
-	cpSpaceHash *hash;
-	cpSpatialIndexQueryFunc func;
-	void *data;
-} queryRehashContext;
-
-// Hashset iterator func used with cpSpaceHashQueryRehash().
-static void
-queryRehash_helper(cpHandle *hand, queryRehashContext *context)
-{
-	cpSpaceHash *hash = context->hash;
-	cpSpatialIndexQueryFunc func = context->func;
-	void *data = context->data;
-
-	cpFloat dim = hash->celldim;
-	int n = hash->numcells;
-
-	void *obj = hand->obj;
-	cpBB bb = hash->spatialIndex.bbfunc(obj);
-
-	int l = floor_int(bb.l/dim);
-	int r = floor_int(bb.r/dim);
-	int b = floor_int(bb.b/dim);
-	int t = floor_int(bb.t/dim);
-	
-	cpSpaceHashBin **table = hash->table;
-
-	for(int i=l; i<=r; i++){
-		for(int j=b; j<=t; j++){
+	for(int i=range.l; i<=range.r; i++){
+		for(int j=range.b; j<=range.t; j++){
 			cpHashValue idx = hash_func(i,j,n);
-			cpSpaceHashBin *bin = table[idx];
-			
-			if(containsHandle(bin, hand)) continue;
 			
-			cpHandleRetain(hand); // this MUST be done first in case the object is removed in func()
-			query_helper(hash, &bin, obj, func, data);
-			
-			cpSpaceHashBin *newBin = getEmptyBin(hash);
-			newBin->handle = hand;
-			newBin->next = bin;
-			table[idx] = newBin;
+			for(int k=table[idx], end=table[idx + 1]; k<end; k++){
+				cpSpaceHashEntry *entry = entries + k;
+				if(entry->x != i || entry->y != j || !cpBBIntersects(bb, entry->bb)) continue;
+				
+				cpHandle *hand = handles[entry->slot];
+				if(hand && hand->obj != obj && firstSharedCell(range, cellRangeForBB(hash, entry->bb), i, j)) func(obj, hand->obj, 0, data);
+			}
 		}
 	}
 	
-	// Increment the stamp for each object hashed.
-	hash->stamp++;
+	// Check the objects that aren't in the table yet.
+	for(int slot=hash->hashed; slot<hash->count; slot++){
+		cpHandle *hand = handles[slot];
+		if(hand && hand->obj != obj && cpBBIntersects(bb, hash->bbs[slot])) func(obj, hand->obj, 0, data);
+	}
 }
 
 static void
 cpSpaceHashReindexQuery(cpSpaceHash *hash, cpSpatialIndexQueryFunc func, void *data)
 {
-	clearTable(hash);
+	rehash(hash);
 	
-	queryRehashContext context = {hash, func, data};
-	cpHashSetEach(hash->handleSet, (cpHashSetIteratorFunc)queryRehash_helper, &context);
-	
-	cpSpatialIndexCollideStatic((cpSpatialIndex *)hash, hash->spatialIndex.staticIndex, func, data);
-}
-
-static inline cpFloat
-segmentQuery_helper(cpSpaceHash *hash, cpSpaceHashBin **bin_ptr, void *obj, cpSpatialIndexSegmentQueryFunc func, void *data)
-{
-	cpFloat t = 1.0f;
-	 
-	restart:
-	for(cpSpaceHashBin *bin = *bin_ptr; bin; bin = bin->next){
-		cpHandle *hand = bin->handle;
-		void *other = hand->obj;
-		
-		// Skip over certain conditions
-		if(hand->stamp == hash->stamp){
-			continue;
-		} else if(other){
-			t = cpfmin(t, func(obj, other, data));
-			hand->stamp = hash->stamp;
-		} else {
-			// The object for this handle has been removed
-			// cleanup this cell and restart the query
-			remove_orphaned_handles(hash, bin_ptr);
-			goto restart; // GCC not smart enough/able to tail call an inlined function.
+	int n = hash->numcells;
+	int *table = hash->table;
+	cpSpaceHashEntry *entries = hash->entries;
+	cpHandle **handles = hash->handles;
+	
+	// Check the pairs of entries in each table cell that belong to the same grid cell.
+	for(int idx=0; idx<n; idx++){
+		for(int k=table[idx], end=table[idx + 1]; k<end; k++){
+			cpSpaceHashEntry *a = entries + k;
+			
+			for(int m=k+1; m<end; m++){
+				cpSpaceHashEntry *b = entries + m;
+				if(a->x != b->x || a->y != b->y || !cpBBIntersects(a->bb, b->bb)) continue;
+				
+				if(firstSharedCell(cellRangeForBB(hash, a->bb), cellRangeForBB(hash, b->bb), a->x, a->y)){
+					func(handles[a->slot]->obj, handles[b->slot]->obj, 0, data);
+				}
+			}
 		}
 	}
 	
-	return t;
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)hash, hash->spatialIndex.staticIndex, func, data);
 }
 
 // modified from http://playtechs.blogspot.com/2007/03/raytracing-on-grid.html
 static void
 cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
-	a = cpvmult(a, 1.0f/hash->celldim);
-	b = cpvmult(b, 1.0f/hash->celldim);
+	cpVect ga = cpvmult(a, 1.0f/hash->celldim);
+	cpVect gb = cpvmult(b, 1.0f/hash->celldim);
 	
-	int cell_x = floor_int(a.x), cell_y = floor_int(a.y);
+	int cell_x = floor_int(ga.x), cell_y = floor_int(ga.y);
 
 	cpFloat t = 0;
 
 	int x_inc, y_inc;
 	cpFloat temp_v, temp_h;
 
-	if (b.x > a.x){
+	if (gb.x > ga.x){
 		x_inc = 1;
-		temp_h = (cpffloor(a.x + 1.0f) - a.x);
+		temp_h = (cpffloor(ga.x + 1.0f) - ga.x);
 	} else {
 		x_inc = -1;
-		temp_h = (a.x - cpffloor(a.x));
+		temp_h = (ga.x - cpffloor(ga.x));
 	}
 
-	if (b.y > a.y){
+	if (gb.y > ga.y){
 		y_inc = 1;
-		temp_v = (cpffloor(a.y + 1.0f) - a.y);
+		temp_v = (cpffloor(ga.y + 1.0f) - ga.y);
 	} else {
 		y_inc = -1;
-		temp_v = (a.y - cpffloor(a.y));
+		temp_v = (ga.y - cpffloor(ga.y));
 	}
 	
 	// Division by zero is *very* slow on ARM
-	cpFloat dx = cpfabs(b.x - a.x), dy = cpfabs(b.y - a.y);
+	cpFloat dx = cpfabs(gb.x - ga.x), dy = cpfabs(gb.y - ga.y);
 	cpFloat dt_dx = (dx ? 1.0f/dx : INFINITY), dt_dy = (dy ? 1.0f/dy : INFINITY);
 	
 	// fix NANs in horizontal directions
-	cpFloat next_h = (temp_h ? temp_h*dt_dx : dt_dx);
-	cpFloat next_v = (temp_v ? temp_v*dt_dy : dt_dy);
+	// A segment starting on a cell edge and heading in the negative direction crosses it right away.
+	cpFloat next_h = (dx ? temp_h*dt_dx : INFINITY);
+	cpFloat next_v = (dy ? temp_v*dt_dy : INFINITY);
 	
 	int n = hash->numcells;
-	cpSpaceHashBin **table = hash->table;
-
+	int *table = hash->table;
+	cpSpaceHashEntry *entries = hash->entries;
+	cpHandle **handles = hash->handles;
+	
+	// The walk only ever steps in the same directions, so it passes through the cells covered by an object one after another.
+	// An object is reported in the first of its cells the walk reaches, which is the one where it didn't cover the previous cell.
+	// There is no previous cell for the first one, so start with a cell the walk can't reach to skip the check.
+	cpBool first = cpTrue;
+	int prev_x = cell_x, prev_y = cell_y;
+	
 	while(t < t_exit){
 		cpHashValue idx = hash_func(cell_x, cell_y, n);
-		t_exit = cpfmin(t_exit, segmentQuery_helper(hash, &table[idx], obj, func, data));
-
+		
+		for(int k=table[idx], end=table[idx + 1]; k<end; k++){
+			cpSpaceHashEntry *entry = entries + k;
+			if(entry->x != cell_x || entry->y != cell_y) continue;
+			if(!first && rangeContains(cellRangeForBB(hash, entry->bb), prev_x, prev_y)) continue;
+			
+			cpHandle *hand = handles[entry->slot];
+			if(hand && cpBBSegmentQuery(entry->bb, a, b) < t_exit) t_exit = cpfmin(t_exit, func(obj, hand->obj, data));
+		}
+		
+		first = cpFalse;
+		prev_x = cell_x;
+		prev_y = cell_y;
+		
 		if (next_v < next_h){
 			cell_y += y_inc;
 			t = next_v;
@@ -539,7 +567,11 @@ cpSpaceHashSegmentQuery(cpSpaceHash *hash, void *obj, cpVect a, cpVect b, cpFloa
 		}
 	}
 	
-	hash->stamp++;
+	// Check the objects that aren't in the table yet.
+	for(int slot=hash->hashed; slot<hash->count; slot++){
+		cpHandle *hand = handles[slot];
+		if(hand && cpBBSegmentQuery(hash->bbs[slot], a, b) < t_exit) t_exit = cpfmin(t_exit, func(obj, hand->obj, data));
+	}
 }
 
 //MARK: Misc
@@ -552,10 +584,9 @@ cpSpaceHashResize(cpSpaceHash *hash, cpFloat celldim, int numcells)
 		return;
 	}
 	
-	clearTable(hash);
-	
 	hash->celldim = celldim;
 	cpSpaceHashAllocTable(hash, next_prime(numcells));
+	rehash(hash);
 }
 
 static int
@@ -622,8 +653,9 @@ cpSpaceHashRenderDebug(cpSpatialIndex *index)
 			int cell_count = 0;
 			
 			int index = hash_func(i,j,n);
-			for(cpSpaceHashBin *bin = hash->table[index]; bin; bin = bin->next)
-				cell_count++;
+			for(int k=hash->table[index]; k<hash->table[index + 1]; k++){
+				if(hash->entries[k].x == i && hash->entries[k].y == j) cell_count++;
+			}
 			
 			GLfloat v = 1.0f - (GLfloat)cell_count/10.0f;
 			glColor3f(v,v,v);
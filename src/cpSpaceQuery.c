@@ -21,6 +21,27 @@
 
 #include "chipmunk/chipmunk_private.h"
 
+// Bounding box trees can skip whole subtrees of shapes that the filter rejects.
+static inline void
+IndexQuery(cpSpatialIndex *index, void *obj, cpBB bb, cpShapeFilter filter, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(cpSpatialIndexIsBBTree(index)){
+		cpBBTreeQueryFiltered(index, obj, bb, filter, func, data);
+	} else {
+		cpSpatialIndexQuery(index, obj, bb, func, data);
+	}
+}
+
+static inline void
+IndexSegmentQuery(cpSpatialIndex *index, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpShapeFilter filter, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	if(cpSpatialIndexIsBBTree(index)){
+		cpBBTreeSegmentQueryFiltered(index, obj, a, b, t_exit, filter, func, data);
+	} else {
+		cpSpatialIndexSegmentQuery(index, obj, a, b, t_exit, func, data);
+	}
+}
+
 //MARK: Nearest Point Query Functions
 
 struct PointQueryContext {
@@ -52,8 +73,8 @@ cpSpacePointQuery(cpSpace *space, cpVect point, cpFloat maxDistance, cpShapeFilt
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
 	
 	cpSpaceLock(space); {
-		cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
-		cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		IndexQuery(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
+		IndexQuery(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -89,8 +110,8 @@ cpSpacePointQueryNearest(cpSpace *space, cpVect point, cpFloat maxDistance, cpSh
 	};
 	
 	cpBB bb = cpBBNewForCircle(point, cpfmax(maxDistance, 0.0f));
-	cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
-	cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	IndexQuery(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
+	IndexQuery(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)NearestPointQueryNearest, out);
 	
 	return (cpShape *)out->shape;
 }
@@ -131,8 +152,8 @@ cpSpaceSegmentQuery(cpSpace *space, cpVect start, cpVect end, cpFloat radius, cp
 	};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
-    cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    IndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
+    IndexSegmentQuery(space->dynamicShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -169,8 +190,8 @@ cpSpaceSegmentQueryFirst(cpSpace *space, cpVect start, cpVect end, cpFloat radiu
 		NULL
 	};
 	
-	cpSpatialIndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
-	cpSpatialIndexSegmentQuery(space->dynamicShapes, &context, start, end, out->alpha, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	IndexSegmentQuery(space->staticShapes, &context, start, end, 1.0f, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
+	IndexSegmentQuery(space->dynamicShapes, &context, start, end, out->alpha, filter, (cpSpatialIndexSegmentQueryFunc)SegmentQueryFirst, out);
 	
 	return (cpShape *)out->shape;
 }
@@ -202,8 +223,8 @@ cpSpaceBBQuery(cpSpace *space, cpBB bb, cpShapeFilter filter, cpSpaceBBQueryFunc
 	struct BBQueryContext context = {bb, filter, func};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
-    cpSpatialIndexQuery(space->staticShapes, &context, bb, (cpSpatialIndexQueryFunc)BBQuery, data);
+    IndexQuery(space->dynamicShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)BBQuery, data);
+    IndexQuery(space->staticShapes, &context, bb, filter, (cpSpatialIndexQueryFunc)BBQuery, data);
 	} cpSpaceUnlock(space, cpTrue);
 }
 
@@ -238,8 +259,8 @@ cpSpaceShapeQuery(cpSpace *space, cpShape *shape, cpSpaceShapeQueryFunc func, vo
 	struct ShapeQueryContext context = {func, data, cpFalse};
 	
 	cpSpaceLock(space); {
-    cpSpatialIndexQuery(space->dynamicShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
-    cpSpatialIndexQuery(space->staticShapes, shape, bb, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    IndexQuery(space->dynamicShapes, shape, bb, shape->filter, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
+    IndexQuery(space->staticShapes, shape, bb, shape->filter, (cpSpatialIndexQueryFunc)ShapeQuery, &context);
 	} cpSpaceUnlock(space, cpTrue);
 	
 	return context.anyCollision;
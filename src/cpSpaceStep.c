@@ -21,6 +21,16 @@
 
 #include "chipmunk/chipmunk_private.h"
 
+#if CP_STEP_STATS
+	#include <string.h>
+	
+	#ifdef _WIN32
+		#include <windows.h>
+	#else
+		#include <time.h>
+	#endif
+#endif
+
 //MARK: Post Step Callback Functions
 
 cpPostStepCallback *
@@ -45,7 +55,7 @@ cpSpaceAddPostStepCallback(cpSpace *space, cpPostStepFunc func, void *key, void
 		"Post-step callbacks will not called until the end of the next call to cpSpaceStep() or the next query.");
 	
 	if(!cpSpaceGetPostStepCallback(space, key)){
-		cpPostStepCallback *callback = (cpPostStepCallback *)cpcalloc(1, sizeof(cpPostStepCallback));
+		cpPostStepCallback *callback = (cpPostStepCallback *)cpAllocatorCalloc(space->allocator, 1, sizeof(cpPostStepCallback));
 		callback->func = (func ? func : PostStepDoNothing);
 		callback->key = key;
 		callback->data = data;
@@ -95,7 +105,7 @@ cpSpaceUnlock(cpSpace *space, cpBool runPostStep)
 				if(func) func(space, callback->key, callback->data);
 				
 				arr->arr[i] = NULL;
-				cpfree(callback);
+				cpAllocatorFree(space->allocator, callback);
 			}
 			
 			arr->num = 0;
@@ -121,7 +131,7 @@ typedef struct cpContactBuffer {
 static cpContactBufferHeader *
 cpSpaceAllocContactBuffer(cpSpace *space)
 {
-	cpContactBuffer *buffer = (cpContactBuffer *)cpcalloc(1, sizeof(cpContactBuffer));
+	cpContactBuffer *buffer = (cpContactBuffer *)cpAllocatorCalloc(space->allocator, 1, sizeof(cpContactBuffer));
 	cpArrayPush(space->allocatedBuffers, buffer);
 	return (cpContactBufferHeader *)buffer;
 }
@@ -192,28 +202,30 @@ cpSpaceArbiterSetTrans(cpShape **shapes, cpSpace *space)
 		int count = CP_BUFFER_BYTES/sizeof(cpArbiter);
 		cpAssertHard(count, "Internal Error: Buffer size too small.");
 		
-		cpArbiter *buffer = (cpArbiter *)cpcalloc(1, CP_BUFFER_BYTES);
+		cpArbiter *buffer = (cpArbiter *)cpAllocatorCalloc(space->allocator, 1, CP_BUFFER_BYTES);
 		cpArrayPush(space->allocatedBuffers, buffer);
 		
-		for(int i=0; i<count; i++) cpArrayPush(space->pooledArbiters, buffer + i);
+		for(int i=0; i<count; i++){
+			cpArbiter *arb = buffer + i;
+			arb->handle = space->arbiterHandles->num;
+			cpArrayPush(space->arbiterHandles, NULL);
+			cpArrayPush(space->pooledArbiters, arb);
+		}
 	}
 	
-	return cpArbiterInit((cpArbiter *)cpArrayPop(space->pooledArbiters), shapes[0], shapes[1]);
+	cpArbiter *arb = cpArbiterInit((cpArbiter *)cpArrayPop(space->pooledArbiters), shapes[0], shapes[1]);
+	cpSpaceSetArbiterCached(space, arb, cpTrue);
+	return arb;
 }
 
 static inline cpBool
-QueryRejectConstraint(cpBody *a, cpBody *b)
+QueryRejectConstraint(cpSpace *space, cpBody *a, cpBody *b)
 {
-	CP_BODY_FOREACH_CONSTRAINT(a, constraint){
-		if(
-			!constraint->collideBodies && (
-				(constraint->a == a && constraint->b == b) ||
-				(constraint->a == b && constraint->b == a)
-			)
-		) return cpTrue;
-	}
+	// Skip the lookup for bodies that don't have any constraints at all.
+	if(a->constraintList == NULL || b->constraintList == NULL) return cpFalse;
 	
-	return cpFalse;
+	cpBody *bodies[] = {a, b};
+	return (cpHashSetFind(space->noCollidePairs, CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b), bodies) != NULL);
 }
 
 static inline cpBool
@@ -227,29 +239,31 @@ QueryReject(cpShape *a, cpShape *b)
 		// Don't collide shapes that are filtered.
 		|| cpShapeFilterReject(a->filter, b->filter)
 		// Don't collide bodies if they have a constraint with collideBodies == cpFalse.
-		|| QueryRejectConstraint(a->body, b->body)
+		|| QueryRejectConstraint(a->space, a->body, b->body)
 	);
 }
 
-// Callback from the spatial hash.
-cpCollisionID
-cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+cpBool
+cpSpaceQueryReject(cpShape *a, cpShape *b)
 {
-	// Reject any of the simple cases
-	if(QueryReject(a,b)) return id;
-	
-	// Narrow-phase collision detection.
-	struct cpCollisionInfo info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+	return QueryReject(a, b);
+}
+
+cpArbiter *
+cpSpaceProcessCollision(cpSpace *space, struct cpCollisionInfo *info, cpArbiter *arb)
+{
+	const cpShape *a = info->a, *b = info->b;
+	cpSpacePushContacts(space, info->count);
 	
-	if(info.count == 0) return info.id; // Shapes are not colliding.
-	cpSpacePushContacts(space, info.count);
+	if(arb == NULL){
+		// Get an arbiter from space->arbiterSet for the two shapes.
+		// This is where the persistant contact magic comes from.
+		const cpShape *shape_pair[] = {a, b};
+		cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)a, (cpHashValue)b);
+		arb = (cpArbiter *)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
+	}
 	
-	// Get an arbiter from space->arbiterSet for the two shapes.
-	// This is where the persistant contact magic comes from.
-	const cpShape *shape_pair[] = {info.a, info.b};
-	cpHashValue arbHashID = CP_HASH_PAIR((cpHashValue)info.a, (cpHashValue)info.b);
-	cpArbiter *arb = (cpArbiter *)cpHashSetInsert(space->cachedArbiters, arbHashID, shape_pair, (cpHashSetTransFunc)cpSpaceArbiterSetTrans, space);
-	cpArbiterUpdate(arb, &info, space);
+	cpArbiterUpdate(arb, info, space);
 	
 	cpCollisionHandler *handler = arb->handler;
 	
@@ -273,7 +287,7 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 	){
 		cpArrayPush(space->arbiters, arb);
 	} else {
-		cpSpacePopContacts(space, info.count);
+		cpSpacePopContacts(space, info->count);
 		
 		arb->contacts = NULL;
 		arb->count = 0;
@@ -285,7 +299,43 @@ cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
 	
 	// Time stamp the arbiter so we know it was used recently.
 	arb->stamp = space->stamp;
-	return info.id;
+	
+	return arb;
+}
+
+// Callback from the spatial hash.
+cpCollisionID
+cpSpaceCollideShapes(cpShape *a, cpShape *b, cpCollisionID id, cpSpace *space)
+{
+	// Reject any of the simple cases
+	if(QueryReject(a,b)) return id;
+	
+	CP_STEP_STATS_MARK();
+	
+	// Pairs that had an arbiter last time return a handle to it in place of the collision ID.
+	// A stale handle is no use for warm starting cpCollide().
+	cpArbiter *arb = cpSpaceArbiterForHandle(space, a, b, id);
+	if(arb){
+		id = arb->id;
+	} else if(id & CP_ARBITER_HANDLE_TAG){
+		id = 0;
+	}
+	
+	// Narrow-phase collision detection.
+	struct cpCollisionInfo info = cpCollide(a, b, id, cpContactBufferGetArray(space));
+	
+	// Only process the shapes if they are colliding.
+	if(info.count > 0) arb = cpSpaceProcessCollision(space, &info, arb);
+	
+	CP_STEP_STATS_LAP(space, narrowPhase);
+	CP_STEP_STATS_COUNT(space, pairsTested, 1);
+	
+	if(arb){
+		arb->id = info.id;
+		return (CP_ARBITER_HANDLE_TAG | (cpCollisionID)arb->handle);
+	} else {
+		return info.id;
+	}
 }
 
 // Hashset filter func to throw away old arbiters.
@@ -318,12 +368,62 @@ cpSpaceArbiterSetFilter(cpArbiter *arb, cpSpace *space)
 		arb->count = 0;
 		
 		cpArrayPush(space->pooledArbiters, arb);
+		cpSpaceSetArbiterCached(space, arb, cpFalse);
 		return cpFalse;
 	}
 	
 	return cpTrue;
 }
 
+//MARK: Step Statistics
+
+#if CP_STEP_STATS
+
+uint64_t
+cpStepStatsTime(void)
+{
+#ifdef _WIN32
+	static LARGE_INTEGER frequency = {0};
+	if(frequency.QuadPart == 0) QueryPerformanceFrequency(&frequency);
+	
+	LARGE_INTEGER counter;
+	QueryPerformanceCounter(&counter);
+	
+	uint64_t ticks = counter.QuadPart, freq = frequency.QuadPart;
+	return ticks/freq*1000000000 + ticks%freq*1000000000/freq;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t)time.tv_sec*1000000000 + (uint64_t)time.tv_nsec;
+#endif
+}
+
+uint64_t
+cpStepStatsReset(cpSpace *space)
+{
+	memset(&space->stepStats, 0, sizeof(cpSpaceStepStats));
+	return cpStepStatsTime();
+}
+
+void
+cpStepStatsFinish(cpSpace *space, uint64_t start)
+{
+	cpSpaceStepStats *stats = &space->stepStats;
+	stats->total = cpStepStatsTime() - start;
+	
+	cpArray *arbiters = space->arbiters;
+	stats->arbiters = arbiters->num;
+	for(int i=0; i<arbiters->num; i++) stats->contacts += ((cpArbiter *)arbiters->arr[i])->count;
+	
+	cpArray *components = space->sleepingComponents;
+	for(int i=0; i<components->num; i++){
+		cpBody *root = (cpBody *)components->arr[i];
+		CP_BODY_FOREACH_COMPONENT(root, body) stats->sleepingBodies++;
+	}
+}
+
+#endif
+
 //MARK: All Important cpSpaceStep() Function
 
  void
@@ -338,6 +438,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 	// don't step if the timestep is 0!
 	if(dt == 0.0f) return;
 	
+	CP_STEP_STATS_START(space);
 	space->stamp++;
 	
 	cpFloat prev_dt = space->curr_dt;
@@ -358,26 +459,35 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 		}
 	}
 	arbiters->num = 0;
-
+	CP_STEP_STATS_LAP(space, arbiterFilter);
+	
 	cpSpaceLock(space); {
 		// Integrate positions
 		for(int i=0; i<bodies->num; i++){
 			cpBody *body = (cpBody *)bodies->arr[i];
 			body->position_func(body, dt);
 		}
+		CP_STEP_STATS_LAP(space, integratePositions);
 		
 		// Find colliding pairs.
 		cpSpacePushFreshContactBuffer(space);
 		cpSpatialIndexEach(space->dynamicShapes, (cpSpatialIndexIteratorFunc)cpShapeUpdateFunc, NULL);
+		CP_STEP_STATS_LAP(space, updateBBs);
+		
 		cpSpatialIndexReindexQuery(space->dynamicShapes, (cpSpatialIndexQueryFunc)cpSpaceCollideShapes, space);
+		CP_STEP_STATS_LAP(space, reindexQuery);
+		// The narrow phase runs inside of the query and was timed separately.
+		CP_STEP_STATS_EXCLUDE(space, reindexQuery, narrowPhase);
 	} cpSpaceUnlock(space, cpFalse);
 	
 	// Rebuild the contact graph (and detect sleeping components if sleeping is enabled)
 	cpSpaceProcessComponents(space, dt);
+	CP_STEP_STATS_LAP(space, processComponents);
 	
 	cpSpaceLock(space); {
 		// Clear out old cached arbiters and call separate callbacks
 		cpHashSetFilter(space->cachedArbiters, (cpHashSetFilterFunc)cpSpaceArbiterSetFilter, space);
+		CP_STEP_STATS_LAP(space, arbiterFilter);
 
 		// Prestep the arbiters and constraints.
 		cpFloat slop = space->collisionSlop;
@@ -394,6 +504,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			
 			constraint->klass->preStep(constraint, dt);
 		}
+		CP_STEP_STATS_LAP(space, preStep);
 	
 		// Integrate velocities.
 		cpFloat damping = cpfpow(space->damping, dt);
@@ -402,6 +513,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			cpBody *body = (cpBody *)bodies->arr[i];
 			body->velocity_func(body, gravity, damping, dt);
 		}
+		CP_STEP_STATS_LAP(space, integrateVelocities);
 		
 		// Apply cached impulses
 		cpFloat dt_coef = (prev_dt == 0.0f ? 0.0f : dt/prev_dt);
@@ -413,6 +525,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			cpConstraint *constraint = (cpConstraint *)constraints->arr[i];
 			constraint->klass->applyCachedImpulse(constraint, dt_coef);
 		}
+		CP_STEP_STATS_LAP(space, warmStart);
 		
 		// Run the impulse solver.
 		for(int i=0; i<space->iterations; i++){
@@ -425,6 +538,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 				constraint->klass->applyImpulse(constraint, dt);
 			}
 		}
+		CP_STEP_STATS_LAP(space, solve);
 		
 		// Run the constraint post-solve callbacks
 		for(int i=0; i<constraints->num; i++){
@@ -442,4 +556,7 @@ cpSpaceStep(cpSpace *space, cpFloat dt)
 			handler->postSolveFunc(arb, space, handler->userData);
 		}
 	} cpSpaceUnlock(space, cpTrue);
+	CP_STEP_STATS_LAP(space, callbacks);
+	
+	CP_STEP_STATS_FINISH(space);
 }
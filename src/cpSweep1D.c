@@ -19,19 +19,21 @@
  * SOFTWARE.
  */
 
+
+#include <string.h>
+
 #include "chipmunk/chipmunk_private.h"
 
 static inline cpSpatialIndexClass *Klass();
 
 //MARK: Basic Structures
 
-typedef struct Bounds {
-	cpFloat min, max;
-} Bounds;
+// Number of cells tested at once by CellsIntersect().
+#define SWEEP_WIDTH 4
 
 typedef struct TableCell {
 	void *obj;
-	Bounds bounds;
+	cpBB bb;
 } TableCell;
 
 struct cpSweep1D
@@ -40,28 +42,73 @@ struct cpSweep1D
 	
 	int num;
 	int max;
-	TableCell *table;
+	
+	// The objects and their bounding boxes, stored by component so several cells can be tested at once.
+	// Each array has SWEEP_WIDTH - 1 cells of padding at the end so the tests can read past the last cell.
+	void **objs;
+	cpFloat *l, *b, *r, *t;
+	
+	// The cells before this index are sorted by their left edge.
+	// Inserted cells are added after them and sorted during the next reindex.
+	int sorted;
 };
 
-static inline cpBool
-BoundsOverlap(Bounds a, Bounds b)
+static inline void
+SetCell(cpSweep1D *sweep, int i, void *obj, cpBB bb)
 {
-	return (a.min <= b.max && b.min <= a.max);
+	sweep->objs[i] = obj;
+	sweep->l[i] = bb.l;
+	sweep->b[i] = bb.b;
+	sweep->r[i] = bb.r;
+	sweep->t[i] = bb.t;
 }
 
-static inline Bounds
-BBToBounds(cpSweep1D *sweep, cpBB bb)
+static inline TableCell
+GetCell(cpSweep1D *sweep, int i)
 {
-	Bounds bounds = {bb.l, bb.r};
-	return bounds;
+	TableCell cell = {sweep->objs[i], cpBBNew(sweep->l[i], sweep->b[i], sweep->r[i], sweep->t[i])};
+	return cell;
 }
 
-static inline TableCell
-MakeTableCell(cpSweep1D *sweep, void *obj)
+#if defined(__GNUC__) && !defined(CP_SWEEP1D_NO_SIMD)
+typedef cpFloat SweepVec __attribute__((vector_size(SWEEP_WIDTH*sizeof(cpFloat))));
+#if CP_USE_DOUBLES
+	typedef int64_t SweepVecMask __attribute__((vector_size(SWEEP_WIDTH*sizeof(cpFloat))));
+#else
+	typedef int32_t SweepVecMask __attribute__((vector_size(SWEEP_WIDTH*sizeof(cpFloat))));
+#endif
+
+// Returns a bit mask of the SWEEP_WIDTH cells starting at i with bounding boxes that intersect bb.
+static inline unsigned int
+CellsIntersect(cpSweep1D *sweep, int i, cpBB bb)
 {
-	TableCell cell = {obj, BBToBounds(sweep, sweep->spatialIndex.bbfunc(obj))};
-	return cell;
+	// The arrays are only aligned to the allocator's alignment, memcpy() lets the compiler use unaligned loads.
+	SweepVec l, b, r, t;
+	memcpy(&l, sweep->l + i, sizeof(l));
+	memcpy(&b, sweep->b + i, sizeof(b));
+	memcpy(&r, sweep->r + i, sizeof(r));
+	memcpy(&t, sweep->t + i, sizeof(t));
+	
+	SweepVec ql = {bb.l, bb.l, bb.l, bb.l};
+	SweepVec qb = {bb.b, bb.b, bb.b, bb.b};
+	SweepVec qr = {bb.r, bb.r, bb.r, bb.r};
+	SweepVec qt = {bb.t, bb.t, bb.t, bb.t};
+	
+	SweepVecMask hit = (l <= qr) & (ql <= r) & (b <= qt) & (qb <= t);
+	return (unsigned int)((hit[0] & 1) | (hit[1] & 2) | (hit[2] & 4) | (hit[3] & 8));
+}
+#else
+static inline unsigned int
+CellsIntersect(cpSweep1D *sweep, int i, cpBB bb)
+{
+	unsigned int mask = 0;
+	for(int j=0; j<SWEEP_WIDTH; j++){
+		mask |= (unsigned int)cpBBIntersects(bb, cpBBNew(sweep->l[i + j], sweep->b[i + j], sweep->r[i + j], sweep->t[i + j])) << j;
+	}
+	
+	return mask;
 }
+#endif
 
 //MARK: Memory Management Functions
 
@@ -74,8 +121,16 @@ cpSweep1DAlloc(void)
 static void
 ResizeTable(cpSweep1D *sweep, int size)
 {
+	int capacity = size + SWEEP_WIDTH - 1;
 	sweep->max = size;
-	sweep->table = (TableCell *)cprealloc(sweep->table, size*sizeof(TableCell));
+	sweep->objs = (void **)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->objs, capacity*sizeof(void *));
+	sweep->l = (cpFloat *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->l, capacity*sizeof(cpFloat));
+	sweep->b = (cpFloat *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->b, capacity*sizeof(cpFloat));
+	sweep->r = (cpFloat *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->r, capacity*sizeof(cpFloat));
+	sweep->t = (cpFloat *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->t, capacity*sizeof(cpFloat));
+	
+	// Give the unused cells empty bounds so they never intersect anything.
+	for(int i=sweep->num; i<capacity; i++) SetCell(sweep, i, NULL, cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY));
 }
 
 cpSpatialIndex *
@@ -84,6 +139,7 @@ cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *sta
 	cpSpatialIndexInit((cpSpatialIndex *)sweep, Klass(), bbfunc, staticIndex);
 	
 	sweep->num = 0;
+	sweep->sorted = 0;
 	ResizeTable(sweep, 32);
 	
 	return (cpSpatialIndex *)sweep;
@@ -92,14 +148,28 @@ cpSweep1DInit(cpSweep1D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *sta
 cpSpatialIndex *
 cpSweep1DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
 {
-	return cpSweep1DInit(cpSweep1DAlloc(), bbfunc, staticIndex);
+	return cpSweep1DNewWithAllocator(bbfunc, staticIndex, NULL);
+}
+
+cpSpatialIndex *
+cpSweep1DNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator)
+{
+	cpSweep1D *sweep = (cpSweep1D *)cpAllocatorCalloc(allocator, 1, sizeof(cpSweep1D));
+	sweep->spatialIndex.allocator = allocator;
+	
+	return cpSweep1DInit(sweep, bbfunc, staticIndex);
 }
 
 static void
 cpSweep1DDestroy(cpSweep1D *sweep)
 {
-	cpfree(sweep->table);
-	sweep->table = NULL;
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->objs);
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->l);
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->b);
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->r);
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->t);
+	sweep->objs = NULL;
+	sweep->l = sweep->b = sweep->r = sweep->t = NULL;
 }
 
 //MARK: Misc
@@ -113,19 +183,25 @@ cpSweep1DCount(cpSweep1D *sweep)
 static void
 cpSweep1DEach(cpSweep1D *sweep, cpSpatialIndexIteratorFunc func, void *data)
 {
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++) func(table[i].obj, data);
+	void **objs = sweep->objs;
+	for(int i=0, count=sweep->num; i<count; i++) func(objs[i], data);
 }
 
 static int
-cpSweep1DContains(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+FindCell(cpSweep1D *sweep, void *obj)
 {
-	TableCell *table = sweep->table;
+	void **objs = sweep->objs;
 	for(int i=0, count=sweep->num; i<count; i++){
-		if(table[i].obj == obj) return cpTrue;
+		if(objs[i] == obj) return i;
 	}
 	
-	return cpFalse;
+	return -1;
+}
+
+static int
+cpSweep1DContains(cpSweep1D *sweep, void *obj, cpHashValue hashid)
+{
+	return (FindCell(sweep, obj) >= 0);
 }
 
 //MARK: Basic Operations
@@ -135,24 +211,26 @@ cpSweep1DInsert(cpSweep1D *sweep, void *obj, cpHashValue hashid)
 {
 	if(sweep->num == sweep->max) ResizeTable(sweep, sweep->max*2);
 	
-	sweep->table[sweep->num] = MakeTableCell(sweep, obj);
+	SetCell(sweep, sweep->num, obj, sweep->spatialIndex.bbfunc(obj));
 	sweep->num++;
 }
 
 static void
 cpSweep1DRemove(cpSweep1D *sweep, void *obj, cpHashValue hashid)
 {
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++){
-		if(table[i].obj == obj){
-			int num = --sweep->num;
-			
-			table[i] = table[num];
-			table[num].obj = NULL;
-			
-			return;
-		}
-	}
+	int i = FindCell(sweep, obj);
+	if(i < 0) return;
+	
+	// Shift the following cells down to keep them in order.
+	int num = --sweep->num, after = num - i;
+	memmove(sweep->objs + i, sweep->objs + i + 1, after*sizeof(void *));
+	memmove(sweep->l + i, sweep->l + i + 1, after*sizeof(cpFloat));
+	memmove(sweep->b + i, sweep->b + i + 1, after*sizeof(cpFloat));
+	memmove(sweep->r + i, sweep->r + i + 1, after*sizeof(cpFloat));
+	memmove(sweep->t + i, sweep->t + i + 1, after*sizeof(cpFloat));
+	SetCell(sweep, num, NULL, cpBBNew(INFINITY, INFINITY, -INFINITY, -INFINITY));
+	
+	if(i < sweep->sorted) sweep->sorted--;
 }
 
 //MARK: Reindexing Functions
@@ -167,37 +245,74 @@ static void
 cpSweep1DReindex(cpSweep1D *sweep)
 {
 	// Nothing to do here
-	// Could perform a sort, but queries are not accelerated anyway.
+	// The table is sorted by the next reindex query, until then queries check the unsorted cells one by one.
 }
 
 //MARK: Query Functions
 
+// Call func for the cells from start to end with bounding boxes that intersect bb.
 static void
-cpSweep1DQuery(cpSweep1D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+QueryRange(cpSweep1D *sweep, int start, int end, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
 {
-	// Implementing binary search here would allow you to find an upper limit
-	// but not a lower limit. Probably not worth the hassle.
-	
-	Bounds bounds = BBToBounds(sweep, bb);
+	void **objs = sweep->objs;
 	
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++){
-		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds) && obj != cell.obj) func(obj, cell.obj, 0, data);
+	for(int i=start; i<end; i+=SWEEP_WIDTH){
+		unsigned int mask = CellsIntersect(sweep, i, bb);
+		if(end - i < SWEEP_WIDTH) mask &= (1u << (end - i)) - 1;
+		
+		for(int j=i; mask; j++, mask >>= 1){
+			if((mask & 1) && obj != objs[j]) func(obj, objs[j], 0, data);
+		}
+	}
+}
+
+// Returns the index of the first sorted cell with a left edge greater than x.
+static int
+SortedUpperBound(cpSweep1D *sweep, cpFloat x)
+{
+	int lo = 0, hi = sweep->sorted;
+	while(lo < hi){
+		int mid = (lo + hi)/2;
+		if(sweep->l[mid] <= x){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
 	}
+	
+	return lo;
+}
+
+static void
+cpSweep1DQuery(cpSweep1D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	// Cells sorted after the right edge of the query can't intersect it.
+	// A binary search can't find a lower limit though since a cell can extend arbitrarily far to the right.
+	QueryRange(sweep, 0, SortedUpperBound(sweep, bb.r), obj, bb, func, data);
+	QueryRange(sweep, sweep->sorted, sweep->num, obj, bb, func, data);
+}
+
+typedef struct SegmentQueryContext {
+	cpSpatialIndexSegmentQueryFunc func;
+	void *data;
+} SegmentQueryContext;
+
+static cpCollisionID
+SegmentQueryHelper(void *obj1, void *obj2, cpCollisionID id, SegmentQueryContext *context)
+{
+	context->func(obj1, obj2, context->data);
+	return id;
 }
 
 static void
 cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
 {
 	cpBB bb = cpBBExpand(cpBBNew(a.x, a.y, a.x, a.y), b);
-	Bounds bounds = BBToBounds(sweep, bb);
+	SegmentQueryContext context = {func, data};
 	
-	TableCell *table = sweep->table;
-	for(int i=0, count=sweep->num; i<count; i++){
-		TableCell cell = table[i];
-		if(BoundsOverlap(bounds, cell.bounds)) func(obj, cell.obj, data);
-	}
+	// Unlike the BB query, segment queries don't skip obj.
+	QueryRange(sweep, 0, SortedUpperBound(sweep, bb.r), NULL, bb, (cpSpatialIndexQueryFunc)SegmentQueryHelper, &context);
+	QueryRange(sweep, sweep->sorted, sweep->num, NULL, bb, (cpSpatialIndexQueryFunc)SegmentQueryHelper, &context);
 }
 
 //MARK: Reindex/Query
@@ -205,25 +320,68 @@ cpSweep1DSegmentQuery(cpSweep1D *sweep, void *obj, cpVect a, cpVect b, cpFloat t
 static int
 TableSort(TableCell *a, TableCell *b)
 {
-	return (a->bounds.min < b->bounds.min ? -1 : (a->bounds.min > b->bounds.min ? 1 : 0));
+	return (a->bb.l < b->bb.l ? -1 : (a->bb.l > b->bb.l ? 1 : 0));
+}
+
+// Sort the table by the left edges of the cells.
+static void
+SortTable(cpSweep1D *sweep)
+{
+	int count = sweep->num;
+	
+	if(count - sweep->sorted > count/4 + SWEEP_WIDTH){
+		// Lots of new cells were inserted since the last sort, fall back to qsort().
+		TableCell *table = (TableCell *)cpAllocatorCalloc(sweep->spatialIndex.allocator, (unsigned int)count, sizeof(TableCell));
+		for(int i=0; i<count; i++) table[i] = GetCell(sweep, i);
+		qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort);
+		for(int i=0; i<count; i++) SetCell(sweep, i, table[i].obj, table[i].bb);
+		cpAllocatorFree(sweep->spatialIndex.allocator, table);
+	} else {
+		// Objects only move a little each step so the table is nearly sorted already and insertion sort is close to linear.
+		cpFloat *l = sweep->l;
+		for(int i=1; i<count; i++){
+			if(l[i - 1] <= l[i]) continue;
+			
+			TableCell cell = GetCell(sweep, i);
+			int j = i;
+			for(; j > 0 && l[j - 1] > cell.bb.l; j--){
+				SetCell(sweep, j, sweep->objs[j - 1], cpBBNew(l[j - 1], sweep->b[j - 1], sweep->r[j - 1], sweep->t[j - 1]));
+			}
+			
+			SetCell(sweep, j, cell.obj, cell.bb);
+		}
+	}
+	
+	sweep->sorted = count;
 }
 
 static void
 cpSweep1DReindexQuery(cpSweep1D *sweep, cpSpatialIndexQueryFunc func, void *data)
 {
-	TableCell *table = sweep->table;
+	void **objs = sweep->objs;
 	int count = sweep->num;
 	
 	// Update bounds and sort
-	for(int i=0; i<count; i++) table[i] = MakeTableCell(sweep, table[i].obj);
-	qsort(table, count, sizeof(TableCell), (int (*)(const void *, const void *))TableSort); // TODO: use insertion sort instead
+	cpSpatialIndexBBFunc bbfunc = sweep->spatialIndex.bbfunc;
+	for(int i=0; i<count; i++) SetCell(sweep, i, objs[i], bbfunc(objs[i]));
+	SortTable(sweep);
 	
+	cpFloat *l = sweep->l;
 	for(int i=0; i<count; i++){
-		TableCell cell = table[i];
-		cpFloat max = cell.bounds.max;
+		TableCell cell = GetCell(sweep, i);
 		
-		for(int j=i+1; table[j].bounds.min < max && j<count; j++){
-			func(cell.obj, table[j].obj, 0, data);
+		// Test the following cells several at a time until reaching one that starts past the right edge of this one.
+		// The padding at the end of the table has an infinite left edge, so the loop stops there too.
+		for(int j=i+1; j<count; j+=SWEEP_WIDTH){
+			unsigned int mask = CellsIntersect(sweep, j, cell.bb);
+			// Padding cells still intersect infinite boxes.
+			if(count - j < SWEEP_WIDTH) mask &= (1u << (count - j)) - 1;
+			
+			for(int k=j; mask; k++, mask >>= 1){
+				if(mask & 1) func(cell.obj, objs[k], 0, data);
+			}
+			
+			if(l[j + SWEEP_WIDTH - 1] > cell.bb.r) break;
 		}
 	}
 	
@@ -251,4 +409,3 @@ static cpSpatialIndexClass klass = {
 };
 
 static inline cpSpatialIndexClass *Klass(){return &klass;}
-
@@ -0,0 +1,691 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass();
+
+typedef struct Proxy Proxy;
+typedef struct Pair Pair;
+
+//MARK: Basic Structures
+
+struct Proxy {
+	void *obj;
+	cpHashValue hashid;
+	// The current bounding box and the one from the previous update.
+	cpBB bb, prev;
+	
+	// Removed proxies stay in the endpoint arrays until the next update cleans them out.
+	cpBool removed;
+	// Reindexed on its own since the last update, so its endpoints are stale.
+	cpBool moved;
+	// Index in the active list while rebuilding the pairs.
+	int active;
+};
+
+typedef struct Endpoint {
+	cpFloat value;
+	Proxy *proxy;
+	cpBool max;
+} Endpoint;
+
+struct Pair {
+	Proxy *a, *b;
+	cpCollisionID id;
+	cpTimestamp stamp;
+};
+
+// Average number of swaps per endpoint an incremental sort may make before falling back to a rebuild.
+// Past that the objects are moving too fast relative to their spacing for frame coherence to pay off.
+#define SWEEP2D_SWAP_BUDGET 4
+
+struct cpSweep2D {
+	cpSpatialIndex spatialIndex;
+	
+	cpHashSet *proxies;
+	
+	// Pairs of proxies with overlapping bounding boxes.
+	// Only changes when endpoints swap places while sorting, so the pairs of objects that don't move don't cost anything to find.
+	cpHashSet *pairs;
+	
+	// Endpoints of the proxies sorted along the x and y axes.
+	// Endpoints of proxies inserted since the last update are appended after the first sorted endpoints.
+	Endpoint *axes[2];
+	int count, max, sorted;
+	
+	int removed;
+	cpTimestamp stamp;
+	
+	// Proxies reindexed since the last update.
+	// Queries check them separately because their endpoints aren't sorted into place yet.
+	cpArray *moved;
+	
+	Proxy *pooledProxies;
+	Pair *pooledPairs;
+	cpArray *allocatedBuffers;
+};
+
+static inline cpFloat
+EndpointValue(Proxy *proxy, int axis, cpBool max)
+{
+	cpBB bb = proxy->bb;
+	return (axis == 0 ? (max ? bb.r : bb.l) : (max ? bb.t : bb.b));
+}
+
+// Minimum endpoints come before maximum endpoints with the same value so that touching boxes overlap like with cpBBIntersects().
+static inline cpBool
+EndpointLess(Endpoint a, Endpoint b)
+{
+	return (a.value < b.value || (a.value == b.value && !a.max && b.max));
+}
+
+// Bottom up merge sort of the endpoints using a scratch buffer of the same size.
+// Faster than qsort() with a comparison callback, and runs that are already in order only cost a comparison to merge.
+static void
+EndpointSort(Endpoint *endpoints, Endpoint *scratch, int count)
+{
+	Endpoint *src = endpoints, *dst = scratch;
+	
+	for(int width=1; width<count; width*=2){
+		for(int lo=0; lo<count; lo+=2*width){
+			int mid = lo + width, hi = lo + 2*width;
+			if(mid > count) mid = count;
+			if(hi > count) hi = count;
+			
+			if(mid == hi || !EndpointLess(src[mid], src[mid - 1])){
+				memcpy(dst + lo, src + lo, (unsigned int)(hi - lo)*sizeof(Endpoint));
+			} else {
+				int i = lo, j = mid, k = lo;
+				while(i < mid && j < hi) dst[k++] = (EndpointLess(src[j], src[i]) ? src[j++] : src[i++]);
+				while(i < mid) dst[k++] = src[i++];
+				while(j < hi) dst[k++] = src[j++];
+			}
+		}
+		
+		Endpoint *tmp = src; src = dst; dst = tmp;
+	}
+	
+	if(src != endpoints) memcpy(endpoints, src, (unsigned int)count*sizeof(Endpoint));
+}
+
+//MARK: Pool Functions
+
+static Proxy *
+ProxyFromPool(cpSweep2D *sweep)
+{
+	Proxy *proxy = sweep->pooledProxies;
+	
+	if(proxy){
+		sweep->pooledProxies = (Proxy *)proxy->obj;
+		return proxy;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Proxy);
+		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		
+		Proxy *buffer = (Proxy *)cpAllocatorCalloc(sweep->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
+		cpArrayPush(sweep->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++){
+			buffer[i].obj = sweep->pooledProxies;
+			sweep->pooledProxies = buffer + i;
+		}
+		
+		return buffer;
+	}
+}
+
+static void
+ProxyRecycle(cpSweep2D *sweep, Proxy *proxy)
+{
+	proxy->obj = sweep->pooledProxies;
+	sweep->pooledProxies = proxy;
+}
+
+static Pair *
+PairFromPool(cpSweep2D *sweep)
+{
+	Pair *pair = sweep->pooledPairs;
+	
+	if(pair){
+		sweep->pooledPairs = (Pair *)pair->a;
+		return pair;
+	} else {
+		// Pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Pair);
+		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		
+		Pair *buffer = (Pair *)cpAllocatorCalloc(sweep->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
+		cpArrayPush(sweep->allocatedBuffers, buffer);
+		
+		// push all but the first one, return the first instead
+		for(int i=1; i<count; i++){
+			buffer[i].a = (Proxy *)sweep->pooledPairs;
+			sweep->pooledPairs = buffer + i;
+		}
+		
+		return buffer;
+	}
+}
+
+static void
+PairRecycle(cpSweep2D *sweep, Pair *pair)
+{
+	pair->a = (Proxy *)sweep->pooledPairs;
+	sweep->pooledPairs = pair;
+}
+
+//MARK: Pair Functions
+
+static cpBool
+PairSetEql(Proxy **proxies, Pair *pair)
+{
+	return ((proxies[0] == pair->a && proxies[1] == pair->b) || (proxies[0] == pair->b && proxies[1] == pair->a));
+}
+
+static Pair *
+PairSetTrans(Proxy **proxies, cpSweep2D *sweep)
+{
+	Pair *pair = PairFromPool(sweep);
+	pair->a = proxies[0];
+	pair->b = proxies[1];
+	pair->id = 0;
+	
+	return pair;
+}
+
+static void
+PairAdd(cpSweep2D *sweep, Proxy *a, Proxy *b)
+{
+	Proxy *proxies[] = {a, b};
+	Pair *pair = (Pair *)cpHashSetInsert(sweep->pairs, CP_HASH_PAIR(a, b), proxies, (cpHashSetTransFunc)PairSetTrans, sweep);
+	pair->stamp = sweep->stamp;
+}
+
+static void
+PairRemove(cpSweep2D *sweep, Proxy *a, Proxy *b)
+{
+	Proxy *proxies[] = {a, b};
+	Pair *pair = (Pair *)cpHashSetRemove(sweep->pairs, CP_HASH_PAIR(a, b), proxies);
+	if(pair) PairRecycle(sweep, pair);
+}
+
+//MARK: Memory Management Functions
+
+cpSweep2D *
+cpSweep2DAlloc(void)
+{
+	return (cpSweep2D *)cpcalloc(1, sizeof(cpSweep2D));
+}
+
+static cpBool
+ProxySetEql(void *obj, Proxy *proxy)
+{
+	return (obj == proxy->obj);
+}
+
+static void
+ResizeAxes(cpSweep2D *sweep, int size)
+{
+	sweep->max = size;
+	sweep->axes[0] = (Endpoint *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->axes[0], size*sizeof(Endpoint));
+	sweep->axes[1] = (Endpoint *)cpAllocatorRealloc(sweep->spatialIndex.allocator, sweep->axes[1], size*sizeof(Endpoint));
+}
+
+cpSpatialIndex *
+cpSweep2DInit(cpSweep2D *sweep, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)sweep, Klass(), bbfunc, staticIndex);
+	
+	sweep->proxies = cpHashSetNew(0, (cpHashSetEqlFunc)ProxySetEql, sweep->spatialIndex.allocator);
+	sweep->pairs = cpHashSetNew(0, (cpHashSetEqlFunc)PairSetEql, sweep->spatialIndex.allocator);
+	
+	sweep->axes[0] = sweep->axes[1] = NULL;
+	sweep->count = sweep->sorted = 0;
+	ResizeAxes(sweep, 64);
+	
+	sweep->removed = 0;
+	sweep->stamp = 0;
+	sweep->moved = cpArrayNew(0, sweep->spatialIndex.allocator);
+	
+	sweep->pooledProxies = NULL;
+	sweep->pooledPairs = NULL;
+	sweep->allocatedBuffers = cpArrayNew(0, sweep->spatialIndex.allocator);
+	
+	return (cpSpatialIndex *)sweep;
+}
+
+cpSpatialIndex *
+cpSweep2DNew(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpSweep2DNewWithAllocator(bbfunc, staticIndex, NULL);
+}
+
+cpSpatialIndex *
+cpSweep2DNewWithAllocator(cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator)
+{
+	cpSweep2D *sweep = (cpSweep2D *)cpAllocatorCalloc(allocator, 1, sizeof(cpSweep2D));
+	sweep->spatialIndex.allocator = allocator;
+	
+	return cpSweep2DInit(sweep, bbfunc, staticIndex);
+}
+
+static void
+cpSweep2DDestroy(cpSweep2D *sweep)
+{
+	cpHashSetFree(sweep->proxies);
+	cpHashSetFree(sweep->pairs);
+	
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->axes[0]);
+	cpAllocatorFree(sweep->spatialIndex.allocator, sweep->axes[1]);
+	cpArrayFree(sweep->moved);
+	
+	if(sweep->allocatedBuffers) cpArrayFreeElements(sweep->allocatedBuffers);
+	cpArrayFree(sweep->allocatedBuffers);
+}
+
+//MARK: Misc
+
+static int
+cpSweep2DCount(cpSweep2D *sweep)
+{
+	return cpHashSetCount(sweep->proxies);
+}
+
+typedef struct EachContext {
+	cpSpatialIndexIteratorFunc func;
+	void *data;
+} EachContext;
+
+static void EachHelper(Proxy *proxy, EachContext *context){context->func(proxy->obj, context->data);}
+
+static void
+cpSweep2DEach(cpSweep2D *sweep, cpSpatialIndexIteratorFunc func, void *data)
+{
+	EachContext context = {func, data};
+	cpHashSetEach(sweep->proxies, (cpHashSetIteratorFunc)EachHelper, &context);
+}
+
+static cpBool
+cpSweep2DContains(cpSweep2D *sweep, void *obj, cpHashValue hashid)
+{
+	return (cpHashSetFind(sweep->proxies, hashid, obj) != NULL);
+}
+
+//MARK: Basic Operations
+
+static Proxy *
+ProxySetTrans(void *obj, cpSweep2D *sweep)
+{
+	Proxy *proxy = ProxyFromPool(sweep);
+	proxy->obj = obj;
+	proxy->bb = proxy->prev = sweep->spatialIndex.bbfunc(obj);
+	proxy->removed = cpFalse;
+	proxy->moved = cpFalse;
+	
+	return proxy;
+}
+
+static void
+cpSweep2DInsert(cpSweep2D *sweep, void *obj, cpHashValue hashid)
+{
+	Proxy *proxy = (Proxy *)cpHashSetInsert(sweep->proxies, hashid, obj, (cpHashSetTransFunc)ProxySetTrans, sweep);
+	proxy->hashid = hashid;
+	
+	if(sweep->count + 2 > sweep->max) ResizeAxes(sweep, 2*sweep->max);
+	
+	for(int axis=0; axis<2; axis++){
+		Endpoint *endpoints = sweep->axes[axis] + sweep->count;
+		Endpoint min = {EndpointValue(proxy, axis, cpFalse), proxy, cpFalse};
+		Endpoint max = {EndpointValue(proxy, axis, cpTrue), proxy, cpTrue};
+		endpoints[0] = min;
+		endpoints[1] = max;
+	}
+	
+	sweep->count += 2;
+}
+
+static void
+cpSweep2DRemove(cpSweep2D *sweep, void *obj, cpHashValue hashid)
+{
+	Proxy *proxy = (Proxy *)cpHashSetRemove(sweep->proxies, hashid, obj);
+	if(proxy){
+		proxy->removed = cpTrue;
+		sweep->removed++;
+	}
+}
+
+//MARK: Update Functions
+
+static cpBool
+PairFilterRemoved(Pair *pair, cpSweep2D *sweep)
+{
+	if(pair->a->removed || pair->b->removed){
+		PairRecycle(sweep, pair);
+		return cpFalse;
+	} else {
+		return cpTrue;
+	}
+}
+
+// Remove the endpoints and pairs of removed proxies.
+static void
+CleanRemoved(cpSweep2D *sweep)
+{
+	cpHashSetFilter(sweep->pairs, (cpHashSetFilterFunc)PairFilterRemoved, sweep);
+	
+	int count = 0, sorted = 0;
+	for(int axis=1; axis>=0; axis--){
+		Endpoint *endpoints = sweep->axes[axis];
+		count = sorted = 0;
+		
+		for(int i=0; i<sweep->count; i++){
+			Endpoint e = endpoints[i];
+			
+			if(!e.proxy->removed){
+				endpoints[count++] = e;
+				if(i < sweep->sorted) sorted++;
+			} else if(axis == 0 && e.max){
+				// Each proxy has one max endpoint per axis, recycle it after the last time it's seen.
+				ProxyRecycle(sweep, e.proxy);
+			}
+		}
+	}
+	
+	sweep->count = count;
+	sweep->sorted = sorted;
+	sweep->removed = 0;
+}
+
+static void
+UpdateBB(Proxy *proxy, cpSweep2D *sweep)
+{
+	// A moved proxy already saved the box its endpoints were sorted with.
+	if(!proxy->moved) proxy->prev = proxy->bb;
+	proxy->moved = cpFalse;
+	
+	proxy->bb = sweep->spatialIndex.bbfunc(proxy->obj);
+}
+
+// Insertion sort the endpoints along an axis.
+// Swapping a minimum and maximum endpoint from different proxies means their boxes started or stopped overlapping on this axis.
+// Insertion sort the endpoints along an axis, adding and removing pairs as endpoints swap places.
+// Gives up and returns false after too many swaps, the endpoints are still a valid permutation then.
+static cpBool
+SortAxis(cpSweep2D *sweep, int axis)
+{
+	Endpoint *endpoints = sweep->axes[axis];
+	int budget = sweep->count*SWEEP2D_SWAP_BUDGET;
+	
+	for(int i=0; i<sweep->count; i++){
+		Endpoint *e = endpoints + i;
+		e->value = EndpointValue(e->proxy, axis, e->max);
+	}
+	
+	for(int i=1; i<sweep->count; i++){
+		Endpoint e = endpoints[i];
+		if(!EndpointLess(e, endpoints[i - 1])) continue;
+		
+		int j = i;
+		for(; j > 0 && EndpointLess(e, endpoints[j - 1]); j--, budget--){
+			Endpoint f = endpoints[j - 1];
+			
+			if(e.proxy != f.proxy){
+				if(!e.max && f.max){
+					// Moved a minimum before a maximum, the boxes might overlap now.
+					if(cpBBIntersects(e.proxy->bb, f.proxy->bb)) PairAdd(sweep, e.proxy, f.proxy);
+				} else if(e.max && !f.max){
+					// Moved a maximum before a minimum, the boxes don't overlap anymore.
+					// They can only have a pair if they overlapped after the last update, which is much cheaper to check than the pair set.
+					if(cpBBIntersects(e.proxy->prev, f.proxy->prev)) PairRemove(sweep, e.proxy, f.proxy);
+				}
+			}
+			
+			endpoints[j] = f;
+		}
+		
+		endpoints[j] = e;
+		if(budget < 0) return cpFalse;
+	}
+	
+	return cpTrue;
+}
+
+static cpBool
+PairFilterStale(Pair *pair, cpSweep2D *sweep)
+{
+	if(pair->stamp != sweep->stamp){
+		PairRecycle(sweep, pair);
+		return cpFalse;
+	} else {
+		return cpTrue;
+	}
+}
+
+// Sort the endpoints from scratch and find the overlapping pairs with a sweep along the x axis.
+// Pairs that still overlap keep their collision ids.
+static void
+Rebuild(cpSweep2D *sweep)
+{
+	int count = sweep->count;
+	Endpoint *scratch = (Endpoint *)cpAllocatorCalloc(sweep->spatialIndex.allocator, (unsigned int)count, sizeof(Endpoint));
+	for(int axis=0; axis<2; axis++){
+		Endpoint *endpoints = sweep->axes[axis];
+		for(int i=0; i<count; i++) endpoints[i].value = EndpointValue(endpoints[i].proxy, axis, endpoints[i].max);
+		EndpointSort(endpoints, scratch, count);
+	}
+	cpAllocatorFree(sweep->spatialIndex.allocator, scratch);
+	
+	sweep->stamp++;
+	
+	Proxy **active = (Proxy **)cpAllocatorCalloc(sweep->spatialIndex.allocator, (unsigned int)count/2 + 1, sizeof(Proxy *));
+	int activeCount = 0;
+	
+	Endpoint *endpoints = sweep->axes[0];
+	for(int i=0; i<count; i++){
+		Proxy *proxy = endpoints[i].proxy;
+		
+		if(endpoints[i].max){
+			Proxy *last = active[--activeCount];
+			active[proxy->active] = last;
+			last->active = proxy->active;
+		} else {
+			for(int j=0; j<activeCount; j++){
+				if(cpBBIntersects(proxy->bb, active[j]->bb)) PairAdd(sweep, active[j], proxy);
+			}
+			
+			proxy->active = activeCount;
+			active[activeCount++] = proxy;
+		}
+	}
+	
+	cpAllocatorFree(sweep->spatialIndex.allocator, active);
+	cpHashSetFilter(sweep->pairs, (cpHashSetFilterFunc)PairFilterStale, sweep);
+}
+
+// Bring the endpoints and pairs up to date with the current bounding boxes.
+static void
+Update(cpSweep2D *sweep)
+{
+	// Removed proxies in the list are recycled by CleanRemoved().
+	sweep->moved->num = 0;
+	
+	if(sweep->removed) CleanRemoved(sweep);
+	cpHashSetEach(sweep->proxies, (cpHashSetIteratorFunc)UpdateBB, sweep);
+	
+	// Insertion sorting a lot of new endpoints from the end of the arrays would be quadratic.
+	int unsorted = sweep->count - sweep->sorted;
+	// Pairs changed by a sort that ran out of swaps are still correct, the rebuild just finishes the job.
+	if(unsorted > sweep->sorted/4 + 8 || !SortAxis(sweep, 0) || !SortAxis(sweep, 1)){
+		Rebuild(sweep);
+	}
+	
+	sweep->sorted = sweep->count;
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpSweep2DReindexObject(cpSweep2D *sweep, void *obj, cpHashValue hashid)
+{
+	Proxy *proxy = (Proxy *)cpHashSetFind(sweep->proxies, hashid, obj);
+	if(!proxy) return;
+	
+	// Only refresh the box, sorting the endpoints and finding the pairs is left to the next update.
+	// Sorting for every object would be quadratic when reindexing all the shapes of a body.
+	if(!proxy->moved){
+		proxy->prev = proxy->bb;
+		proxy->moved = cpTrue;
+		cpArrayPush(sweep->moved, proxy);
+	}
+	
+	proxy->bb = sweep->spatialIndex.bbfunc(obj);
+}
+
+static void
+cpSweep2DReindex(cpSweep2D *sweep)
+{
+	Update(sweep);
+}
+
+//MARK: Query Functions
+
+// Returns the index of the first sorted endpoint along the x axis with a value greater than x.
+static int
+SortedUpperBound(cpSweep2D *sweep, cpFloat x)
+{
+	Endpoint *endpoints = sweep->axes[0];
+	int lo = 0, hi = sweep->sorted;
+	while(lo < hi){
+		int mid = (lo + hi)/2;
+		if(endpoints[mid].value <= x){
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	
+	return lo;
+}
+
+typedef struct QueryContext {
+	void *obj;
+	cpBB bb;
+	cpSpatialIndexQueryFunc func;
+	cpSpatialIndexSegmentQueryFunc segmentFunc;
+	void *data;
+} QueryContext;
+
+static inline void
+QueryProxy(Proxy *proxy, QueryContext *context)
+{
+	if(proxy->removed || !cpBBIntersects(context->bb, proxy->bb)) return;
+	
+	if(context->segmentFunc){
+		context->segmentFunc(context->obj, proxy->obj, context->data);
+	} else if(context->obj != proxy->obj){
+		context->func(context->obj, proxy->obj, 0, context->data);
+	}
+}
+
+static void
+QueryRange(cpSweep2D *sweep, int start, int end, QueryContext *context)
+{
+	Endpoint *endpoints = sweep->axes[0];
+	
+	for(int i=start; i<end; i++){
+		Proxy *proxy = endpoints[i].proxy;
+		if(endpoints[i].max || proxy->moved) continue;
+		QueryProxy(proxy, context);
+	}
+}
+
+static void
+Query(cpSweep2D *sweep, QueryContext *context)
+{
+	// Proxies with a minimum endpoint after the right edge of the query can't intersect it.
+	QueryRange(sweep, 0, SortedUpperBound(sweep, context->bb.r), context);
+	QueryRange(sweep, sweep->sorted, sweep->count, context);
+	
+	// Moved proxies can be anywhere in the endpoint arrays.
+	cpArray *moved = sweep->moved;
+	for(int i=0; i<moved->num; i++) QueryProxy((Proxy *)moved->arr[i], context);
+}
+
+static void
+cpSweep2DQuery(cpSweep2D *sweep, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	QueryContext context = {obj, bb, func, NULL, data};
+	Query(sweep, &context);
+}
+
+static void
+cpSweep2DSegmentQuery(cpSweep2D *sweep, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	QueryContext context = {obj, cpBBExpand(cpBBNew(a.x, a.y, a.x, a.y), b), NULL, func, data};
+	Query(sweep, &context);
+}
+
+//MARK: Reindex/Query
+
+static void
+ReportPair(Pair *pair, QueryContext *context)
+{
+	pair->id = context->func(pair->a->obj, pair->b->obj, pair->id, context->data);
+}
+
+static void
+cpSweep2DReindexQuery(cpSweep2D *sweep, cpSpatialIndexQueryFunc func, void *data)
+{
+	Update(sweep);
+	
+	QueryContext context = {NULL, cpBBNew(0.0f, 0.0f, 0.0f, 0.0f), func, NULL, data};
+	cpHashSetEach(sweep->pairs, (cpHashSetIteratorFunc)ReportPair, &context);
+	
+	// Reindex query is also responsible for colliding against the static index.
+	// Fortunately there is a helper function for that.
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)sweep, sweep->spatialIndex.staticIndex, func, data);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpSweep2DDestroy,
+	
+	(cpSpatialIndexCountImpl)cpSweep2DCount,
+	(cpSpatialIndexEachImpl)cpSweep2DEach,
+	(cpSpatialIndexContainsImpl)cpSweep2DContains,
+	
+	(cpSpatialIndexInsertImpl)cpSweep2DInsert,
+	(cpSpatialIndexRemoveImpl)cpSweep2DRemove,
+	
+	(cpSpatialIndexReindexImpl)cpSweep2DReindex,
+	(cpSpatialIndexReindexObjectImpl)cpSweep2DReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpSweep2DReindexQuery,
+	
+	(cpSpatialIndexQueryImpl)cpSweep2DQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpSweep2DSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}
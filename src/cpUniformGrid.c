@@ -0,0 +1,605 @@
+/* Copyright (c) 2013 Scott Lembcke and Howling Moon Software
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <string.h>
+
+#include "chipmunk/chipmunk_private.h"
+
+static inline cpSpatialIndexClass *Klass();
+
+//MARK: Basic Structures
+
+typedef struct Handle {
+	void *obj;
+	// Index of the slot the object is stored in.
+	int slot;
+	cpTimestamp stamp;
+} Handle;
+
+// The range of cells covered by a bounding box, inclusive.
+typedef struct CellRange {
+	int l, b, r, t;
+} CellRange;
+
+// A copy of an object's bounding box stored in one of the cells it covers.
+typedef struct GridEntry {
+	cpBB bb;
+	int slot;
+} GridEntry;
+
+struct cpUniformGrid {
+	cpSpatialIndex spatialIndex;
+	
+	cpFloat celldim;
+	cpBB bounds;
+	int width, height;
+	
+	cpHashSet *handleSet;
+	
+	// The objects are stored in slots, a removed object leaves an empty slot until the next rebuild.
+	// The slots after the first binned ones were added since the last rebuild and aren't in the grid yet.
+	Handle **handles;
+	cpBB *bbs;
+	CellRange *ranges;
+	int count, max, binned;
+	
+	// Slots of the binned objects that stick out of the bounds of the grid.
+	int *outside;
+	int outsideCount;
+	
+	// Index of the first entry of each cell followed by the total number of entries.
+	// The entries are counting sorted by cell, so each cell's entries are next to each other in the array.
+	int *cellStart;
+	GridEntry *entries;
+	int entries_max;
+	
+	cpArray *pooledHandles;
+	cpArray *allocatedBuffers;
+	
+	cpTimestamp stamp;
+};
+
+//MARK: Handle Functions
+
+static int handleSetEql(void *obj, Handle *hand){return (obj == hand->obj);}
+
+static void *
+handleSetTrans(void *obj, cpUniformGrid *grid)
+{
+	if(grid->pooledHandles->num == 0){
+		// handle pool is exhausted, make more
+		int count = CP_BUFFER_BYTES/sizeof(Handle);
+		cpAssertHard(count, "Internal Error: Buffer size is too small.");
+		
+		Handle *buffer = (Handle *)cpAllocatorCalloc(grid->spatialIndex.allocator, 1, CP_BUFFER_BYTES);
+		cpArrayPush(grid->allocatedBuffers, buffer);
+		
+		for(int i=0; i<count; i++) cpArrayPush(grid->pooledHandles, buffer + i);
+	}
+	
+	Handle *hand = (Handle *)cpArrayPop(grid->pooledHandles);
+	hand->obj = obj;
+	hand->slot = -1;
+	hand->stamp = 0;
+	
+	return hand;
+}
+
+//MARK: Cell Functions
+
+// Convert a coordinate relative to the grid into a cell index clamped to [0, n - 1].
+// Compares before converting so that huge or non-finite coordinates never overflow an int.
+static inline int
+ClampCell(cpFloat f, int n)
+{
+	if(0.0f <= f && f < n){
+		return (int)f;
+	} else {
+		return (f < 0.0f ? 0 : n - 1);
+	}
+}
+
+static inline CellRange
+CellRangeForBB(cpUniformGrid *grid, cpBB bb)
+{
+	cpFloat inv = 1.0f/grid->celldim;
+	cpBB bounds = grid->bounds;
+	
+	CellRange range = {
+		ClampCell((bb.l - bounds.l)*inv, grid->width),
+		ClampCell((bb.b - bounds.b)*inv, grid->height),
+		ClampCell((bb.r - bounds.l)*inv, grid->width),
+		ClampCell((bb.t - bounds.b)*inv, grid->height),
+	};
+	
+	return range;
+}
+
+static inline int imax(int a, int b){return (a > b ? a : b);}
+
+// Two objects that cover several cells are found in every cell they share.
+// Only report them from the first one, the lower left cell of the overlap of their ranges.
+static inline cpBool
+FirstSharedCell(CellRange a, CellRange b, int x, int y)
+{
+	return (x == imax(a.l, b.l) && y == imax(a.b, b.b));
+}
+
+//MARK: Memory Management Functions
+
+cpUniformGrid *
+cpUniformGridAlloc(void)
+{
+	return (cpUniformGrid *)cpcalloc(1, sizeof(cpUniformGrid));
+}
+
+static void
+ResizeSlots(cpUniformGrid *grid, int max)
+{
+	grid->max = max;
+	grid->handles = (Handle **)cpAllocatorRealloc(grid->spatialIndex.allocator, grid->handles, max*sizeof(Handle *));
+	grid->bbs = (cpBB *)cpAllocatorRealloc(grid->spatialIndex.allocator, grid->bbs, max*sizeof(cpBB));
+	grid->ranges = (CellRange *)cpAllocatorRealloc(grid->spatialIndex.allocator, grid->ranges, max*sizeof(CellRange));
+	grid->outside = (int *)cpAllocatorRealloc(grid->spatialIndex.allocator, grid->outside, max*sizeof(int));
+}
+
+// Frees the old cells and allocates new empty ones.
+static void
+AllocCells(cpUniformGrid *grid, cpFloat celldim, cpBB bounds)
+{
+	cpAssertHard(celldim > 0.0f, "The cell size must be positive.");
+	cpAssertHard(bounds.l <= bounds.r && bounds.b <= bounds.t, "The bounds of the grid are invalid.");
+	
+	cpFloat width = cpfmax(cpfceil((bounds.r - bounds.l)/celldim), 1.0f);
+	cpFloat height = cpfmax(cpfceil((bounds.t - bounds.b)/celldim), 1.0f);
+	cpAssertHard(width*height < 0x10000000, "The grid has too many cells, use larger cells or smaller bounds.");
+	
+	grid->celldim = celldim;
+	grid->bounds = bounds;
+	grid->width = (int)width;
+	grid->height = (int)height;
+	
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->cellStart);
+	grid->cellStart = (int *)cpAllocatorCalloc(grid->spatialIndex.allocator, (unsigned int)(grid->width*grid->height + 1), sizeof(int));
+	
+	// All the objects are waiting to be binned now.
+	grid->binned = grid->outsideCount = 0;
+}
+
+cpSpatialIndex *
+cpUniformGridInit(cpUniformGrid *grid, cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	cpSpatialIndexInit((cpSpatialIndex *)grid, Klass(), bbfunc, staticIndex);
+	
+	AllocCells(grid, celldim, bounds);
+	ResizeSlots(grid, 32);
+	grid->count = 0;
+	
+	grid->entries = NULL;
+	grid->entries_max = 0;
+	
+	grid->handleSet = cpHashSetNew(0, (cpHashSetEqlFunc)handleSetEql, grid->spatialIndex.allocator);
+	grid->pooledHandles = cpArrayNew(0, grid->spatialIndex.allocator);
+	grid->allocatedBuffers = cpArrayNew(0, grid->spatialIndex.allocator);
+	
+	grid->stamp = 1;
+	
+	return (cpSpatialIndex *)grid;
+}
+
+cpSpatialIndex *
+cpUniformGridNew(cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex)
+{
+	return cpUniformGridNewWithAllocator(celldim, bounds, bbfunc, staticIndex, NULL);
+}
+
+cpSpatialIndex *
+cpUniformGridNewWithAllocator(cpFloat celldim, cpBB bounds, cpSpatialIndexBBFunc bbfunc, cpSpatialIndex *staticIndex, cpAllocator *allocator)
+{
+	cpUniformGrid *grid = (cpUniformGrid *)cpAllocatorCalloc(allocator, 1, sizeof(cpUniformGrid));
+	grid->spatialIndex.allocator = allocator;
+	
+	return cpUniformGridInit(grid, celldim, bounds, bbfunc, staticIndex);
+}
+
+static void
+cpUniformGridDestroy(cpUniformGrid *grid)
+{
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->handles);
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->bbs);
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->ranges);
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->outside);
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->cellStart);
+	cpAllocatorFree(grid->spatialIndex.allocator, grid->entries);
+	
+	cpHashSetFree(grid->handleSet);
+	
+	cpArrayFreeElements(grid->allocatedBuffers);
+	cpArrayFree(grid->allocatedBuffers);
+	cpArrayFree(grid->pooledHandles);
+}
+
+//MARK: Binning Functions
+
+// Compacts the slots, updates the bounding boxes and counting sorts the objects into the cells.
+static void
+Rebuild(cpUniformGrid *grid)
+{
+	cpSpatialIndexBBFunc bbfunc = grid->spatialIndex.bbfunc;
+	Handle **handles = grid->handles;
+	cpBB *bbs = grid->bbs;
+	CellRange *ranges = grid->ranges;
+	
+	int count = 0;
+	for(int i=0; i<grid->count; i++){
+		Handle *hand = handles[i];
+		if(!hand) continue;
+		
+		hand->slot = count;
+		handles[count] = hand;
+		bbs[count] = bbfunc(hand->obj);
+		count++;
+	}
+	
+	grid->count = grid->binned = count;
+	grid->outsideCount = 0;
+	
+	int width = grid->width, cells = width*grid->height;
+	int *cellStart = grid->cellStart;
+	memset(cellStart, 0, (unsigned int)(cells + 1)*sizeof(int));
+	
+	// Count the entries in each cell, offset by one so that the prefix sum leaves the start of each cell in place.
+	for(int i=0; i<count; i++){
+		if(!cpBBContainsBB(grid->bounds, bbs[i])){
+			grid->outside[grid->outsideCount++] = i;
+			continue;
+		}
+		
+		CellRange range = ranges[i] = CellRangeForBB(grid, bbs[i]);
+		for(int y=range.b; y<=range.t; y++){
+			for(int x=range.l; x<=range.r; x++) cellStart[y*width + x + 1]++;
+		}
+	}
+	
+	for(int c=0; c<cells; c++) cellStart[c + 1] += cellStart[c];
+	
+	int total = cellStart[cells];
+	if(total > grid->entries_max){
+		grid->entries_max = (total > 2*grid->entries_max ? total : 2*grid->entries_max);
+		cpAllocatorFree(grid->spatialIndex.allocator, grid->entries);
+		grid->entries = (GridEntry *)cpAllocatorCalloc(grid->spatialIndex.allocator, (unsigned int)grid->entries_max, sizeof(GridEntry));
+	}
+	
+	// Fill in the entries using the cell starts as cursors, which leaves each cell's start at the start of the next.
+	GridEntry *entries = grid->entries;
+	for(int i=0, k=0; i<count; i++){
+		if(k < grid->outsideCount && grid->outside[k] == i){
+			k++;
+			continue;
+		}
+		
+		CellRange range = ranges[i];
+		GridEntry entry = {bbs[i], i};
+		for(int y=range.b; y<=range.t; y++){
+			for(int x=range.l; x<=range.r; x++) entries[cellStart[y*width + x]++] = entry;
+		}
+	}
+	
+	memmove(cellStart + 1, cellStart, (unsigned int)cells*sizeof(int));
+	cellStart[0] = 0;
+}
+
+// Add an object to the end of the slots to be binned in the next rebuild.
+static void
+AppendSlot(cpUniformGrid *grid, Handle *hand)
+{
+	if(grid->count == grid->max) ResizeSlots(grid, 2*grid->max);
+	
+	int slot = grid->count++;
+	grid->handles[slot] = hand;
+	grid->bbs[slot] = grid->spatialIndex.bbfunc(hand->obj);
+	hand->slot = slot;
+}
+
+//MARK: Basic Operations
+
+static int
+cpUniformGridCount(cpUniformGrid *grid)
+{
+	return cpHashSetCount(grid->handleSet);
+}
+
+static void
+cpUniformGridEach(cpUniformGrid *grid, cpSpatialIndexIteratorFunc func, void *data)
+{
+	for(int i=0; i<grid->count; i++){
+		Handle *hand = grid->handles[i];
+		if(hand) func(hand->obj, data);
+	}
+}
+
+static int
+cpUniformGridContains(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	return cpHashSetFind(grid->handleSet, hashid, obj) != NULL;
+}
+
+static void
+cpUniformGridInsert(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	Handle *hand = (Handle *)cpHashSetInsert(grid->handleSet, hashid, obj, (cpHashSetTransFunc)handleSetTrans, grid);
+	AppendSlot(grid, hand);
+	
+	// Queries check the unbinned objects one by one, don't let too many of them pile up between reindexes.
+	if(grid->count - grid->binned > grid->binned + 16) Rebuild(grid);
+}
+
+static void
+cpUniformGridRemove(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	Handle *hand = (Handle *)cpHashSetRemove(grid->handleSet, hashid, obj);
+	
+	if(hand){
+		grid->handles[hand->slot] = NULL;
+		cpArrayPush(grid->pooledHandles, hand);
+	}
+}
+
+//MARK: Reindexing Functions
+
+static void
+cpUniformGridReindexObject(cpUniformGrid *grid, void *obj, cpHashValue hashid)
+{
+	Handle *hand = (Handle *)cpHashSetFind(grid->handleSet, hashid, obj);
+	
+	if(hand){
+		// Move the object to a new slot so that it's checked with its new bounding box until the next rebuild.
+		grid->handles[hand->slot] = NULL;
+		AppendSlot(grid, hand);
+	}
+}
+
+static void
+cpUniformGridReindex(cpUniformGrid *grid)
+{
+	Rebuild(grid);
+}
+
+//MARK: Query Functions
+
+// Query the objects binned in a range of cells.
+static inline void
+QueryCells(cpUniformGrid *grid, CellRange range, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	int width = grid->width;
+	int *cellStart = grid->cellStart;
+	GridEntry *entries = grid->entries;
+	
+	for(int y=range.b; y<=range.t; y++){
+		for(int x=range.l; x<=range.r; x++){
+			int c = y*width + x;
+			for(int i=cellStart[c], end=cellStart[c + 1]; i<end; i++){
+				if(!cpBBIntersects(bb, entries[i].bb)) continue;
+				
+				int slot = entries[i].slot;
+				Handle *hand = grid->handles[slot];
+				if(hand && hand->obj != obj && FirstSharedCell(range, grid->ranges[slot], x, y)) func(obj, hand->obj, 0, data);
+			}
+		}
+	}
+}
+
+// Query the objects that aren't in the cells one by one.
+// Checks the slots listed in slots[start, end) or the slots from start to end when slots is NULL.
+static inline void
+QuerySlots(cpUniformGrid *grid, int *slots, int start, int end, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	for(int i=start; i<end; i++){
+		int slot = (slots ? slots[i] : i);
+		Handle *hand = grid->handles[slot];
+		if(hand && hand->obj != obj && cpBBIntersects(bb, grid->bbs[slot])) func(obj, hand->obj, 0, data);
+	}
+}
+
+static void
+cpUniformGridQuery(cpUniformGrid *grid, void *obj, cpBB bb, cpSpatialIndexQueryFunc func, void *data)
+{
+	if(cpBBIntersects(grid->bounds, bb)) QueryCells(grid, CellRangeForBB(grid, bb), obj, bb, func, data);
+	
+	QuerySlots(grid, grid->outside, 0, grid->outsideCount, obj, bb, func, data);
+	QuerySlots(grid, NULL, grid->binned, grid->count, obj, bb, func, data);
+}
+
+static inline cpFloat
+SegmentQuerySlot(cpUniformGrid *grid, int slot, cpBB bb, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	Handle *hand = grid->handles[slot];
+	
+	// Objects that cover several cells are stamped the first time they are found.
+	if(hand && hand->stamp != grid->stamp && cpBBSegmentQuery(bb, a, b) < t_exit){
+		hand->stamp = grid->stamp;
+		return cpfmin(t_exit, func(obj, hand->obj, data));
+	} else {
+		return t_exit;
+	}
+}
+
+// Find the range of the segment from a to b that is inside the bounding box.
+static inline cpBool
+ClipSegment(cpBB bb, cpVect a, cpVect b, cpFloat *t0, cpFloat *t1)
+{
+	cpFloat tmin = 0.0f, tmax = 1.0f;
+	cpVect delta = cpvsub(b, a);
+	
+	if(delta.x == 0.0f){
+		if(a.x < bb.l || bb.r < a.x) return cpFalse;
+	} else {
+		cpFloat tl = (bb.l - a.x)/delta.x, tr = (bb.r - a.x)/delta.x;
+		tmin = cpfmax(tmin, cpfmin(tl, tr));
+		tmax = cpfmin(tmax, cpfmax(tl, tr));
+	}
+	
+	if(delta.y == 0.0f){
+		if(a.y < bb.b || bb.t < a.y) return cpFalse;
+	} else {
+		cpFloat tb = (bb.b - a.y)/delta.y, tt = (bb.t - a.y)/delta.y;
+		tmin = cpfmax(tmin, cpfmin(tb, tt));
+		tmax = cpfmin(tmax, cpfmax(tb, tt));
+	}
+	
+	(*t0) = tmin;
+	(*t1) = tmax;
+	return (tmin <= tmax);
+}
+
+// Walks the cells the segment passes through, similar to cpSpaceHashSegmentQuery().
+static void
+cpUniformGridSegmentQuery(cpUniformGrid *grid, void *obj, cpVect a, cpVect b, cpFloat t_exit, cpSpatialIndexSegmentQueryFunc func, void *data)
+{
+	cpFloat t0, t1;
+	if(ClipSegment(grid->bounds, a, b, &t0, &t1) && t0 < t_exit){
+		int width = grid->width, height = grid->height;
+		int *cellStart = grid->cellStart;
+		GridEntry *entries = grid->entries;
+		
+		// The segment in cell coordinates.
+		cpFloat inv = 1.0f/grid->celldim;
+		cpVect ga = cpvmult(cpvsub(a, cpv(grid->bounds.l, grid->bounds.b)), inv);
+		cpVect gb = cpvmult(cpvsub(b, cpv(grid->bounds.l, grid->bounds.b)), inv);
+		cpFloat dx = gb.x - ga.x, dy = gb.y - ga.y;
+		
+		cpVect start = cpvlerp(ga, gb, t0);
+		int x = ClampCell(start.x, width), y = ClampCell(start.y, height);
+		int x_inc = (dx > 0.0f ? 1 : -1), y_inc = (dy > 0.0f ? 1 : -1);
+		
+		// Division by zero is *very* slow on ARM
+		cpFloat dt_dx = (dx ? 1.0f/cpfabs(dx) : INFINITY), dt_dy = (dy ? 1.0f/cpfabs(dy) : INFINITY);
+		
+		// The times the segment crosses into the next column and row of cells.
+		cpFloat next_h = (dx ? ((dx > 0.0f ? x + 1 : x) - ga.x)/dx : INFINITY);
+		cpFloat next_v = (dy ? ((dy > 0.0f ? y + 1 : y) - ga.y)/dy : INFINITY);
+		
+		for(cpFloat t = t0; t < t_exit && t <= t1;){
+			int c = y*width + x;
+			for(int i=cellStart[c], end=cellStart[c + 1]; i<end; i++){
+				t_exit = SegmentQuerySlot(grid, entries[i].slot, entries[i].bb, obj, a, b, t_exit, func, data);
+			}
+			
+			if(next_v < next_h){
+				y += y_inc;
+				t = next_v;
+				next_v += dt_dy;
+				if(y < 0 || height <= y) break;
+			} else {
+				x += x_inc;
+				t = next_h;
+				next_h += dt_dx;
+				if(x < 0 || width <= x) break;
+			}
+		}
+	}
+	
+	for(int i=0; i<grid->outsideCount; i++){
+		int slot = grid->outside[i];
+		t_exit = SegmentQuerySlot(grid, slot, grid->bbs[slot], obj, a, b, t_exit, func, data);
+	}
+	
+	for(int i=grid->binned; i<grid->count; i++) t_exit = SegmentQuerySlot(grid, i, grid->bbs[i], obj, a, b, t_exit, func, data);
+	
+	grid->stamp++;
+}
+
+static void
+cpUniformGridReindexQuery(cpUniformGrid *grid, cpSpatialIndexQueryFunc func, void *data)
+{
+	Rebuild(grid);
+	
+	int width = grid->width, height = grid->height;
+	int *cellStart = grid->cellStart;
+	GridEntry *entries = grid->entries;
+	CellRange *ranges = grid->ranges;
+	Handle **handles = grid->handles;
+	
+	// Check the pairs of entries in each cell.
+	for(int y=0; y<height; y++){
+		for(int x=0; x<width; x++){
+			int c = y*width + x;
+			for(int i=cellStart[c], end=cellStart[c + 1]; i<end; i++){
+				cpBB bb = entries[i].bb;
+				int slot = entries[i].slot;
+				
+				for(int j=i+1; j<end; j++){
+					int other = entries[j].slot;
+					if(cpBBIntersects(bb, entries[j].bb) && FirstSharedCell(ranges[slot], ranges[other], x, y)){
+						func(handles[slot]->obj, handles[other]->obj, 0, data);
+					}
+				}
+			}
+		}
+	}
+	
+	// Check the objects outside of the bounds against the cells and each other.
+	for(int i=0; i<grid->outsideCount; i++){
+		int slot = grid->outside[i];
+		cpBB bb = grid->bbs[slot];
+		void *obj = handles[slot]->obj;
+		
+		if(cpBBIntersects(grid->bounds, bb)) QueryCells(grid, CellRangeForBB(grid, bb), obj, bb, func, data);
+		QuerySlots(grid, grid->outside, i + 1, grid->outsideCount, obj, bb, func, data);
+	}
+	
+	cpSpatialIndexCollideStatic((cpSpatialIndex *)grid, grid->spatialIndex.staticIndex, func, data);
+}
+
+//MARK: Misc
+
+void
+cpUniformGridResize(cpUniformGrid *grid, cpFloat celldim, cpBB bounds)
+{
+	if(grid->spatialIndex.klass != Klass()){
+		cpAssertWarn(cpFalse, "Ignoring cpUniformGridResize() call to non-cpUniformGrid spatial index.");
+		return;
+	}
+	
+	AllocCells(grid, celldim, bounds);
+	Rebuild(grid);
+}
+
+static cpSpatialIndexClass klass = {
+	(cpSpatialIndexDestroyImpl)cpUniformGridDestroy,
+	
+	(cpSpatialIndexCountImpl)cpUniformGridCount,
+	(cpSpatialIndexEachImpl)cpUniformGridEach,
+	(cpSpatialIndexContainsImpl)cpUniformGridContains,
+	
+	(cpSpatialIndexInsertImpl)cpUniformGridInsert,
+	(cpSpatialIndexRemoveImpl)cpUniformGridRemove,
+	
+	(cpSpatialIndexReindexImpl)cpUniformGridReindex,
+	(cpSpatialIndexReindexObjectImpl)cpUniformGridReindexObject,
+	(cpSpatialIndexReindexQueryImpl)cpUniformGridReindexQuery,
+	
+	(cpSpatialIndexQueryImpl)cpUniformGridQuery,
+	(cpSpatialIndexSegmentQueryImpl)cpUniformGridSegmentQuery,
+};
+
+static inline cpSpatialIndexClass *Klass(){return &klass;}